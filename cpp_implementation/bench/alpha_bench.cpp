@@ -0,0 +1,103 @@
+// Micro-benchmark for the alpha-fraction kernels in src/alpha.h.
+//
+// Compares the original vector-based implementation of Acid::alpha (four heap
+// allocations, partial_sum and pow per call) against alpha_kernel and the batched
+// alpha_kernel_batch, for mono- to hexaprotic acids.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <numeric>
+#include <vector>
+
+#include "../src/alpha.h"
+
+static std::vector<double> legacy_alpha(const std::vector<double> &Ka_temp, double pH) {
+    double h3o = std::pow(10, -pH);
+    std::vector<double> h3o_pow(Ka_temp.size());
+    std::vector<double> Ka_prod(Ka_temp.size());
+
+    for (size_t i = 0; i < Ka_temp.size(); ++i) {
+        h3o_pow[i] = std::pow(h3o, Ka_temp.size() - 1 - i);
+    }
+
+    std::partial_sum(Ka_temp.begin(), Ka_temp.end(), Ka_prod.begin(), std::multiplies<double>());
+
+    std::vector<double> h3o_Ka(Ka_temp.size());
+    for (size_t i = 0; i < Ka_temp.size(); ++i) {
+        h3o_Ka[i] = h3o_pow[i] * Ka_prod[i];
+    }
+
+    double den = std::accumulate(h3o_Ka.begin(), h3o_Ka.end(), 0.0);
+    std::vector<double> result(Ka_temp.size());
+    for (size_t i = 0; i < Ka_temp.size(); ++i) {
+        result[i] = h3o_Ka[i] / den;
+    }
+
+    return result;
+}
+
+template <class F>
+static double time_ns(F f, size_t calls) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / calls;
+}
+
+int main() {
+    const size_t n_points = 4096;
+    const int repeats = 200;
+    const size_t calls = n_points * repeats;
+
+    std::vector<double> pH(n_points), h3o(n_points);
+    for (size_t p = 0; p < n_points; ++p) {
+        pH[p] = 14.0 * p / (n_points - 1);
+        h3o[p] = std::pow(10, -pH[p]);
+    }
+
+    printf("%-6s %14s %14s %14s\n", "n_Ka", "legacy ns", "kernel ns", "batch ns");
+    for (int n_Ka = 1; n_Ka <= 6; ++n_Ka) {
+        std::vector<double> Ka(n_Ka);
+        for (int i = 0; i < n_Ka; ++i) {
+            Ka[i] = std::pow(10, -(2.0 + 2.0 * i));
+        }
+        std::vector<double> Ka_temp(1, 1.0);
+        Ka_temp.insert(Ka_temp.end(), Ka.begin(), Ka.end());
+        std::vector<double> Ka_prod = ka_cumulative_products(Ka);
+        size_t n_terms = Ka_prod.size();
+
+        volatile double sink = 0.0;
+
+        double legacy = time_ns([&]() {
+            for (int r = 0; r < repeats; ++r) {
+                for (size_t p = 0; p < n_points; ++p) {
+                    sink = sink + legacy_alpha(Ka_temp, pH[p])[0];
+                }
+            }
+        }, calls);
+
+        double kernel = time_ns([&]() {
+            double out[kMaxAlphaTerms];
+            for (int r = 0; r < repeats; ++r) {
+                for (size_t p = 0; p < n_points; ++p) {
+                    alpha_kernel(Ka_prod.data(), n_terms, std::pow(10, -pH[p]), out);
+                    sink = sink + out[0];
+                }
+            }
+        }, calls);
+
+        std::vector<double> out(n_terms * n_points), h_pow(n_points), den(n_points);
+        double batch = time_ns([&]() {
+            for (int r = 0; r < repeats; ++r) {
+                alpha_kernel_batch(Ka_prod.data(), n_terms, h3o.data(), n_points, out.data(), h_pow.data(), den.data());
+                sink = sink + out[r];
+            }
+        }, calls);
+
+        printf("%-6d %14.2f %14.2f %14.2f\n", n_Ka, legacy, kernel, batch);
+    }
+
+    return 0;
+}
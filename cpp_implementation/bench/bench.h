@@ -0,0 +1,109 @@
+#ifndef PH_BENCH_H
+#define PH_BENCH_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// Small benchmark harness in the spirit of Google Benchmark: every case is timed with an
+// iteration count grown until it runs for at least `min_seconds`, and may report counters
+// (evaluations, allocations, ...) per operation next to ns/op.
+
+namespace bench {
+
+struct State {
+    size_t iterations;
+    std::map<std::string, double> counters;  // totals over all iterations, reported per op
+};
+
+struct Case {
+    std::string name;
+    std::function<void(State &)> run;
+};
+
+struct Measurement {
+    std::string name;
+    double ns_per_op;
+    size_t iterations;
+    std::map<std::string, double> per_op;
+};
+
+inline std::vector<Case> &registry() {
+    static std::vector<Case> cases;
+    return cases;
+}
+
+inline void add(const std::string &name, const std::function<void(State &)> &run) {
+    Case c = {name, run};
+    registry().push_back(c);
+}
+
+inline Measurement measure(const Case &c, double min_seconds) {
+    State state;
+    state.iterations = 1;
+    double seconds = 0.0;
+    for (;;) {
+        state.counters.clear();
+        auto start = std::chrono::steady_clock::now();
+        c.run(state);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds >= min_seconds || state.iterations >= (size_t(1) << 30)) {
+            break;
+        }
+        double grow = seconds > 0 ? 1.4 * min_seconds / seconds : 10.0;
+        state.iterations = static_cast<size_t>(state.iterations * (grow < 10.0 ? (grow > 1.5 ? grow : 1.5) : 10.0)) + 1;
+    }
+
+    Measurement m;
+    m.name = c.name;
+    m.iterations = state.iterations;
+    m.ns_per_op = 1e9 * seconds / state.iterations;
+    for (const auto &counter : state.counters) {
+        m.per_op[counter.first] = counter.second / state.iterations;
+    }
+    return m;
+}
+
+// Reads a CSV written by write_csv: name,ns_per_op,...
+inline std::map<std::string, double> read_baseline(const std::string &path) {
+    std::map<std::string, double> baseline;
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f) {
+        return baseline;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        std::string s(line);
+        size_t comma = s.find(',');
+        if (comma == std::string::npos || s.compare(0, comma, "name") == 0) {
+            continue;
+        }
+        baseline[s.substr(0, comma)] = std::strtod(s.c_str() + comma + 1, nullptr);
+    }
+    fclose(f);
+    return baseline;
+}
+
+inline void write_csv(const std::string &path, const std::vector<Measurement> &results) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path.c_str());
+        return;
+    }
+    fprintf(f, "name,ns_per_op,evaluations_per_op,allocations_per_op\n");
+    for (const auto &m : results) {
+        auto evals = m.per_op.find("evaluations");
+        auto allocs = m.per_op.find("allocations");
+        fprintf(f, "%s,%.3f,%.3f,%.3f\n", m.name.c_str(), m.ns_per_op, evals == m.per_op.end() ? 0.0 : evals->second,
+                allocs == m.per_op.end() ? 0.0 : allocs->second);
+    }
+    fclose(f);
+}
+
+}  // namespace bench
+
+#endif  // PH_BENCH_H
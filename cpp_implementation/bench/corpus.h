@@ -0,0 +1,80 @@
+#ifndef PH_BENCH_CORPUS_H
+#define PH_BENCH_CORPUS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/CBE.h"
+#include "../src/PBE.h"
+
+// Reproducible mixture corpora for the benchmarks. A corpus is fully determined by its
+// spec and seed, so numbers from two builds are measured on identical inputs.
+
+namespace bench {
+
+struct SpeciesSpec {
+    std::vector<double> pKa;  // sorted ascending
+    int charge;               // charge of the fully protonated form (CBE)
+    int proton_ref;           // reference level (PBE)
+    double conc;
+};
+
+struct CorpusSpec {
+    std::string name;
+    int min_Ka, max_Ka;         // protic order range, 1 = monoprotic
+    double pKa_lo, pKa_hi;      // pKa values drawn uniformly from this range
+    double lconc_lo, lconc_hi;  // log10 concentrations drawn uniformly from this range
+};
+
+inline std::vector<CorpusSpec> standard_corpora() {
+    std::vector<CorpusSpec> corpora;
+    corpora.push_back({"mono", 1, 1, 2.0, 12.0, -4.0, -1.0});
+    corpora.push_back({"mixed", 1, 6, 1.0, 13.0, -4.0, -1.0});
+    corpora.push_back({"hexa", 6, 6, 1.0, 13.0, -4.0, -1.0});
+    corpora.push_back({"extreme", 1, 6, -2.0, 16.0, -9.0, 0.7});
+    return corpora;
+}
+
+inline std::vector<SpeciesSpec> make_mixture(const CorpusSpec &spec, size_t n_species, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> order(spec.min_Ka, spec.max_Ka);
+    std::uniform_real_distribution<double> pKa(spec.pKa_lo, spec.pKa_hi);
+    std::uniform_real_distribution<double> lconc(spec.lconc_lo, spec.lconc_hi);
+
+    std::vector<SpeciesSpec> mixture(n_species);
+    for (auto &s : mixture) {
+        int n = order(rng);
+        for (int i = 0; i < n; ++i) {
+            s.pKa.push_back(pKa(rng));
+        }
+        std::sort(s.pKa.begin(), s.pKa.end());
+        s.charge = std::uniform_int_distribution<int>(0, n)(rng);
+        s.proton_ref = std::uniform_int_distribution<int>(0, n)(rng);
+        s.conc = std::pow(10, lconc(rng));
+    }
+    return mixture;
+}
+
+inline std::vector<Acid> cbe_species(const std::vector<SpeciesSpec> &mixture) {
+    std::vector<Acid> species;
+    for (const auto &s : mixture) {
+        species.push_back(Acid({}, s.pKa, s.charge, s.conc));
+    }
+    return species;
+}
+
+inline std::vector<PBE_Acid> pbe_species(const std::vector<SpeciesSpec> &mixture) {
+    std::vector<PBE_Acid> acids;
+    for (const auto &s : mixture) {
+        acids.push_back(PBE_Acid({}, s.pKa, static_cast<int>(s.pKa.size()), s.proton_ref, s.conc));
+    }
+    return acids;
+}
+
+}  // namespace bench
+
+#endif  // PH_BENCH_CORPUS_H
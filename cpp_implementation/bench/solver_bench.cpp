@@ -0,0 +1,278 @@
+// Benchmark suite for the solver hot paths: alpha fractions, residual evaluation, the
+// guess-free bracket search that replaced the initial-guess scan, cache hits, in-place
+// updates and complete solves, on the generated corpora of corpus.h (mono- to hexaprotic, 1 to 500 species, extreme
+// pKa spreads and concentrations), and the same on a thread pool for mixtures of up to
+// 4000 species.
+//
+// Usage: solver_bench [filter] [--min-time S] [--csv out.csv] [--baseline old.csv] [--max-ratio R]
+// With a baseline, cases slower than R times their baseline ns/op (default 1.2) are flagged
+// and the exit status is 1.
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "../src/ph.h"
+#include "bench.h"
+#include "corpus.h"
+
+// Heap allocations are counted by replacing the global operator new for this program.
+static std::atomic<size_t> g_allocations(0);
+
+void *operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+static const uint64_t kSeed = 20240611;
+static const size_t kMixtures = 64;  // mixtures per corpus and size, cycled through by the solve cases
+
+static volatile double g_sink = 0.0;
+
+static void register_alpha() {
+    for (int n_Ka = 1; n_Ka <= 6; ++n_Ka) {
+        std::vector<double> pKa;
+        for (int i = 0; i < n_Ka; ++i) {
+            pKa.push_back(2.0 + 2.0 * i);
+        }
+        Acid acid({}, pKa, n_Ka, 0.01);
+
+        bench::add("alpha/vector/" + std::to_string(n_Ka), [acid](bench::State &state) {
+            size_t allocs = g_allocations;
+            for (size_t it = 0; it < state.iterations; ++it) {
+                g_sink = g_sink + acid.alpha(14.0 * (it & 1023) / 1023)[0];
+            }
+            state.counters["allocations"] = double(g_allocations - allocs);
+        });
+        bench::add("alpha/kernel/" + std::to_string(n_Ka), [acid](bench::State &state) {
+            double out[kMaxAlphaTerms];
+            size_t allocs = g_allocations;
+            for (size_t it = 0; it < state.iterations; ++it) {
+                acid.alpha_at_h3o(std::pow(10, -14.0 * (it & 1023) / 1023), out);
+                g_sink = g_sink + out[0];
+            }
+            state.counters["allocations"] = double(g_allocations - allocs);
+        });
+    }
+}
+
+template <class Calc, class Species>
+static void register_residual(const std::string &balance, const std::vector<Species> &species, const std::string &label,
+                              WorkStealingPool *pool = nullptr) {
+    std::shared_ptr<Calc> calc(new Calc(species));
+    calc->set_pool(pool);
+    bench::add(balance + (pool ? "/residual_pool/" : "/residual/") + label, [calc](bench::State &state) {
+        size_t allocs = g_allocations;
+        double d;
+        for (size_t it = 0; it < state.iterations; ++it) {
+            g_sink = g_sink + calc->get_system().residual(14.0 * (it & 1023) / 1023, &d);
+        }
+        state.counters["allocations"] = double(g_allocations - allocs);
+    });
+}
+
+// `guess_est` times the bracket search over the whole pH range (the former 1500-point scan);
+// otherwise the solve starts from pH 7 as pH_calc does without an estimate.
+template <class Calc, class Species>
+static void register_solve(const std::string &name, const std::vector<std::vector<Species> > &corpus, bool guess_est,
+                           WorkStealingPool *pool = nullptr) {
+    std::shared_ptr<std::vector<Calc> > calcs(new std::vector<Calc>());
+    for (const auto &species : corpus) {
+        calcs->push_back(Calc(species));
+        calcs->back().set_pool(pool);
+    }
+    bench::add(name, [calcs, guess_est](bench::State &state) {
+        size_t allocs = g_allocations;
+        double evaluations = 0.0;
+        for (size_t it = 0; it < state.iterations; ++it) {
+            SolveResult r = (*calcs)[it % calcs->size()].solve(7.0, guess_est, 1500, 1e-12);
+            evaluations += r.evaluations;
+            g_sink = g_sink + r.pH;
+        }
+        state.counters["evaluations"] = evaluations;
+        state.counters["allocations"] = double(g_allocations - allocs);
+    });
+}
+
+// Repeated solves of already cached mixtures: key construction plus lookup.
+template <class Calc, class Species>
+static void register_cache_hit(const std::string &name, const std::vector<std::vector<Species> > &corpus) {
+    std::shared_ptr<std::vector<Calc> > calcs(new std::vector<Calc>());
+    std::shared_ptr<SolveCache> cache(new SolveCache());
+    for (const auto &species : corpus) {
+        calcs->push_back(Calc(species));
+        cache->solve(calcs->back());
+    }
+    bench::add(name, [calcs, cache](bench::State &state) {
+        size_t allocs = g_allocations;
+        double evaluations = 0.0;
+        for (size_t it = 0; it < state.iterations; ++it) {
+            SolveResult r = cache->solve((*calcs)[it % calcs->size()]);
+            evaluations += r.evaluations;
+            g_sink = g_sink + r.pH;
+        }
+        state.counters["evaluations"] = evaluations;
+        state.counters["allocations"] = double(g_allocations - allocs);
+    });
+}
+
+// Dosing-controller pattern: one concentration changed by 1% in place, then re-solved from
+// the last root through MixtureHandle.
+template <class Calc, class Species>
+static void register_update(const std::string &name, const std::vector<Species> &species) {
+    std::shared_ptr<MixtureHandle<Calc, Species> > mixture(new MixtureHandle<Calc, Species>(species));
+    mixture->solve();
+    bench::add(name, [mixture, species](bench::State &state) {
+        size_t allocs = g_allocations;
+        double evaluations = 0.0;
+        for (size_t it = 0; it < state.iterations; ++it) {
+            size_t s = (it / 2) % species.size();
+            mixture->set_conc(s, species[s].get_conc() * (it & 1 ? 1.0 : 1.01));
+            const SolveResult &r = mixture->solve();
+            evaluations += r.evaluations;
+            g_sink = g_sink + r.pH;
+        }
+        state.counters["evaluations"] = evaluations;
+        state.counters["allocations"] = double(g_allocations - allocs);
+    });
+}
+
+// Complete API call: species copy, system construction, solve and alpha fractions.
+template <class Species, class Solve>
+static void register_api(const std::string &name, const std::vector<std::vector<Species> > &corpus, const Solve &solve) {
+    bench::add(name, [corpus, solve](bench::State &state) {
+        size_t allocs = g_allocations;
+        double evaluations = 0.0;
+        for (size_t it = 0; it < state.iterations; ++it) {
+            PhResult r = solve(corpus[it % corpus.size()]);
+            evaluations += r.evaluations;
+            g_sink = g_sink + r.pH;
+        }
+        state.counters["evaluations"] = evaluations;
+        state.counters["allocations"] = double(g_allocations - allocs);
+    });
+}
+
+static void register_corpora() {
+    const size_t sizes[] = {1, 10, 100, 500};
+    for (const auto &spec : bench::standard_corpora()) {
+        for (size_t n : sizes) {
+            std::vector<std::vector<Acid> > cbe;
+            std::vector<std::vector<PBE_Acid> > pbe;
+            size_t mixtures = n >= 100 ? kMixtures / 8 : kMixtures;
+            for (size_t m = 0; m < mixtures; ++m) {
+                std::vector<bench::SpeciesSpec> mixture = bench::make_mixture(spec, n, kSeed + 1000003 * n + m);
+                cbe.push_back(bench::cbe_species(mixture));
+                pbe.push_back(bench::pbe_species(mixture));
+            }
+
+            std::string label = spec.name + "/" + std::to_string(n);
+            register_residual<CBE_calc>("cbe", cbe[0], label);
+            register_residual<PBE_calc>("pbe", pbe[0], label);
+            register_solve<CBE_calc>("cbe/scan/" + label, cbe, true);
+            register_solve<PBE_calc>("pbe/scan/" + label, pbe, true);
+            register_solve<CBE_calc>("cbe/solve/" + label, cbe, false);
+            register_solve<PBE_calc>("pbe/solve/" + label, pbe, false);
+            register_cache_hit<CBE_calc>("cbe/cache_hit/" + label, cbe);
+            register_update<CBE_calc>("cbe/update/" + label, cbe[0]);
+            register_api("cbe/api/" + label, cbe, [](const std::vector<Acid> &s) { return solve_cbe(s); });
+            register_api("pbe/api/" + label, pbe, [](const std::vector<PBE_Acid> &s) { return solve_pbe(s); });
+        }
+    }
+}
+
+// Large mixtures, serially and split over a pool of all cores, for the speedup of one solve.
+static void register_parallel(WorkStealingPool *pool) {
+    const size_t sizes[] = {1000, 4000};
+    const bench::CorpusSpec spec = bench::standard_corpora()[1];  // mixed
+    for (size_t n : sizes) {
+        std::vector<std::vector<Acid> > cbe;
+        for (size_t m = 0; m < 4; ++m) {
+            cbe.push_back(bench::cbe_species(bench::make_mixture(spec, n, kSeed + 1000003 * n + m)));
+        }
+
+        std::string label = spec.name + "/" + std::to_string(n);
+        register_residual<CBE_calc>("cbe", cbe[0], label);
+        register_residual<CBE_calc>("cbe", cbe[0], label, pool);
+        register_solve<CBE_calc>("cbe/scan/" + label, cbe, true);
+        register_solve<CBE_calc>("cbe/scan_pool/" + label, cbe, true, pool);
+        register_solve<CBE_calc>("cbe/solve/" + label, cbe, false);
+        register_solve<CBE_calc>("cbe/solve_pool/" + label, cbe, false, pool);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string filter, csv, baseline_path;
+    double min_time = 0.1, max_ratio = 1.2;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--min-time" && i + 1 < argc) {
+            min_time = std::strtod(argv[++i], nullptr);
+        } else if (arg == "--csv" && i + 1 < argc) {
+            csv = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--max-ratio" && i + 1 < argc) {
+            max_ratio = std::strtod(argv[++i], nullptr);
+        } else {
+            filter = arg;
+        }
+    }
+
+    WorkStealingPool pool;
+    register_alpha();
+    register_corpora();
+    register_parallel(&pool);
+    std::map<std::string, double> baseline = bench::read_baseline(baseline_path);
+
+    printf("%-32s %14s %12s %12s %10s\n", "case", "ns/op", "evals/op", "allocs/op", "vs base");
+    std::vector<bench::Measurement> results;
+    int regressions = 0;
+    for (const auto &c : bench::registry()) {
+        if (!filter.empty() && c.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        bench::Measurement m = bench::measure(c, min_time);
+        results.push_back(m);
+
+        auto evals = m.per_op.find("evaluations");
+        auto allocs = m.per_op.find("allocations");
+        printf("%-32s %14.1f", m.name.c_str(), m.ns_per_op);
+        if (evals == m.per_op.end()) {
+            printf(" %12s", "-");
+        } else {
+            printf(" %12.2f", evals->second);
+        }
+        printf(" %12.2f", allocs == m.per_op.end() ? 0.0 : allocs->second);
+        auto base = baseline.find(m.name);
+        if (base != baseline.end() && base->second > 0) {
+            double ratio = m.ns_per_op / base->second;
+            printf(" %9.2fx%s", ratio, ratio > max_ratio ? "  REGRESSION" : "");
+            regressions += ratio > max_ratio ? 1 : 0;
+        }
+        printf("\n");
+    }
+
+    if (!csv.empty()) {
+        bench::write_csv(csv, results);
+    }
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+// Minimal program embedding the solver through libph: 0.01 M (NH4)3PO4, solved with both
+// balance equations, the amount of HCl that brings it to pH 7, and the pH along additions of
+// NaOH followed in place.
+// Build with: g++ -std=c++11 -Isrc examples/solve_example.cpp exec/libph.a
+#include <cstdio>
+#include <vector>
+
+#include "ph.h"
+
+int main() {
+    std::vector<Acid> species = {Acid({}, {1.97, 6.82, 12.5}, 0, 0.01), Acid({}, {9.25}, 1, 0.03)};
+
+    PhResult ideal = solve_cbe(species);
+    PhOptions options;
+    options.activity = ActivityModel(ActivityModel::kDavies);
+    PhResult davies = solve_cbe(species, 1.01e-14, options);
+
+    std::vector<PBE_Acid> acids = {PBE_Acid({}, {1.97, 6.82, 12.5}, 3, 0, 0.01), PBE_Acid({}, {9.25}, 1, 1, 0.03)};
+    PhResult pbe = solve_pbe(acids);
+
+    std::vector<Acid> hcl = {Acid({}, {-10}, 0, 1.0)};  // 1 M of Cl-, the anion of a strong acid
+    DoseResult dose = dose_cbe(species, hcl, {7.0})[0];
+
+    // Na+ of the added NaOH as a species of its own (pKa 50 as in the species database),
+    // raised in place and re-solved each time.
+    MixtureHandle<CBE_calc, Acid> mixture(species);
+    mixture.solve();
+    size_t sodium = mixture.add_species(Acid({}, {50}, 1, 0.0));
+    std::vector<double> titrated;
+    for (int step = 1; step <= 4; ++step) {
+        mixture.set_conc(sodium, 0.005 * step);
+        titrated.push_back(mixture.solve().pH);
+    }
+
+    printf("CBE pH %.12f (%d evaluations, condition %.2f), Davies pH %.12f at I = %.4e, PBE pH %.12f\n", ideal.pH,
+           ideal.evaluations, ideal.condition, davies.pH, davies.ionic_strength, pbe.pH);
+    for (size_t s = 0; s < ideal.alphas.size(); ++s) {
+        printf("Species %zu:", s + 1);
+        for (double a : ideal.alphas[s]) {
+            printf(" %.6e", a);
+        }
+        printf("\n");
+    }
+    printf("HCl to reach pH 7: %.6e M\n", dose.dose);
+    printf("pH with 5 to 20 mM NaOH:");
+    for (double pH : titrated) {
+        printf(" %.6f", pH);
+    }
+    printf("\n");
+    return ideal.converged && davies.converged && pbe.converged && dose.reachable && mixture.get_result().converged ? 0 : 1;
+}
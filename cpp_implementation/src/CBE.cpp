@@ -1,3 +1,6 @@
+// Counts the heap allocations of traced solves, see trace.h.
+#define PH_TRACE_MAIN
+
 // #include <iostream>
 #include <algorithm>
 #include <cmath>
@@ -5,170 +8,17 @@
 #include <limits>
 #include <numeric>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
-class Acid {
-   public:
-    Acid(const std::vector<double> &Ka, const std::vector<double> &pKa, int charge, double conc)
-        : charge(charge), conc(conc) {
-        if (Ka.empty() && pKa.empty()) {
-            throw std::invalid_argument("You must define either Ka or pKa values.");
-        }
-        // if (charge == 0) {
-        //     throw std::invalid_argument("The maximum charge for this acid must be defined.");
-        // }
-
-        if (Ka.empty()) {
-            this->pKa = pKa;
-            std::sort(this->pKa.begin(), this->pKa.end());
-            this->Ka.resize(this->pKa.size());
-            std::transform(this->pKa.begin(), this->pKa.end(), this->Ka.begin(), [](double pKa) { return std::pow(10, -pKa); });
-        } else {
-            this->Ka = Ka;
-            std::sort(this->Ka.begin(), this->Ka.end(), std::greater<double>());
-            this->pKa.resize(this->Ka.size());
-            std::transform(this->Ka.begin(), this->Ka.end(), this->pKa.begin(), [](double Ka) { return -std::log10(Ka); });
-        }
-
-        _Ka_temp.push_back(1.0);
-        _Ka_temp.insert(_Ka_temp.end(), this->Ka.begin(), this->Ka.end());
-
-        for (int i = 0; i <= this->Ka.size(); ++i) {
-            this->charge_vector.push_back(charge - i);
-        }
-    }
-
-    std::vector<double> alpha(double pH) const {
-        double h3o = std::pow(10, -pH);
-        std::vector<double> h3o_pow(_Ka_temp.size());
-        std::vector<double> Ka_prod(_Ka_temp.size());
-
-        for (size_t i = 0; i < _Ka_temp.size(); ++i) {
-            h3o_pow[i] = std::pow(h3o, _Ka_temp.size() - 1 - i);
-        }
-
-        std::partial_sum(_Ka_temp.begin(), _Ka_temp.end(), Ka_prod.begin(), std::multiplies<double>());
-
-        std::vector<double> h3o_Ka(_Ka_temp.size());
-        for (size_t i = 0; i < _Ka_temp.size(); ++i) {
-            h3o_Ka[i] = h3o_pow[i] * Ka_prod[i];
-        }
-
-        double den = std::accumulate(h3o_Ka.begin(), h3o_Ka.end(), 0.0);
-        std::vector<double> result(_Ka_temp.size());
-        std::transform(h3o_Ka.begin(), h3o_Ka.end(), result.begin(), [den](double val) { return val / den; });
-
-        return result;
-    }
-
-    inline void print_acid_data() const {
-        if (pKa.empty()) {
-            printf("Ka values: ");
-            for (const auto &val : Ka) {
-                printf("%.2e ", val);
-            }
-            printf("\n");
-        } else {
-            printf("pKa values: ");
-            for (const auto &val : pKa) {
-                printf("%.2f ", val);
-            }
-            printf("\n");
-        }
-
-        printf("Charge: %d\n", charge);
-        printf("Concentration: %.2e\n", conc);
-    }
-
-    double get_conc() const {
-        return conc;
-    }
-
-    const std::vector<int> &get_charge_vector() const {
-        return charge_vector;
-    }
-
-   private:
-    std::vector<double> Ka;
-    std::vector<double> pKa;
-    std::vector<double> _Ka_temp;
-    std::vector<int> charge_vector;
-    int charge;
-    double conc;
-};
-
-class CBE_calc {
-   public:
-    CBE_calc(const std::vector<Acid> &species, double Kw = 1.01e-14)
-        : species(species), Kw(Kw) {}
-
-    double Charge_diff(double pH) const {
-        double h3o = std::pow(10, -pH);
-        double oh = Kw / h3o;
-        double x = h3o - oh;
-
-        for (const auto &s : species) {
-            auto alpha = s.alpha(pH);
-            for (size_t i = 0; i < alpha.size(); ++i) {
-                x += s.get_conc() * s.get_charge_vector()[i] * alpha[i];
-            }
-        }
-
-        return std::abs(x);
-    }
-
-    double pH_calc(double guess = 7.0, bool guess_est = false, int est_num = 1500, double tol = 1e-5) {
-        printf("Calculating pH...\n");
-        if (guess_est) {
-            std::vector<double> phs(est_num);
-            double step = 14.0 / (est_num - 1);
-            for (int i = 0; i < est_num; ++i) {
-                phs[i] = i * step;
-            }
-
-            double min_diff = std::numeric_limits<double>::max();
-            for (double ph : phs) {
-                double diff = Charge_diff(ph);
-                if (diff < min_diff) {
-                    min_diff = diff;
-                    guess = ph;
-                }
-            }
-        }
-
-        double pH = guess;
-        double diff = Charge_diff(pH);
-        double learning_rate = 0.001;  // Initial learning rate
-        int max_iterations = 10000;    // Maximum number of iterations to prevent infinite loop
-
-        for (int i = 0; i < max_iterations && diff > tol; ++i) {
-            double gradient = (Charge_diff(pH + tol) - diff) / tol;  // Numerical gradient
-            pH -= learning_rate * gradient;                          // Update pH using gradient descent
-            double new_diff = Charge_diff(pH);                       // Recalculate the difference
-
-            // Adjust learning rate based on the change in difference
-            if (new_diff < diff) {
-                learning_rate *= 1.05;  // Increase learning rate if getting closer
-            } else {
-                learning_rate *= 0.5;  // Decrease learning rate if getting further
-            }
-
-            diff = new_diff;  // Update the difference
-
-            // printf("Iteration: %d, pH: %.5f, diff: %.5e, gradient: %.5e, learning_rate: %.5e\n", i, pH, diff, gradient, learning_rate);
-        }
-
-        if (diff > tol) {
-            throw std::runtime_error("Failed to converge to the desired tolerance.");
-        }
-
-        return pH;
-    }
-
-   private:
-    std::vector<Acid> species;
-    double Kw;
-};
+#include "batch.h"
+#include "dose.h"
+#include "grid.h"
+#include "ph.h"
+#include "server.h"
+#include "speciation.h"
+#include "titration.h"
+#include "uncertainty.h"
 
 // int main() {
 //     // std::vector<double> Ka = {1.0e-3, 1.0e-5, 1.0e-7};
@@ -190,7 +40,35 @@ class CBE_calc {
 //     return 0;
 // }
 
-int main() {
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        auto make_acid = [](const std::vector<double> &values, bool is_pKa, int charge, int, double conc) {
+            return is_pKa ? Acid({}, values, charge, conc) : Acid(values, {}, charge, conc);
+        };
+        if (std::string(argv[1]) == "--mix" || std::string(argv[1]) == "--compile-db") {
+            return species_main<CBE_calc, Acid>(argc, argv, make_cbe_species);
+        }
+        if (std::string(argv[1]) == "--titrate") {
+            return titration_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+        }
+        if (std::string(argv[1]) == "--serve") {
+            return server_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+        }
+        if (std::string(argv[1]) == "--grid") {
+            return grid_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+        }
+        if (std::string(argv[1]) == "--uncertainty") {
+            return uncertainty_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+        }
+        if (std::string(argv[1]) == "--dose") {
+            return dose_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+        }
+        if (std::string(argv[1]) == "--speciate") {
+            return speciation_main(argc, argv);
+        }
+        return batch_main<CBE_calc, Acid>(argc, argv, 1, make_acid);
+    }
+
     printf("The program is running...\n");
     printf("Program name: Calculation of pH with Charge Balance Equation (CBE)\n");
     printf("Author: Eric Xin\n");
@@ -271,11 +149,10 @@ int main() {
     // scanf("%d", &est);
     int est = 1;
 
-    CBE_calc cbe(s, Kw);
-    double pH;
+    PhOptions options;
+    options.guess_est = est != 0;
     if (est) {
         printf("All parameters are set. Estimating the initial pH...\n");
-        pH = cbe.pH_calc(7.0, true, 1500, 1e-5);
     } else {
         printf("Please enter the initial guess of pH: (or input 0 for default value 7.0): ");
         double guess;
@@ -287,8 +164,14 @@ int main() {
             printf("The initial guess of pH is: %.2f\n", guess);
         }
         printf("All parameters are set. Calculating the pH...\n");
-        pH = cbe.pH_calc(guess, false, 1500, 1e-5);
+        options.guess = guess;
+    }
+    printf("Calculating pH...\n");
+    PhResult result = solve_cbe(s, Kw, options);
+    if (!result.converged) {
+        throw std::runtime_error("Failed to converge to the desired tolerance.");
     }
+    double pH = result.pH;
     printf("----------------------------------------\n");
     printf("The pH is: %.12f\n", pH);
     printf("----------------------------------------\n");
@@ -315,7 +198,7 @@ int main() {
             printf("Component with charge %d and concentration %.2e\n", acid.get_charge_vector()[0], acid.get_conc());
             // print the alpha values
             printf("Alpha values: at equilibrium pH = %.5f\n", pH);
-            auto alpha = acid.alpha(pH);
+            const std::vector<double> &alpha = result.alphas[&acid - &s[0]];
             for (size_t i = 0; i < alpha.size(); ++i) {
                 printf("Alpha_%d: %.5f\n", acid.get_charge_vector()[i], alpha[i]);
             }
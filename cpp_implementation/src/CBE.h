@@ -0,0 +1,67 @@
+#ifndef PH_CBE_H
+#define PH_CBE_H
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "balance.h"
+
+// Species and calculator of the charge balance equation (CBE). Header-only so that the
+// batch and titration templates can use them; the solve API in ph.h is built on top.
+
+class Acid : public AcidSpecies {
+   public:
+    Acid(const std::vector<double> &Ka, const std::vector<double> &pKa, int charge, double conc)
+        : AcidSpecies(Ka, pKa, conc), charge(charge) {
+        // if (charge == 0) {
+        //     throw std::invalid_argument("The maximum charge for this acid must be defined.");
+        // }
+        set_charge(charge);
+    }
+
+    // From precomputed tables, e.g. a SpeciesDatabase system: `Ka` sorted descending, `pKa`
+    // matching it and `Ka_prod` its n_Ka + 1 cumulative products.
+    Acid(const double *pKa, const double *Ka, const double *Ka_prod, size_t n_Ka, int charge, double conc)
+        : AcidSpecies(pKa, Ka, Ka_prod, n_Ka, conc), charge(charge) {
+        set_charge(charge);
+    }
+
+    inline void print_acid_data() const {
+        if (pKa.empty()) {
+            printf("Ka values: ");
+            for (const auto &val : Ka) {
+                printf("%.2e ", val);
+            }
+            printf("\n");
+        } else {
+            printf("pKa values: ");
+            for (const auto &val : pKa) {
+                printf("%.2f ", val);
+            }
+            printf("\n");
+        }
+
+        printf("Charge: %d\n", charge);
+        printf("Concentration: %.2e\n", conc);
+    }
+
+   private:
+    int charge;
+};
+
+class CBE_calc : public BalanceCalc {
+   public:
+    CBE_calc(const std::vector<Acid> &species, double Kw = 1.01e-14, double celsius = kReferenceTemperature)
+        : BalanceCalc(species, kChargeBalance, Kw, celsius) {}
+
+    double Charge_residual(double pH, double *dres = nullptr) const {
+        return residual(pH, dres);
+    }
+
+    double Charge_diff(double pH) const {
+        return std::abs(Charge_residual(pH));
+    }
+};
+
+#endif  // PH_CBE_H
@@ -1,3 +1,6 @@
+// Counts the heap allocations of traced solves, see trace.h.
+#define PH_TRACE_MAIN
+
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
@@ -6,155 +9,16 @@
 #include <limits>
 #include <numeric>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
-class PBE_Acid {
-   public:
-    PBE_Acid(const std::vector<double>& Ka, const std::vector<double>& pKa, int proton, int proton_ref, double conc)
-        : proton_ref(proton_ref), conc(conc) {
-        if (Ka.empty() && pKa.empty()) {
-            throw std::invalid_argument("You must define either Ka or pKa values.");
-        }
-        if (proton == 0) {
-            throw std::invalid_argument("The maximum proton for this acid must be defined.");
-        }
-        // if (proton_ref == 0) {
-        //     throw std::invalid_argument("The reference proton for PBE must be defined.");
-        // }
-
-        if (Ka.empty()) {
-            this->pKa = pKa;
-            std::sort(this->pKa.begin(), this->pKa.end());
-            this->Ka.resize(this->pKa.size());
-            std::transform(this->pKa.begin(), this->pKa.end(), this->Ka.begin(), [](double pKa) { return std::pow(10, -pKa); });
-        } else {
-            this->Ka = Ka;
-            std::sort(this->Ka.begin(), this->Ka.end(), std::greater<double>());
-            this->pKa.resize(this->Ka.size());
-            std::transform(this->Ka.begin(), this->Ka.end(), this->pKa.begin(), [](double Ka) { return -std::log10(Ka); });
-        }
-
-        _Ka_temp.push_back(1.0);
-        _Ka_temp.insert(_Ka_temp.end(), this->Ka.begin(), this->Ka.end());
-
-        for (int i = 0; i <= this->Ka.size(); ++i) {
-            this->proton_vector.push_back(proton - i - proton_ref);
-        }
-    }
-
-    std::vector<double> alpha(double pH) const {
-        double h3o = std::pow(10, -pH);
-        std::vector<double> h3o_pow(_Ka_temp.size());
-        std::vector<double> Ka_prod(_Ka_temp.size());
-
-        for (size_t i = 0; i < _Ka_temp.size(); ++i) {
-            h3o_pow[i] = std::pow(h3o, _Ka_temp.size() - 1 - i);
-        }
-
-        std::partial_sum(_Ka_temp.begin(), _Ka_temp.end(), Ka_prod.begin(), std::multiplies<double>());
-
-        std::vector<double> h3o_Ka(_Ka_temp.size());
-        for (size_t i = 0; i < _Ka_temp.size(); ++i) {
-            h3o_Ka[i] = h3o_pow[i] * Ka_prod[i];
-        }
-
-        double den = std::accumulate(h3o_Ka.begin(), h3o_Ka.end(), 0.0);
-        std::vector<double> result(_Ka_temp.size());
-        std::transform(h3o_Ka.begin(), h3o_Ka.end(), result.begin(), [den](double val) { return val / den; });
-
-        return result;
-    }
-
-    int get_proton(int index) const {
-        return proton_vector[index];
-    }
-
-    double get_conc() const {
-        return conc;
-    }
-
-    size_t get_proton_vector_size() const {
-        return proton_vector.size();
-    }
-
-   private:
-    std::vector<double> Ka;
-    std::vector<double> pKa;
-    std::vector<double> _Ka_temp;
-    std::vector<int> proton_vector;
-    int proton_ref;
-    double conc;
-};
-
-class PBE_calc {
-   public:
-    PBE_calc(const std::vector<PBE_Acid>& acids, double Kw = 1.01e-14)
-        : acids(acids), Kw(Kw) {}
-
-    double PBE_error(double pH) const {
-        double h3o = std::pow(10, -pH);
-        double oh = Kw / h3o;
-        double P_error = h3o - oh;
-
-        for (const auto& acid : acids) {
-            auto alpha = acid.alpha(pH);
-            for (size_t i = 0; i < alpha.size(); ++i) {
-                P_error += acid.get_conc() * acid.get_proton(i) * alpha[i];
-            }
-        }
-
-        return std::abs(P_error);
-    }
-
-    double pH_calc(double guess = 7.0, bool guess_est = false, int est_num = 1500, double tol = 1e-5) {
-        if (guess_est) {
-            std::vector<double> phs(est_num);
-            double step = 14.0 / (est_num - 1);
-            for (int i = 0; i < est_num; ++i) {
-                phs[i] = i * step;
-            }
-
-            double min_diff = std::numeric_limits<double>::max();
-            for (double ph : phs) {
-                double diff = PBE_error(ph);
-                if (diff < min_diff) {
-                    min_diff = diff;
-                    guess = ph;
-                }
-            }
-        }
-
-        double pH = guess;
-        double diff = PBE_error(pH);
-        double learning_rate = 0.001;  // Stochastic Gradient Descent learning rate
-        int max_iterations = 10000;    // Maximum number of iterations to prevent infinite loop
-
-        for (int i = 0; i < max_iterations && diff > tol; ++i) {
-            double gradient = (PBE_error(pH + tol) - diff) / tol;  // Numerical gradient
-            pH -= learning_rate * gradient;                        // Update pH using gradient descent
-            double new_diff = PBE_error(pH);                       // Recalculate the difference
-
-            // Adjust learning rate based on the change in difference
-            if (new_diff < diff) {
-                learning_rate *= 1.05;  // Increase learning rate if getting closer
-            } else {
-                learning_rate *= 0.5;  // Decrease learning rate if getting further
-            }
-
-            diff = new_diff;  // Update the difference
-        }
-
-        if (diff > tol) {
-            throw std::runtime_error("Failed to converge to the desired tolerance.");
-        }
-
-        return pH;
-    }
-
-   private:
-    std::vector<PBE_Acid> acids;
-    double Kw;
-};
+#include "batch.h"
+#include "dose.h"
+#include "grid.h"
+#include "ph.h"
+#include "server.h"
+#include "titration.h"
+#include "uncertainty.h"
 
 // int main() {
 //     // std::vector<double> Ka = {1.0e-3, 1.0e-5, 1.0e-7};
@@ -176,7 +40,32 @@ class PBE_calc {
 //     return 0;
 // }
 
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        auto make_acid = [](const std::vector<double>& values, bool is_pKa, int proton, int proton_ref, double conc) {
+            return is_pKa ? PBE_Acid({}, values, proton, proton_ref, conc) : PBE_Acid(values, {}, proton, proton_ref, conc);
+        };
+        if (std::string(argv[1]) == "--mix" || std::string(argv[1]) == "--compile-db") {
+            return species_main<PBE_calc, PBE_Acid>(argc, argv, make_pbe_species);
+        }
+        if (std::string(argv[1]) == "--titrate") {
+            return titration_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+        }
+        if (std::string(argv[1]) == "--serve") {
+            return server_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+        }
+        if (std::string(argv[1]) == "--grid") {
+            return grid_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+        }
+        if (std::string(argv[1]) == "--uncertainty") {
+            return uncertainty_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+        }
+        if (std::string(argv[1]) == "--dose") {
+            return dose_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+        }
+        return batch_main<PBE_calc, PBE_Acid>(argc, argv, 2, make_acid);
+    }
+
     printf("The program is running...\n");
     printf("Program name: Calculation of pH with Proton Balance Equation (PBE)\n");
     printf("Author: Eric Xin\n");
@@ -259,11 +148,10 @@ int main() {
     printf("----------------------------------------\n");
     int est = 1;
 
-    PBE_calc pbe(acids, Kw);
-    double pH;
+    PhOptions options;
+    options.guess_est = est != 0;
     if (est) {
         printf("All parameters are set. Estimating the initial pH...\n");
-        pH = pbe.pH_calc(7.0, true, 1500, 1e-5);
     } else {
         printf("Please enter the initial guess of pH: (or input 0 for default value 7.0): ");
         double guess;
@@ -275,8 +163,13 @@ int main() {
             printf("The initial guess of pH is: %.2f\n", guess);
         }
         printf("All parameters are set. Calculating the pH...\n");
-        pH = pbe.pH_calc(guess, false, 1500, 1e-5);
+        options.guess = guess;
+    }
+    PhResult result = solve_pbe(acids, Kw, options);
+    if (!result.converged) {
+        throw std::runtime_error("Failed to converge to the desired tolerance.");
     }
+    double pH = result.pH;
     printf("----------------------------------------\n");
     printf("The pH is: %.12f\n", pH);
     printf("----------------------------------------\n");
@@ -290,7 +183,7 @@ int main() {
             printf("For component No. %d:\n", (int)(&acid - &acids[0]) + 1);
             printf("Component with concentration %.2e\n", acid.get_conc());
             printf("Alpha values: at equilibrium pH = %.5f\n", pH);
-            auto alpha = acid.alpha(pH);
+            const std::vector<double>& alpha = result.alphas[&acid - &acids[0]];
             for (size_t i = 0; i < alpha.size(); ++i) {
                 printf("Alpha_%d: %.5f\n", acid.get_proton(i), alpha[i]);
             }
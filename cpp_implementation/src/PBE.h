@@ -0,0 +1,62 @@
+#ifndef PH_PBE_H
+#define PH_PBE_H
+
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include "balance.h"
+
+// Species and calculator of the proton balance equation (PBE). Header-only so that the
+// batch and titration templates can use them; the solve API in ph.h is built on top.
+
+class PBE_Acid : public AcidSpecies {
+   public:
+    PBE_Acid(const std::vector<double>& Ka, const std::vector<double>& pKa, int proton, int proton_ref, double conc)
+        : AcidSpecies(Ka, pKa, conc) {
+        if (proton == 0) {
+            throw std::invalid_argument("The maximum proton for this acid must be defined.");
+        }
+        // if (proton_ref == 0) {
+        //     throw std::invalid_argument("The reference proton for PBE must be defined.");
+        // }
+        set_protons(proton, proton_ref);
+    }
+
+    // From precomputed tables, e.g. a SpeciesDatabase system: `Ka` sorted descending, `pKa`
+    // matching it and `Ka_prod` its n_Ka + 1 cumulative products.
+    PBE_Acid(const double* pKa, const double* Ka, const double* Ka_prod, size_t n_Ka, int proton, int proton_ref, double conc)
+        : AcidSpecies(pKa, Ka, Ka_prod, n_Ka, conc) {
+        if (proton == 0) {
+            throw std::invalid_argument("The maximum proton for this acid must be defined.");
+        }
+        set_protons(proton, proton_ref);
+    }
+
+    int get_proton(int index) const {
+        return proton_vector[index];
+    }
+
+    size_t get_proton_vector_size() const {
+        return proton_vector.size();
+    }
+};
+
+// The proton balance does not need charges, but activity corrections do, and so does
+// check_balance(): PBE_Acid::set_charge() adds them.
+class PBE_calc : public BalanceCalc {
+   public:
+    PBE_calc(const std::vector<PBE_Acid>& acids, double Kw = 1.01e-14, double celsius = kReferenceTemperature)
+        : BalanceCalc(acids, kProtonBalance, Kw, celsius) {}
+
+    double PBE_residual(double pH, double* dres = nullptr) const {
+        return residual(pH, dres);
+    }
+
+    double PBE_error(double pH) const {
+        return std::abs(PBE_residual(pH));
+    }
+};
+
+#endif  // PH_PBE_H
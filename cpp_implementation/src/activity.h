@@ -0,0 +1,116 @@
+#ifndef PH_ACTIVITY_H
+#define PH_ACTIVITY_H
+
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "solver.h"
+
+// Activity corrections for non-ideal solutions. Both models give log10(gamma) = z^2 * f(I)
+// for an ion of charge z, so one value f per ionic strength is enough to move every
+// equilibrium constant of a System to the concentration scale (System::set_log_gamma_unit).
+//
+// The ionic strength depends on the speciation and therefore on the pH, so the pH and I
+// are solved together: I is iterated to a fixed point with secant acceleration, each step
+// being a warm-started solve at the previous pH.
+
+struct ActivityModel {
+    enum Kind { kIdeal, kDebyeHuckel, kDavies };
+
+    Kind kind;
+    double A;         // Debye-Hueckel A, 0.509 at 25 C in water
+    double B;         // Debye-Hueckel B in 1/Angstrom, 0.328 at 25 C
+    double ion_size;  // ion size parameter in Angstrom, extended Debye-Hueckel only
+
+    explicit ActivityModel(Kind kind = kIdeal) : kind(kind), A(0.509), B(0.328), ion_size(4.5) {}
+
+    // log10(gamma) of a singly charged ion at ionic strength I.
+    double log_gamma_unit(double I) const {
+        if (kind == kIdeal || !(I > 0)) {
+            return 0.0;
+        }
+        double s = std::sqrt(I);
+        if (kind == kDebyeHuckel) {
+            return -A * s / (1.0 + B * ion_size * s);
+        }
+        return -A * (s / (1.0 + s) - 0.3 * I);
+    }
+};
+
+inline ActivityModel parse_activity_model(const std::string &name) {
+    if (name == "ideal") {
+        return ActivityModel(ActivityModel::kIdeal);
+    }
+    if (name == "dh" || name == "debye-huckel") {
+        return ActivityModel(ActivityModel::kDebyeHuckel);
+    }
+    if (name == "davies") {
+        return ActivityModel(ActivityModel::kDavies);
+    }
+    throw std::invalid_argument("Unknown activity model '" + name + "' (expected ideal, dh or davies)");
+}
+
+struct ActivitySolveResult {
+    SolveResult solve;      // concentration scale: solve.pH = -log10[H3O+]
+    double pH;              // -log10 a(H3O+), the measured pH
+    double ionic_strength;
+    int outer_iterations;
+    bool converged;
+};
+
+// Solves `calc` with activity corrections. The calculator is left on the concentration scale
+// of the converged ionic strength, so set_conc() followed by another call warm-starts from it.
+// Converges when f(I) moves by less than `tol`, which bounds the change of every log K.
+template <class Calc>
+ActivitySolveResult solve_activity(Calc &calc, const ActivityModel &model, double tol = 1e-12, int max_outer = 50) {
+    if (model.kind != ActivityModel::kIdeal && !calc.get_system().has_charges()) {
+        throw std::invalid_argument("Activity corrections need the charge of every species.");
+    }
+
+    ActivitySolveResult result;
+    result.outer_iterations = 0;
+    result.converged = false;
+
+    double f = calc.get_system().get_log_gamma_unit();
+    SolveResult r = calc.solve(7.0, false, 0, tol);
+    int evaluations = r.evaluations;
+    double I = 0.0;
+    double I_prev = 0.0, G_prev = 0.0;
+
+    for (int it = 1; it <= max_outer && r.converged; ++it) {
+        result.outer_iterations = it;
+        double I_new = calc.get_system().ionic_strength(r.pH);
+        double G = I_new - I;
+
+        // Secant step on G(I) = I(pH(I)) - I once two points are known, plain iteration otherwise.
+        double I_next = I_new;
+        if (it > 1 && G != G_prev) {
+            double secant = I - G * (I - I_prev) / (G - G_prev);
+            if (std::isfinite(secant) && secant >= 0.0) {
+                I_next = secant;
+            }
+        }
+        I_prev = I, G_prev = G;
+        I = I_next;
+
+        double f_next = model.log_gamma_unit(I);
+        bool done = std::fabs(f_next - f) <= tol;
+        f = f_next;
+        calc.set_log_gamma_unit(f);
+        r = calc.solve_warm(r.pH, 0.05, tol);
+        evaluations += r.evaluations;
+        if (done) {
+            result.converged = r.converged;
+            break;
+        }
+    }
+
+    r.evaluations = evaluations;
+    result.solve = r;
+    result.ionic_strength = I;
+    result.pH = r.pH - f;
+    return result;
+}
+
+#endif  // PH_ACTIVITY_H
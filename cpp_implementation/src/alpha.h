@@ -0,0 +1,165 @@
+#ifndef PH_ALPHA_H
+#define PH_ALPHA_H
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// Alpha-fraction kernels shared by Acid and PBE_Acid.
+//
+// For an acid with n dissociation steps, the fraction carrying n - i protons is
+//     alpha_i = h^(n-i) * P_i / sum_j h^(n-j) * P_j,   P_i = Ka_1 * ... * Ka_i, P_0 = 1.
+// The cumulative products P_i only depend on the Ka values and are computed once per
+// species; the powers of h are built up by repeated multiplication instead of pow().
+//
+// That direct form leaves the double range for extreme constants or pH, e.g. a hexaprotic
+// acid at pH -60 or products of Ka values beyond 1e308. alpha_kernel_log covers those cases
+// in log10 form; alpha_direct_safe tells from a bound on the exponents which one to use.
+
+// Upper bound on the number of alpha terms (dissociation steps + 1), so callers can
+// keep the fractions in a stack buffer.
+const size_t kMaxAlphaTerms = 16;
+
+inline std::vector<double> ka_cumulative_products(const std::vector<double> &Ka) {
+    std::vector<double> Ka_prod(Ka.size() + 1);
+    Ka_prod[0] = 1.0;
+    for (size_t i = 0; i < Ka.size(); ++i) {
+        Ka_prod[i + 1] = Ka_prod[i] * Ka[i];
+    }
+    return Ka_prod;
+}
+
+// The same products in log10 form, log10 P_i = -(pKa_1 + ... + pKa_i), written to the n_Ka + 1
+// elements of out. They stay exact where the products themselves overflow or underflow.
+inline void ka_log_products(const double *pKa, size_t n_Ka, double *out) {
+    out[0] = 0.0;
+    for (size_t i = 0; i < n_Ka; ++i) {
+        out[i + 1] = out[i] - pKa[i];
+    }
+}
+
+// Largest |log10 P_i| of a species, the argument of alpha_direct_safe.
+inline double ka_log_prod_max(const double *pKa, size_t n_Ka) {
+    double sum = 0.0, m = 0.0;
+    for (size_t i = 0; i < n_Ka; ++i) {
+        sum -= pKa[i];
+        m = std::fabs(sum) > m ? std::fabs(sum) : m;
+    }
+    return m;
+}
+
+// Bound on |log10| of every term h^(n-1-i) * P_i up to which the direct kernels are used.
+// It leaves room for summing the terms and for the power of h a residual kernel builds.
+const double kAlphaDirectLog10 = 300.0;
+
+// True if the direct kernels are exact at pH for a species whose log10 products are all
+// within [-log_prod_max, log_prod_max].
+inline bool alpha_direct_safe(double pH, size_t n_terms, double log_prod_max) {
+    return static_cast<double>(n_terms - 1) * std::fabs(pH) + log_prod_max < kAlphaDirectLog10;
+}
+
+// Log-sum-exp form of alpha_kernel, valid at any pH: the exponents are shifted so that the
+// largest term is 1 before they are raised, so no term overflows and the sum is at least 1.
+inline void alpha_kernel_log(const double *log_Ka_prod, size_t n_terms, double pH, double *out) {
+    double top = -HUGE_VAL;
+    for (size_t i = 0; i < n_terms; ++i) {
+        out[i] = log_Ka_prod[i] - static_cast<double>(n_terms - 1 - i) * pH;
+        top = out[i] > top ? out[i] : top;
+    }
+
+    double den = 0.0;
+    for (size_t i = 0; i < n_terms; ++i) {
+        out[i] = std::pow(10, out[i] - top);
+        den += out[i];
+    }
+    for (size_t i = 0; i < n_terms; ++i) {
+        out[i] /= den;
+    }
+}
+
+// Writes the n_terms fractions at [H3O+] = h3o into out.
+inline void alpha_kernel(const double *Ka_prod, size_t n_terms, double h3o, double *out) {
+    double h_pow = 1.0;
+    double den = 0.0;
+    for (size_t i = n_terms; i-- > 0;) {
+        double term = h_pow * Ka_prod[i];
+        out[i] = term;
+        den += term;
+        h_pow *= h3o;
+    }
+
+    double inv_den = 1.0 / den;
+    for (size_t i = 0; i < n_terms; ++i) {
+        out[i] *= inv_den;
+    }
+}
+
+// alpha_kernel with the number of terms fixed at compile time: the loops have constant trip
+// counts and are fully unrolled, with no branching on the acid's size.
+template <size_t N>
+void alpha_kernel_fixed(const double *Ka_prod, size_t, double h3o, double *out) {
+    double term[N];
+    double h_pow = 1.0;
+    double den = 0.0;
+    for (size_t j = 0; j < N; ++j) {
+        const size_t i = N - 1 - j;
+        term[i] = h_pow * Ka_prod[i];
+        den += term[i];
+        h_pow *= h3o;
+    }
+
+    double inv_den = 1.0 / den;
+    for (size_t i = 0; i < N; ++i) {
+        out[i] = term[i] * inv_den;
+    }
+}
+
+typedef void (*AlphaKernel)(const double *Ka_prod, size_t n_terms, double h3o, double *out);
+
+// Picked once per species: fixed-size instances for mono- to hexaprotic acids, the generic
+// kernel otherwise.
+inline AlphaKernel select_alpha_kernel(size_t n_terms) {
+    switch (n_terms) {
+        case 2: return alpha_kernel_fixed<2>;
+        case 3: return alpha_kernel_fixed<3>;
+        case 4: return alpha_kernel_fixed<4>;
+        case 5: return alpha_kernel_fixed<5>;
+        case 6: return alpha_kernel_fixed<6>;
+        case 7: return alpha_kernel_fixed<7>;
+        default: return alpha_kernel;
+    }
+}
+
+// Evaluates the fractions at n_points values of [H3O+] at once. The output is term-major,
+// out[i * n_points + p], so every loop runs over contiguous points and vectorises.
+// `h_pow` and `den` are scratch buffers of n_points elements.
+inline void alpha_kernel_batch(const double *Ka_prod, size_t n_terms, const double *h3o, size_t n_points,
+                               double *out, double *h_pow, double *den) {
+    for (size_t p = 0; p < n_points; ++p) {
+        h_pow[p] = 1.0;
+        den[p] = 0.0;
+    }
+
+    for (size_t i = n_terms; i-- > 0;) {
+        const double P = Ka_prod[i];
+        double *row = out + i * n_points;
+        for (size_t p = 0; p < n_points; ++p) {
+            double term = h_pow[p] * P;
+            row[p] = term;
+            den[p] += term;
+            h_pow[p] *= h3o[p];
+        }
+    }
+
+    for (size_t p = 0; p < n_points; ++p) {
+        den[p] = 1.0 / den[p];
+    }
+    for (size_t i = 0; i < n_terms; ++i) {
+        double *row = out + i * n_points;
+        for (size_t p = 0; p < n_points; ++p) {
+            row[p] *= den[p];
+        }
+    }
+}
+
+#endif  // PH_ALPHA_H
@@ -0,0 +1,446 @@
+#ifndef PH_BALANCE_H
+#define PH_BALANCE_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include "alpha.h"
+#include "solver.h"
+#include "system.h"
+#include "temperature.h"
+
+// Engine shared by the charge balance (CBE) and the proton balance (PBE). Both solve
+//     h - Kw/h + sum_s c_s sum_i w_i alpha_i = 0
+// over the same species table and differ only in the integer weight w_i of each alpha term:
+// the charge of the form for the CBE, its protons in excess of the reference level for the
+// PBE. AcidSpecies holds the constants and both weight vectors, BalanceCalc solves one
+// balance and, when the species carry the weights of the other one too, checks the root
+// against it (check_balance). Acid/CBE_calc and PBE_Acid/PBE_calc are thin layers on top.
+//
+// Species with enthalpy data (set_thermo) are moved from the temperature their constants hold
+// at to that of the calculator, see temperature.h; species without keep their constants.
+
+enum Balance { kChargeBalance, kProtonBalance };
+
+inline Balance other_balance(Balance balance) {
+    return balance == kChargeBalance ? kProtonBalance : kChargeBalance;
+}
+
+inline const char *balance_name(Balance balance) {
+    return balance == kChargeBalance ? "charge balance" : "proton balance";
+}
+
+class AcidSpecies {
+   public:
+    std::vector<double> alpha(double pH) const {
+        std::vector<double> result(Ka_prod.size());
+        alpha_at_pH(pH, result.data());
+        return result;
+    }
+
+    // Allocation-free variant: writes get_alpha_size() fractions into out. Falls back to the
+    // log-space kernel where the direct one would leave the double range.
+    void alpha_at_pH(double pH, double *out) const {
+        if (alpha_direct_safe(pH, Ka_prod.size(), log_prod_max)) {
+            alpha_fn(Ka_prod.data(), Ka_prod.size(), std::pow(10, -pH), out);
+        } else {
+            double log_Ka_prod[kMaxAlphaTerms];
+            ka_log_products(pKa.data(), pKa.size(), log_Ka_prod);
+            alpha_kernel_log(log_Ka_prod, Ka_prod.size(), pH, out);
+        }
+    }
+
+    // Direct kernel for callers that already have [H3O+]; only valid where alpha_direct_safe
+    // holds, which covers ordinary constants over pH -2 to 16.
+    void alpha_at_h3o(double h3o, double *out) const {
+        alpha_fn(Ka_prod.data(), Ka_prod.size(), h3o, out);
+    }
+
+    // Fractions at n_points pH values, term-major: out[i * n_points + p].
+    void alpha_batch(const double *pH, size_t n_points, double *out) const {
+        bool direct = true;
+        for (size_t p = 0; p < n_points; ++p) {
+            direct = direct && alpha_direct_safe(pH[p], Ka_prod.size(), log_prod_max);
+        }
+        if (!direct) {
+            double alpha[kMaxAlphaTerms];
+            for (size_t p = 0; p < n_points; ++p) {
+                alpha_at_pH(pH[p], alpha);
+                for (size_t i = 0; i < Ka_prod.size(); ++i) {
+                    out[i * n_points + p] = alpha[i];
+                }
+            }
+            return;
+        }
+
+        std::vector<double> h3o(n_points), h_pow(n_points), den(n_points);
+        for (size_t p = 0; p < n_points; ++p) {
+            h3o[p] = std::pow(10, -pH[p]);
+        }
+        alpha_kernel_batch(Ka_prod.data(), Ka_prod.size(), h3o.data(), n_points, out, h_pow.data(), den.data());
+    }
+
+    size_t get_alpha_size() const {
+        return Ka_prod.size();
+    }
+
+    double get_conc() const {
+        return conc;
+    }
+
+    void set_conc(double c) {
+        conc = c;
+    }
+
+    const std::vector<double> &get_Ka_prod() const {
+        return Ka_prod;
+    }
+
+    // Ascending, matching the Ka products.
+    const std::vector<double> &get_pKa() const {
+        return pKa;
+    }
+
+    // `charge` is the charge of the fully protonated form.
+    void set_charge(int charge) {
+        charge_vector.clear();
+        for (size_t i = 0; i < Ka_prod.size(); ++i) {
+            charge_vector.push_back(charge - static_cast<int>(i));
+        }
+    }
+
+    // `proton` is the number of protons of the fully protonated form, `proton_ref` the number
+    // the reference level of the proton balance takes away.
+    void set_protons(int proton, int proton_ref) {
+        proton_vector.clear();
+        for (size_t i = 0; i < Ka_prod.size(); ++i) {
+            proton_vector.push_back(proton - static_cast<int>(i) - proton_ref);
+        }
+    }
+
+    // Each is empty until set; the CBE species set the charges, the PBE species the protons.
+    const std::vector<int> &get_charge_vector() const {
+        return charge_vector;
+    }
+
+    const std::vector<int> &get_proton_vector() const {
+        return proton_vector;
+    }
+
+    const std::vector<int> &get_weights(Balance balance) const {
+        return balance == kChargeBalance ? charge_vector : proton_vector;
+    }
+
+    // Enthalpies (kJ/mol) and heat capacity changes (J/(mol K), zero when left empty) of the
+    // dissociation steps in the order of get_pKa(), and the temperature in C the constants
+    // hold at.
+    void set_thermo(const std::vector<double> &dH, const std::vector<double> &dCp = std::vector<double>(),
+                    double celsius = kReferenceTemperature) {
+        if (dH.size() != pKa.size() || (!dCp.empty() && dCp.size() != pKa.size())) {
+            throw std::invalid_argument("Expected one enthalpy and heat capacity per Ka value.");
+        }
+        check_temperature(celsius);
+        this->dH = dH;
+        this->dCp = dCp.empty() ? std::vector<double>(dH.size(), 0.0) : dCp;
+        temperature = celsius;
+    }
+
+    bool has_thermo() const {
+        return !dH.empty();
+    }
+
+    double get_temperature() const {
+        return temperature;
+    }
+
+    const std::vector<double> &get_dH() const {
+        return dH;
+    }
+
+    const std::vector<double> &get_dCp() const {
+        return dCp;
+    }
+
+    // pKa values at `celsius` in the order of get_pKa(); the constants as given without
+    // enthalpy data.
+    std::vector<double> pKa_at(double celsius) const {
+        std::vector<double> result(pKa);
+        if (has_thermo() && celsius != temperature) {
+            check_temperature(celsius);
+            for (size_t i = 0; i < result.size(); ++i) {
+                result[i] += log_k_shift(dH[i], dCp[i], temperature) - log_k_shift(dH[i], dCp[i], celsius);
+            }
+        }
+        return result;
+    }
+
+   protected:
+    AcidSpecies(const std::vector<double> &Ka, const std::vector<double> &pKa, double conc)
+        : conc(conc), temperature(kReferenceTemperature) {
+        if (Ka.empty() && pKa.empty()) {
+            throw std::invalid_argument("You must define either Ka or pKa values.");
+        }
+
+        if (Ka.empty()) {
+            this->pKa = pKa;
+            std::sort(this->pKa.begin(), this->pKa.end());
+            this->Ka.resize(this->pKa.size());
+            std::transform(this->pKa.begin(), this->pKa.end(), this->Ka.begin(), [](double pKa) { return std::pow(10, -pKa); });
+        } else {
+            this->Ka = Ka;
+            std::sort(this->Ka.begin(), this->Ka.end(), std::greater<double>());
+            this->pKa.resize(this->Ka.size());
+            std::transform(this->Ka.begin(), this->Ka.end(), this->pKa.begin(), [](double Ka) { return -std::log10(Ka); });
+        }
+
+        if (this->Ka.size() >= kMaxAlphaTerms) {
+            throw std::invalid_argument("Too many Ka values for one acid.");
+        }
+        Ka_prod = ka_cumulative_products(this->Ka);
+        log_prod_max = ka_log_prod_max(this->pKa.data(), this->pKa.size());
+        alpha_fn = select_alpha_kernel(Ka_prod.size());
+    }
+
+    // From precomputed tables, e.g. a SpeciesDatabase system: `Ka` sorted descending, `pKa`
+    // matching it and `Ka_prod` its n_Ka + 1 cumulative products.
+    AcidSpecies(const double *pKa, const double *Ka, const double *Ka_prod, size_t n_Ka, double conc)
+        : Ka(Ka, Ka + n_Ka),
+          pKa(pKa, pKa + n_Ka),
+          Ka_prod(Ka_prod, Ka_prod + n_Ka + 1),
+          alpha_fn(select_alpha_kernel(n_Ka + 1)),
+          conc(conc),
+          temperature(kReferenceTemperature) {
+        if (n_Ka == 0 || n_Ka >= kMaxAlphaTerms) {
+            throw std::invalid_argument("Invalid number of Ka values for one acid.");
+        }
+        log_prod_max = ka_log_prod_max(this->pKa.data(), this->pKa.size());
+    }
+
+    std::vector<double> Ka;
+    std::vector<double> pKa;
+    std::vector<double> Ka_prod;
+    double log_prod_max;  // see alpha_direct_safe
+    AlphaKernel alpha_fn;
+    std::vector<int> charge_vector;
+    std::vector<int> proton_vector;
+    double conc;
+    std::vector<double> dH, dCp;
+    double temperature;
+};
+
+// Root of the other balance next to a solved one, see BalanceCalc::check_balance.
+struct BalanceCheck {
+    double pH;            // root of the other balance
+    double residual;      // the other balance's residual at the solved pH
+    double disagreement;  // pH minus the solved pH
+    int evaluations;
+    bool converged;
+
+    BalanceCheck() : pH(0.0), residual(0.0), disagreement(0.0), evaluations(0), converged(false) {}
+};
+
+class BalanceCalc {
+   public:
+    // `Species` derives from AcidSpecies and carries the weights of `balance`. When every
+    // species also carries those of the other balance, they are kept as the second weight
+    // set of the system for check_balance(). `Kw` is the value at 25 C; the solution is
+    // taken at `celsius`.
+    template <class Species>
+    BalanceCalc(const std::vector<Species> &species, Balance balance, double Kw = 1.01e-14,
+                double celsius = kReferenceTemperature)
+        : balance(balance),
+          temperature(celsius),
+          system(kw_at_temperature(Kw, celsius)),
+          ph_min(kSearchMinPH),
+          ph_max(kSearchMaxPH) {
+        for (const auto &s : species) {
+            add_species(s);
+        }
+    }
+
+    // Appends one species, taken at the temperature of the calculator.
+    template <class Species>
+    void add_species(const Species &s) {
+        if (s.has_thermo() && s.get_temperature() != temperature) {
+            std::vector<double> pKa = s.pKa_at(temperature);
+            std::vector<double> Ka(pKa.size());
+            std::transform(pKa.begin(), pKa.end(), Ka.begin(), [](double p) { return std::pow(10, -p); });
+            system.add_species(ka_cumulative_products(Ka), s.get_weights(balance), s.get_conc(), s.get_charge_vector(),
+                               pKa, s.get_weights(other_balance(balance)));
+        } else {
+            system.add_species(s.get_Ka_prod(), s.get_weights(balance), s.get_conc(), s.get_charge_vector(),
+                               s.get_pKa(), s.get_weights(other_balance(balance)));
+        }
+    }
+
+    // Removes one species; those after it move down by one, see System::remove_species.
+    void remove_species(size_t index) {
+        system.remove_species(index);
+    }
+
+    // Signed residual of the balance equation, evaluated on the flattened system.
+    // When `dres` is given it receives d(residual)/d(pH), which is always negative.
+    double residual(double pH, double *dres = nullptr) const {
+        return system.residual(pH, dres);
+    }
+
+    // `tol` is the absolute tolerance on pH. With `guess_est` the guess is ignored and the
+    // root is bracketed inside the search range down to the resolution of an `est_num`-point
+    // grid, which takes about log2(est_num) evaluations instead of est_num.
+    SolveResult solve(double guess = 7.0, bool guess_est = false, int est_num = 1500, double tol = 1e-12) const {
+#ifdef PH_TRACE
+        TraceScope trace(system.size());
+#endif
+        auto f = [this](double pH, double *dres) { return system.residual(pH, dres); };
+        SolveResult result;
+        if (guess_est) {
+            double width = (ph_max - ph_min) / (est_num > 1 ? est_num - 1 : 1);
+            result = solve_in_range(f, ph_min, ph_max, width, tol, 100, system.scan_pool());
+        } else {
+            result = solve_bracketed(f, guess, tol);
+        }
+        result.condition = system.condition(result.pH, result.slope);
+#ifdef PH_TRACE
+        trace.finish(result);
+#endif
+        return result;
+    }
+
+    // Range searched by solve() with guess_est; roots outside it are still found.
+    void set_search_range(double lo, double hi) {
+        if (!(lo < hi)) {
+            throw std::invalid_argument("The pH search range must not be empty.");
+        }
+        ph_min = lo;
+        ph_max = hi;
+    }
+
+    // Warm start from a nearby pH, e.g. the previous point of a titration: the bracket
+    // is searched outwards from `guess` starting with `step`.
+    SolveResult solve_warm(double guess, double step = 0.05, double tol = 1e-12) const {
+#ifdef PH_TRACE
+        TraceScope trace(system.size());
+#endif
+        auto f = [this](double pH, double *dres) { return system.residual(pH, dres); };
+        SolveResult result = solve_bracketed(f, guess, tol, 100, step);
+        result.condition = system.condition(result.pH, result.slope);
+#ifdef PH_TRACE
+        trace.finish(result);
+#endif
+        return result;
+    }
+
+    // Warm start from a pH x where the residual r and its slope d are already known, see
+    // solve_from.
+    SolveResult solve_from(double x, double r, double d, double tol = 1e-12) const {
+#ifdef PH_TRACE
+        TraceScope trace(system.size());
+#endif
+        auto f = [this](double pH, double *dres) { return system.residual(pH, dres); };
+        SolveResult result = ::solve_from(f, x, r, d, tol);
+        result.condition = system.condition(result.pH, result.slope);
+#ifdef PH_TRACE
+        trace.finish(result);
+#endif
+        return result;
+    }
+
+    // Solves the other balance next to `solved`, a root of this one, and reports where the
+    // two disagree. Both balances hold exactly for a consistent species table, so any
+    // disagreement beyond the tolerance points at wrong charges or reference levels.
+    //
+    // The check starts with one evaluation of both balances at the solved pH, which shares
+    // the alpha terms between them (System::residual_pair). When the Newton step of the other
+    // balance is within `tol`, as it is for a consistent table, that is the whole cost;
+    // otherwise its root is searched from the Newton estimate.
+    BalanceCheck check_balance(const SolveResult &solved, double tol = 1e-12) const {
+        if (!system.has_second_weights()) {
+            throw std::invalid_argument("Checking the other balance needs the charges and proton levels of every species.");
+        }
+
+        BalanceCheck check;
+        double res[2], dres[2];
+        system.residual_pair(solved.pH, res, dres);
+        check.residual = res[1];
+        check.evaluations = 1;
+        if (within_tol(res[1], dres[1], tol)) {
+            check.pH = solved.pH - res[1] / dres[1];
+            check.converged = true;
+        } else {
+            auto f = [this](double pH, double *d) {
+                double r[2], dr[2];
+                system.residual_pair(pH, r, dr);
+                *d = dr[1];
+                return r[1];
+            };
+            double step = dres[1] < 0 ? -res[1] / dres[1] : 0.0;
+            double guess = std::fabs(step) < 1.0 ? solved.pH + step : solved.pH;
+            SolveResult other = solve_bracketed(f, guess, tol, 100, 0.05);
+            check.pH = other.pH;
+            check.converged = other.converged;
+            check.evaluations += other.evaluations;
+        }
+        check.disagreement = check.pH - solved.pH;
+        return check;
+    }
+
+    // Changes the concentration of one species in place, without rebuilding the system.
+    void set_conc(size_t index, double conc) {
+        system.set_conc(index, conc);
+    }
+
+    // `Kw` at 25 C, taken at the temperature of the calculator.
+    void set_Kw(double Kw) {
+        system.set_Kw(kw_at_temperature(Kw, temperature));
+    }
+
+    // Changes the constants of one species in place, see System::set_pKa; the pKa values
+    // hold at the temperature of the calculator.
+    void set_pKa(size_t index, const double *pKa) {
+        system.set_pKa(index, pKa);
+    }
+
+    // Moves the constants to the concentration scale, see System::set_log_gamma_unit.
+    void set_log_gamma_unit(double f) {
+        system.set_log_gamma_unit(f);
+    }
+
+    // Splits the solves of large mixtures over `pool` (not owned, may be null), see
+    // System::set_pool; mixtures below the thresholds are solved serially either way.
+    void set_pool(WorkStealingPool *pool) {
+        system.set_pool(pool);
+    }
+
+    Balance get_balance() const {
+        return balance;
+    }
+
+    // In C.
+    double get_temperature() const {
+        return temperature;
+    }
+
+    const System &get_system() const {
+        return system;
+    }
+
+    double pH_calc(double guess = 7.0, bool guess_est = false, int est_num = 1500, double tol = 1e-12) {
+        SolveResult result = solve(guess, guess_est, est_num, tol);
+        if (!result.converged) {
+            throw std::runtime_error("Failed to converge to the desired tolerance.");
+        }
+
+        return result.pH;
+    }
+
+   private:
+    Balance balance;
+    double temperature;
+    System system;
+    double ph_min, ph_max;
+};
+
+#endif  // PH_BALANCE_H
@@ -0,0 +1,377 @@
+#ifndef PH_BATCH_H
+#define PH_BATCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "activity.h"
+#include "alpha.h"
+#include "cli.h"
+#include "mixture_io.h"
+#include "parallel.h"
+#include "result_io.h"
+#include "solve_cache.h"
+#include "solver.h"
+#include "trace.h"
+
+// Batch mode: solve every mixture of a columnar table in one process and stream the
+// results to a CSV or binary result file in input order.
+
+struct BatchOptions {
+    unsigned threads;
+    bool alphas;             // append the alpha fractions of every species (CSV output only)
+    bool sensitivities;      // append the buffer capacity and dpH/dc of every species (CSV output only)
+    bool binary;             // write a binary result file instead of CSV
+    bool resume;             // continue a partially written binary result file
+    double Kw;               // used for mixtures without their own Kw
+    double tol;
+    size_t window;           // mixtures solved between two writes of the output
+    ActivityModel activity;  // non-ideal models report -log10 a(H3O+) as the pH
+    SolveCache *cache;       // optional, ideal model only
+
+    BatchOptions()
+        : threads(default_thread_count()), alphas(false), sensitivities(false), binary(false), resume(false), Kw(1.01e-14),
+          tol(1e-12), window(1 << 16), activity(), cache(nullptr) {}
+};
+
+struct BatchStats {
+    size_t mixtures;
+    size_t failed;
+    size_t evaluations;
+    size_t bracket_evaluations;
+    size_t ill_conditioned;  // mixtures whose condition does not allow the requested tolerance
+    double max_condition;
+    double seconds;
+};
+
+struct BatchResult {
+    SolveResult solve;
+    std::string columns;  // optional CSV columns
+};
+
+// `make_species(values, is_pKa, weight0, weight1, conc)` turns one row into the species type
+// the calculator `Calc` is constructed from.
+template <class Species, class Factory>
+std::vector<Species> build_species(const MixtureColumns &c, size_t m, const Factory &make_species) {
+    std::vector<Species> species;
+    species.reserve(c.row_begin[m + 1] - c.row_begin[m]);
+    std::vector<double> values;
+    for (uint64_t r = c.row_begin[m]; r < c.row_begin[m + 1]; ++r) {
+        values.assign(c.values + c.value_begin[r], c.values + c.value_begin[r + 1]);
+        species.push_back(make_species(values, c.is_pKa[r] != 0, c.weight0[r], c.weight1[r], c.conc[r]));
+    }
+    return species;
+}
+
+// Solves one calculator with the batch options. With activity corrections the reported pH
+// is -log10 a(H3O+); `pH_conc` receives -log10[H3O+], where the speciation is evaluated.
+template <class Calc>
+SolveResult solve_with_options(Calc &calc, const BatchOptions &options, double &pH_conc) {
+    SolveResult result;
+    if (options.activity.kind == ActivityModel::kIdeal) {
+        result = options.cache ? options.cache->solve(calc, options.tol) : calc.solve(7.0, false, 0, options.tol);
+        pH_conc = result.pH;
+    } else {
+        ActivitySolveResult a = solve_activity(calc, options.activity, options.tol);
+        result = a.solve;
+        result.converged = a.converged;
+        result.pH = a.pH;
+        pH_conc = a.solve.pH;
+    }
+    return result;
+}
+
+// Identifies the input and the options a binary result file was solved with, so that
+// --resume does not append to results of something else: every column of the input, the
+// Kw used for every mixture, the tolerance and the activity model. Hashing the columns is
+// a single pass over them, cheap next to the solves.
+inline uint64_t batch_fingerprint(const MixtureColumns &c, const BatchOptions &options) {
+    uint64_t h = cache_mix(cache_mix(cache_mix(0, c.n_mixtures), c.n_rows), c.n_values);
+    for (size_t m = 0; m < c.n_mixtures; ++m) {
+        h = cache_mix(h, c.mixture_id[m]);
+        h = cache_mix(h, c.row_begin[m + 1]);
+        h = cache_mix(h, static_cast<uint64_t>(cache_bits(c.Kw && c.Kw[m] > 0 ? c.Kw[m] : options.Kw)));
+    }
+    for (size_t r = 0; r < c.n_rows; ++r) {
+        h = cache_mix(h, c.value_begin[r + 1]);
+        h = cache_mix(h, static_cast<uint64_t>(cache_bits(c.conc[r])));
+        h = cache_mix(h, static_cast<uint32_t>(c.weight0[r]));
+        h = cache_mix(h, static_cast<uint32_t>(c.weight1[r]));
+        h = cache_mix(h, c.is_pKa[r]);
+    }
+    for (size_t v = 0; v < c.n_values; ++v) {
+        h = cache_mix(h, static_cast<uint64_t>(cache_bits(c.values[v])));
+    }
+    h = cache_mix(h, static_cast<uint64_t>(cache_bits(options.tol)));
+    h = cache_mix(h, static_cast<uint64_t>(options.activity.kind));
+    h = cache_mix(h, static_cast<uint64_t>(cache_bits(options.activity.A)));
+    h = cache_mix(h, static_cast<uint64_t>(cache_bits(options.activity.B)));
+    return cache_mix(h, static_cast<uint64_t>(cache_bits(options.activity.ion_size)));
+}
+
+template <class Calc, class Species, class Factory>
+BatchResult solve_mixture(const MixtureColumns &c, size_t m, const Factory &make_species, const BatchOptions &options) {
+    BatchResult result;
+    try {
+        std::vector<Species> species = build_species<Species>(c, m, make_species);
+        Calc calc(species, c.Kw && c.Kw[m] > 0 ? c.Kw[m] : options.Kw);
+        double pH_conc;
+        result.solve = solve_with_options(calc, options, pH_conc);
+
+        if (options.alphas) {
+            char buf[32];
+            double alpha[kMaxAlphaTerms];
+            for (size_t s = 0; s < species.size(); ++s) {
+                calc.get_system().alpha(s, pH_conc, alpha);
+                for (size_t i = 0; i < species[s].get_alpha_size(); ++i) {
+                    snprintf(buf, sizeof(buf), "%s%.6e", i ? ";" : (s ? "|" : ""), alpha[i]);
+                    result.columns += buf;
+                }
+            }
+        }
+        if (options.sensitivities) {
+            // Derivatives on the concentration scale; the measured pH differs by a constant.
+            char buf[32];
+            std::vector<double> dpH_dc(species.size());
+            calc.get_system().sensitivities(pH_conc, result.solve.slope, dpH_dc.data());
+            snprintf(buf, sizeof(buf), "%s%.6e,", options.alphas ? "," : "", -result.solve.slope);
+            result.columns += buf;
+            for (size_t s = 0; s < species.size(); ++s) {
+                snprintf(buf, sizeof(buf), "%s%.6e", s ? ";" : "", dpH_dc[s]);
+                result.columns += buf;
+            }
+        }
+    } catch (const std::exception &) {
+        result.solve = SolveResult();
+        result.solve.pH = std::numeric_limits<double>::quiet_NaN();
+        result.solve.residual = std::numeric_limits<double>::quiet_NaN();
+    }
+    return result;
+}
+
+// Solves mixtures [first, n_mixtures) and hands the results to `out` in input order.
+template <class Calc, class Species, class Factory>
+BatchStats run_batch(const MixtureColumns &c, ResultWriter &out, size_t first, const Factory &make_species,
+                     const BatchOptions &options) {
+    BatchStats stats = {0, 0, 0, 0, 0, 0.0, 0.0};
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<BatchResult> results;
+    for (size_t begin = first; begin < c.n_mixtures; begin += options.window) {
+        size_t end = std::min<size_t>(begin + options.window, c.n_mixtures);
+        results.assign(end - begin, BatchResult());
+
+        parallel_for(begin, end, options.threads, [&](size_t m) {
+            results[m - begin] = solve_mixture<Calc, Species>(c, m, make_species, options);
+        });
+
+        for (size_t m = begin; m < end; ++m) {
+            const BatchResult &r = results[m - begin];
+            out.write(c.mixture_id[m], r.solve, r.columns);
+            stats.failed += r.solve.converged ? 0 : 1;
+            stats.evaluations += r.solve.evaluations;
+            stats.bracket_evaluations += r.solve.bracket_evaluations;
+            if (r.solve.condition * std::numeric_limits<double>::epsilon() > options.tol) {
+                stats.ill_conditioned++;
+            }
+            stats.max_condition = std::max(stats.max_condition, r.solve.condition);
+        }
+        out.flush();
+        stats.mixtures += end - begin;
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+inline void print_batch_usage(const char *program, int n_weights) {
+    fprintf(stderr, "Usage: %s --batch <input> <output> [--threads N] [--kw Kw] [--alphas] [--binary] [--resume]\n", program);
+    fprintf(stderr, "           [--sensitivities] [--activity ideal|dh|davies] [--cache entries] [--cache-file path]\n");
+    fprintf(stderr, "           [--trace path [--trace-format json|csv|chrome]]   (builds with make TRACE=1)\n");
+    fprintf(stderr, "       %s --pack <input.csv> <output.bin>\n", program);
+    fprintf(stderr, "       %s --convert <prompt input> <output.bin>\n", program);
+    fprintf(stderr, "       %s --unpack <results.bin> <output.csv>\n", program);
+    fprintf(stderr, "CSV input, one species per line: mixture,type,values,%s,conc\n",
+            n_weights > 1 ? "proton,proton_ref" : "charge");
+}
+
+inline void unpack_results(const std::string &input, const std::string &output) {
+    MappedResults results(input);
+    CsvResultWriter out(output, false);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const ResultRecord &r = results[i];
+        SolveResult solve;
+        solve.pH = r.pH;
+        solve.residual = r.residual;
+        solve.iterations = r.iterations;
+        solve.evaluations = r.evaluations;
+        solve.converged = r.converged != 0;
+        out.write(r.mixture_id, solve, std::string());
+    }
+    if (results.size() < results.expected()) {
+        fprintf(stderr, "%s is incomplete: %zu of %llu mixtures\n", input.c_str(), results.size(),
+                (unsigned long long)results.expected());
+    }
+}
+
+// Command-line entry point of the batch mode, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int batch_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    if (argc < 4) {
+        print_batch_usage(argv[0], n_weights);
+        return 1;
+    }
+
+    std::string mode = argv[1];
+    std::string input = argv[2];
+    std::string output = argv[3];
+
+    try {
+        if (mode == "--pack" || mode == "--convert") {
+            MixtureTable table = mode == "--pack" ? read_mixtures_csv(input, n_weights) : read_mixtures_prompt(input, n_weights);
+            write_mixtures_binary(output, table.columns());
+            fprintf(stderr, "Packed %zu mixtures (%zu species) into %s\n", table.mixture_id.size(), table.conc.size(), output.c_str());
+            return 0;
+        }
+        if (mode == "--unpack") {
+            unpack_results(input, output);
+            return 0;
+        }
+        if (mode != "--batch") {
+            print_batch_usage(argv[0], n_weights);
+            return 1;
+        }
+
+        BatchOptions options;
+        size_t cache_entries = 0;
+        std::string cache_file;
+        std::string trace_file, trace_format = "json";
+        for (int i = 4; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc) {
+                options.threads = option_threads(arg, argv[++i]);
+            } else if (arg == "--kw" && i + 1 < argc) {
+                options.Kw = option_positive(arg, argv[++i]);
+            } else if (arg == "--alphas") {
+                options.alphas = true;
+            } else if (arg == "--sensitivities") {
+                options.sensitivities = true;
+            } else if (arg == "--binary") {
+                options.binary = true;
+            } else if (arg == "--resume") {
+                options.binary = options.resume = true;
+            } else if (arg == "--cache" && i + 1 < argc) {
+                cache_entries = static_cast<size_t>(option_integer(arg, argv[++i], 1));
+            } else if (arg == "--cache-file" && i + 1 < argc) {
+                cache_file = argv[++i];
+            } else if (arg == "--trace" && i + 1 < argc) {
+                trace_file = argv[++i];
+            } else if (arg == "--trace-format" && i + 1 < argc) {
+                trace_format = argv[++i];
+            } else if (arg == "--activity" && i + 1 < argc) {
+                options.activity = parse_activity_model(argv[++i]);
+                if (options.activity.kind != ActivityModel::kIdeal && n_weights > 1) {
+                    throw std::invalid_argument("Activity corrections need species charges, which the PBE input does not carry");
+                }
+            } else {
+                print_batch_usage(argv[0], n_weights);
+                return 1;
+            }
+        }
+
+        if (trace_format != "json" && trace_format != "csv" && trace_format != "chrome") {
+            throw std::invalid_argument("Unknown trace format '" + trace_format + "'; use json, csv or chrome");
+        }
+#ifdef PH_TRACE
+        Tracer::instance().set_record_steps(trace_format != "csv");  // the CSV has the counters only
+#else
+        if (!trace_file.empty()) {
+            throw std::invalid_argument("--trace needs a build with tracing compiled in (make TRACE=1)");
+        }
+#endif
+
+        // Binary input is used in place from the mapping; CSV is parsed into a table.
+        MixtureTable table;
+        std::unique_ptr<MappedMixtures> mapped;
+        MixtureColumns columns;
+        if (is_mixture_binary(input)) {
+            mapped.reset(new MappedMixtures(input));
+            columns = mapped->columns();
+        } else {
+            table = read_mixtures_csv(input, n_weights);
+            columns = table.columns();
+        }
+
+        size_t first = 0;
+        std::unique_ptr<ResultWriter> out;
+        if (options.binary) {
+            BinaryResultWriter *writer = new BinaryResultWriter(output, columns.n_mixtures, batch_fingerprint(columns, options),
+                                                                options.resume);
+            out.reset(writer);
+            first = writer->completed();
+            if (first) {
+                fprintf(stderr, "Resuming after %zu solved mixtures\n", first);
+            }
+        } else {
+            out.reset(new CsvResultWriter(output, options.alphas, options.sensitivities));
+        }
+
+        std::unique_ptr<SolveCache> cache;
+        if (cache_entries || !cache_file.empty()) {
+            SolveCacheOptions cache_options;
+            if (cache_entries) {
+                cache_options.capacity = cache_entries;
+            }
+            cache.reset(new SolveCache(cache_options));
+            if (!cache_file.empty()) {
+                cache->load(cache_file);
+            }
+            options.cache = cache.get();
+        }
+
+        BatchStats stats = run_batch<Calc, Species>(columns, *out, first, make_species, options);
+
+        fprintf(stderr, "Solved %zu mixtures (%zu failed) in %.3f s on %u threads: %.0f mixtures/s\n", stats.mixtures,
+                stats.failed, stats.seconds, options.threads, stats.seconds > 0 ? stats.mixtures / stats.seconds : 0.0);
+        if (stats.mixtures) {
+            fprintf(stderr, "Residual evaluations per mixture: %.1f (%.1f bracketing)\n", double(stats.evaluations) / stats.mixtures,
+                    double(stats.bracket_evaluations) / stats.mixtures);
+        }
+        if (stats.ill_conditioned) {
+            fprintf(stderr, "%zu mixtures may be too ill-conditioned for a pH tolerance of %g (condition up to %.2e)\n",
+                    stats.ill_conditioned, options.tol, stats.max_condition);
+        }
+        if (cache) {
+            SolveCacheStats cs = cache->get_stats();
+            fprintf(stderr, "Cache: %zu hits, %zu misses (%zu warm-started), %zu evictions, %zu entries\n", cs.hits, cs.misses,
+                    cs.warm_hits, cs.evictions, cs.size);
+            if (!cache_file.empty()) {
+                cache->save(cache_file);
+            }
+        }
+#ifdef PH_TRACE
+        if (!trace_file.empty()) {
+            const Tracer &tracer = Tracer::instance();
+            tracer.write(trace_file, trace_format);
+            fprintf(stderr, "Traced %zu solves into %s (%llu solves and %llu steps dropped by the ring)\n",
+                    tracer.solves().size(), trace_file.c_str(), static_cast<unsigned long long>(tracer.dropped_solves()),
+                    static_cast<unsigned long long>(tracer.dropped_steps()));
+        }
+#endif
+        return stats.failed ? 2 : 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_BATCH_H
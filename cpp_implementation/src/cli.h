@@ -0,0 +1,68 @@
+#ifndef PH_CLI_H
+#define PH_CLI_H
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+// Values of numeric command-line options, shared by the modes of the CBE and PBE executables.
+// The whole text must parse and a value outside the range of the option is an error instead
+// of being clamped, so that a typo does not turn into a run on 0. The option_* functions
+// throw std::invalid_argument naming the option.
+
+// The whole text must be a finite number.
+inline bool parse_number(const char *text, double &value) {
+    char *end = nullptr;
+    value = std::strtod(text, &end);
+    return end != text && *end == '\0' && std::isfinite(value);
+}
+
+inline double option_number(const std::string &option, const char *text) {
+    double value;
+    if (!parse_number(text, value)) {
+        throw std::invalid_argument(option + " must be a number, got '" + text + "'");
+    }
+    return value;
+}
+
+inline double option_positive(const std::string &option, const char *text) {
+    double value = option_number(option, text);
+    if (!(value > 0)) {
+        throw std::invalid_argument(option + " must be > 0, got '" + text + "'");
+    }
+    return value;
+}
+
+inline double option_nonnegative(const std::string &option, const char *text) {
+    double value = option_number(option, text);
+    if (!(value >= 0)) {
+        throw std::invalid_argument(option + " must be >= 0, got '" + text + "'");
+    }
+    return value;
+}
+
+// A decimal integer from `min` to `max`.
+inline uint64_t option_integer(const std::string &option, const char *text, uint64_t min, uint64_t max = UINT64_MAX) {
+    char *end = nullptr;
+    errno = 0;
+    unsigned long long value = std::isdigit(static_cast<unsigned char>(text[0])) ? std::strtoull(text, &end, 10) : 0;
+    if (!end || *end != '\0' || errno == ERANGE || value < min || value > max) {
+        std::string range = max == UINT64_MAX ? ">= " + std::to_string(min)
+                                              : "from " + std::to_string(min) + " to " + std::to_string(max);
+        throw std::invalid_argument(option + " must be an integer " + range + ", got '" + text + "'");
+    }
+    return value;
+}
+
+// A worker thread count; more than kMaxOptionThreads is taken as a typo.
+const uint64_t kMaxOptionThreads = 4096;
+
+inline unsigned option_threads(const std::string &option, const char *text) {
+    return static_cast<unsigned>(option_integer(option, text, 1, kMaxOptionThreads));
+}
+
+#endif  // PH_CLI_H
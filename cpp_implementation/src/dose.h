@@ -0,0 +1,217 @@
+#ifndef PH_DOSE_H
+#define PH_DOSE_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "activity.h"
+#include "batch.h"
+#include "cli.h"
+#include "mixture_io.h"
+#include "temperature.h"
+
+// Inverse problem: how much titrant brings the analyte to a target pH. With the pH fixed,
+// every alpha fraction is fixed, and the balance is linear in the concentrations:
+//     residual = h - Kw/h + sum_s c_s * m_s,   m_s = sum_i w_i alpha_i (System::weight_means).
+// Writing S_a and S_t for sum_s c_s m_s over the analyte and titrant at their nominal
+// concentrations and W for h - Kw/h, the dose follows from one pass over the species:
+//     without dilution    W + S_a + x S_t = 0,                 x = -(W + S_a) / S_t
+//     volume v into V0    (V0 + v) W + V0 S_a + v S_t = 0,     v = -V0 (W + S_a) / (W + S_t)
+// where x multiplies the titrant concentrations. A target that needs a negative or
+// infinite dose lies beyond what the titrant can reach and is reported as unreachable.
+//
+// With activity corrections the constants depend on the ionic strength and so on the dose;
+// the ionic strength is iterated to a fixed point, each step being one such pass.
+
+struct DoseOptions {
+    double V0;               // analyte volume; 0 adds the titrant without dilution
+    ActivityModel activity;  // non-ideal models take the target as -log10 a(H3O+)
+    double tol;              // on log10(gamma) of a singly charged ion
+    int max_outer;
+    double temperature;      // in C, for dose_cbe and dose_pbe; see PhOptions::temperature
+
+    DoseOptions() : V0(0.0), activity(), tol(1e-12), max_outer(50), temperature(kReferenceTemperature) {}
+};
+
+struct DoseResult {
+    double pH;              // the target
+    double dose;            // titrant volume, or the factor on its concentrations without V0
+    double ionic_strength;  // 0 for the ideal model
+    int outer_iterations;
+    bool reachable;
+};
+
+// `calc` holds the analyte species first (n_analyte of them) and then the titrant species;
+// `nominal` gives their concentrations in the analyte solution and in the titrant, as for
+// titrate(). The calculator is left at the concentrations of the returned dose.
+template <class Calc>
+DoseResult solve_dose(Calc &calc, const std::vector<double> &nominal, size_t n_analyte, double target_pH,
+                      const DoseOptions &options = DoseOptions()) {
+    if (options.activity.kind != ActivityModel::kIdeal && !calc.get_system().has_charges()) {
+        throw std::invalid_argument("Activity corrections need the charge of every species.");
+    }
+
+    DoseResult result;
+    result.pH = target_pH;
+    result.dose = std::numeric_limits<double>::quiet_NaN();
+    result.ionic_strength = 0.0;
+    result.outer_iterations = 0;
+    result.reachable = false;
+
+    const size_t n = nominal.size();
+    std::vector<double> weight_mean(n);
+    double f = 0.0;
+    for (int it = 1; it <= options.max_outer; ++it) {
+        result.outer_iterations = it;
+        calc.set_log_gamma_unit(f);
+        const System &system = calc.get_system();
+        const double pH = target_pH + f;  // concentration scale
+
+        system.weight_means(pH, weight_mean.data());
+        double S_a = 0.0, S_t = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            (i < n_analyte ? S_a : S_t) += nominal[i] * weight_mean[i];
+        }
+        double h3o = std::pow(10, -pH);
+        double W = h3o - system.get_Kw() / h3o;
+
+        double dose = options.V0 > 0 ? -options.V0 * (W + S_a) / (W + S_t) : -(W + S_a) / S_t;
+        if (!(std::isfinite(dose) && dose >= 0.0)) {
+            result.reachable = false;
+            return result;
+        }
+        result.dose = dose;
+        result.reachable = true;
+
+        double total = options.V0 + dose;
+        for (size_t i = 0; i < n; ++i) {
+            if (options.V0 > 0) {
+                calc.set_conc(i, i < n_analyte ? nominal[i] * options.V0 / total : nominal[i] * dose / total);
+            } else {
+                calc.set_conc(i, i < n_analyte ? nominal[i] : nominal[i] * dose);
+            }
+        }
+
+        if (options.activity.kind == ActivityModel::kIdeal) {
+            break;
+        }
+        result.ionic_strength = system.ionic_strength(pH);
+        double f_next = options.activity.log_gamma_unit(result.ionic_strength);
+        bool done = std::fabs(f_next - f) <= options.tol;
+        f = f_next;
+        if (done) {
+            break;
+        }
+    }
+    return result;
+}
+
+// Comma-separated list of target pH values, e.g. "4.5,7,9.25".
+inline std::vector<double> parse_pH_list(const std::string &list) {
+    std::vector<double> targets;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        char *end = nullptr;
+        double pH = std::strtod(item.c_str(), &end);
+        if (end == item.c_str() || *end != '\0' || !std::isfinite(pH)) {
+            throw std::invalid_argument("Invalid target pH '" + item + "'");
+        }
+        targets.push_back(pH);
+    }
+    if (targets.empty()) {
+        throw std::invalid_argument("No target pH given");
+    }
+    return targets;
+}
+
+inline void print_dose_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --dose <analyte.csv> <titrant.csv> <output.csv> --ph pH[,pH...] [--v0 V] [--kw Kw]\n", program);
+    fprintf(stderr, "          [--activity ideal|dh|davies]\n");
+    fprintf(stderr, "The analyte and titrant files use the batch CSV format; the first mixture of each is used.\n");
+    fprintf(stderr, "With --v0 the dose is the titrant volume added to V0, otherwise the factor on the titrant\n");
+    fprintf(stderr, "concentrations added without dilution. Unreachable targets are written as nan.\n");
+}
+
+// Command-line entry point of the dose mode, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int dose_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    if (argc < 5) {
+        print_dose_usage(argv[0]);
+        return 1;
+    }
+
+    DoseOptions options;
+    double Kw = 1.01e-14;
+    std::string targets_arg;
+    try {
+        for (int i = 5; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--ph" && i + 1 < argc) {
+                targets_arg = argv[++i];
+            } else if (arg == "--v0" && i + 1 < argc) {
+                options.V0 = option_positive(arg, argv[++i]);
+            } else if (arg == "--kw" && i + 1 < argc) {
+                Kw = option_positive(arg, argv[++i]);
+            } else if (arg == "--activity" && i + 1 < argc) {
+                options.activity = parse_activity_model(argv[++i]);
+            } else {
+                print_dose_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (targets_arg.empty()) {
+            print_dose_usage(argv[0]);
+            return 1;
+        }
+        std::vector<double> targets = parse_pH_list(targets_arg);
+
+        MixtureTable analyte = read_mixtures_csv(argv[2], n_weights);
+        MixtureTable titrant = read_mixtures_csv(argv[3], n_weights);
+        if (analyte.mixture_id.empty() || titrant.mixture_id.empty()) {
+            throw std::runtime_error("The analyte and titrant files must each define a mixture");
+        }
+
+        std::vector<Species> species = build_species<Species>(analyte.columns(), 0, make_species);
+        size_t n_analyte = species.size();
+        std::vector<Species> added = build_species<Species>(titrant.columns(), 0, make_species);
+        species.insert(species.end(), added.begin(), added.end());
+
+        std::vector<double> nominal;
+        for (const auto &s : species) {
+            nominal.push_back(s.get_conc());
+        }
+
+        FILE *out = fopen(argv[4], "w");
+        if (!out) {
+            throw std::runtime_error(std::string("Cannot open ") + argv[4]);
+        }
+        fprintf(out, options.V0 > 0 ? "pH,volume\n" : "pH,dose\n");
+
+        auto start = std::chrono::steady_clock::now();
+        Calc calc(species, Kw);
+        size_t unreachable = 0;
+        for (double pH : targets) {
+            DoseResult r = solve_dose(calc, nominal, n_analyte, pH, options);
+            fprintf(out, "%.12g,%.12e\n", r.pH, r.dose);
+            unreachable += r.reachable ? 0 : 1;
+        }
+        fclose(out);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "Computed %zu doses (%zu unreachable) in %.3f s\n", targets.size(), unreachable, seconds);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_DOSE_H
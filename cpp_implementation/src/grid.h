@@ -0,0 +1,379 @@
+#ifndef PH_GRID_H
+#define PH_GRID_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "alpha.h"
+#include "batch.h"
+#include "cli.h"
+#include "mapped_file.h"
+#include "mixture_io.h"
+#include "parallel.h"
+#include "system.h"
+
+// Evaluation of a whole system over a grid of pH values, for distribution diagrams and
+// residual curves. One pass fills a column-major table of one row per grid point:
+//     column 0: pH, column 1: balance residual,
+//     then the alpha fractions of every species in the order the species were added,
+//     each from its most protonated form,
+// so that every column is contiguous and can be exported as it is, e.g. into a mapped file.
+//
+// The grid is evaluated in blocks of kGridBlock points. Inside a block the powers of [H3O+]
+// are shared by all species and every loop runs over the points of the block with a fixed
+// trip count, so the work vectorises across grid points. On a uniform grid [H3O+] is stepped
+// by the factor 10^-step from one pow() per block instead of one per point, unless the steps
+// are so coarse that a block would span more than kGridSteppedRange pH units. A species whose
+// terms could leave the double range somewhere in a block (alpha_direct_safe) is evaluated
+// point by point in log space there. The pH is on the concentration scale, as for
+// System::residual.
+
+const size_t kGridBlock = 256;
+const double kGridSteppedRange = 100.0;
+
+// Number of columns GridEvaluator::evaluate writes for `system`.
+inline size_t grid_columns(const System &system) {
+    size_t n = 2;
+    for (const auto &group : system.get_groups()) {
+        n += group.n_terms * group.size;
+    }
+    return n;
+}
+
+class GridEvaluator {
+   public:
+    // Uniform grid of n_points pH values from `first` in steps of `step`.
+    GridEvaluator(double first, double step, size_t n_points)
+        : uniform(true), first(first), step(step), n_points(n_points) {
+        if (n_points == 0 || !std::isfinite(first) || !std::isfinite(step)) {
+            throw std::invalid_argument("Invalid pH grid.");
+        }
+        if (std::fabs(step) * kGridBlock <= kGridSteppedRange) {
+            step_pow.resize(kGridBlock);
+            for (size_t p = 0; p < kGridBlock; ++p) {
+                step_pow[p] = std::pow(10, -step * static_cast<double>(p));
+            }
+        }
+    }
+
+    // Any n_points pH values.
+    GridEvaluator(const double *pH, size_t n_points)
+        : uniform(false), first(0.0), step(0.0), values(pH, pH + n_points), n_points(n_points) {
+        if (n_points == 0) {
+            throw std::invalid_argument("Invalid pH grid.");
+        }
+    }
+
+    size_t size() const {
+        return n_points;
+    }
+
+    // Writes grid_columns(system) columns of size() rows; column c starts at out + c * ld.
+    // Safe to call from several threads for different outputs.
+    void evaluate(const System &system, double *out, size_t ld) const {
+        if (ld < n_points) {
+            throw std::invalid_argument("The grid output is shorter than the grid.");
+        }
+
+        size_t max_terms = 1;
+        for (const auto &group : system.get_groups()) {
+            max_terms = std::max(max_terms, group.n_terms);
+        }
+        const double Kw = system.get_Kw();
+        // Separate arrays, so that the compiler knows they do not overlap and vectorises the
+        // point loops without runtime alias checks. About 70 kB of stack.
+        alignas(64) double pH[kGridBlock], h[kGridBlock], res[kGridBlock], den[kGridBlock];
+        alignas(64) double h_pow[kMaxAlphaTerms * kGridBlock];  // h_pow[k * kGridBlock + p] = h[p]^k
+        alignas(64) double term[kMaxAlphaTerms * kGridBlock];   // term[i * kGridBlock + p]
+        double alpha[kMaxAlphaTerms];
+
+        for (size_t b = 0; b < n_points; b += kGridBlock) {
+            const size_t nb = std::min(kGridBlock, n_points - b);
+            fill_block(b, nb, pH, h);
+            double pH_max = 0.0;
+            for (size_t p = 0; p < nb; ++p) {
+                pH_max = std::max(pH_max, std::fabs(pH[p]));
+            }
+
+            for (size_t p = 0; p < kGridBlock; ++p) {
+                res[p] = h[p] - Kw / h[p];
+                h_pow[p] = 1.0;
+            }
+            for (size_t k = 1; k < max_terms; ++k) {
+                const double *prev = h_pow + (k - 1) * kGridBlock;
+                double *row = h_pow + k * kGridBlock;
+                for (size_t p = 0; p < kGridBlock; ++p) {
+                    row[p] = prev[p] * h[p];
+                }
+            }
+
+            size_t column = 2;
+            for (size_t sp = 0; sp < system.size(); ++sp) {
+                const System::Group &group = system.get_groups()[system.get_slot(sp).group];
+                const size_t s = system.get_slot(sp).index;
+                const size_t n = group.n_terms;
+
+                if (alpha_direct_safe(pH_max, n, group.log_prod_max)) {
+                    for (size_t p = 0; p < kGridBlock; ++p) {
+                        den[p] = 0.0;
+                    }
+                    for (size_t i = 0; i < n; ++i) {
+                        const double P = group.ka_prod[i * group.stride + s];
+                        const double *hp = h_pow + (n - 1 - i) * kGridBlock;
+                        double *t = term + i * kGridBlock;
+                        for (size_t p = 0; p < kGridBlock; ++p) {
+                            t[p] = hp[p] * P;
+                            den[p] += t[p];
+                        }
+                    }
+                    for (size_t p = 0; p < kGridBlock; ++p) {
+                        den[p] = 1.0 / den[p];
+                    }
+                    for (size_t i = 0; i < n; ++i) {
+                        const double cw = group.conc_weight[i * group.stride + s];
+                        double *t = term + i * kGridBlock;
+                        for (size_t p = 0; p < kGridBlock; ++p) {
+                            t[p] *= den[p];
+                            res[p] += cw * t[p];
+                        }
+                    }
+                } else {
+                    for (size_t p = 0; p < nb; ++p) {
+                        system.alpha(sp, pH[p], alpha);
+                        for (size_t i = 0; i < n; ++i) {
+                            term[i * kGridBlock + p] = alpha[i];
+                        }
+                    }
+                    for (size_t i = 0; i < n; ++i) {
+                        const double cw = group.conc_weight[i * group.stride + s];
+                        const double *t = term + i * kGridBlock;
+                        for (size_t p = 0; p < nb; ++p) {
+                            res[p] += cw * t[p];
+                        }
+                    }
+                }
+
+                for (size_t i = 0; i < n; ++i) {
+                    std::memcpy(out + (column + i) * ld + b, term + i * kGridBlock, nb * sizeof(double));
+                }
+                column += n;
+            }
+
+            std::memcpy(out + b, pH, nb * sizeof(double));
+            std::memcpy(out + ld + b, res, nb * sizeof(double));
+        }
+    }
+
+   private:
+    // pH and [H3O+] of points [b, b + nb), padded to a whole block with the last point.
+    void fill_block(size_t b, size_t nb, double *pH, double *h) const {
+        for (size_t p = 0; p < kGridBlock; ++p) {
+            size_t q = b + std::min(p, nb - 1);
+            pH[p] = uniform ? first + step * static_cast<double>(q) : values[q];
+        }
+        if (!step_pow.empty()) {
+            const double h_0 = std::pow(10, -pH[0]);
+            for (size_t p = 0; p < kGridBlock; ++p) {
+                h[p] = h_0 * step_pow[std::min(p, nb - 1)];
+            }
+        } else {
+            for (size_t p = 0; p < kGridBlock; ++p) {
+                h[p] = p < nb ? std::pow(10, -pH[p]) : h[nb - 1];
+            }
+        }
+    }
+
+    bool uniform;
+    double first, step;
+    std::vector<double> values;
+    size_t n_points;
+    std::vector<double> step_pow;  // 10^(-step * p) for p < kGridBlock; empty when not stepping
+};
+
+// Binary grid file: a header, the mixture ids, the first column of every mixture and then one
+// column-major matrix of n_points rows holding the columns of all mixtures back to back, each
+// mixture laid out as GridEvaluator writes it. The matrix starts at a multiple of 64 bytes.
+const char kGridMagic[8] = {'P', 'H', 'G', 'R', 'I', 'D', 'C', 'M'};
+const uint32_t kGridVersion = 1;
+
+struct GridFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t n_mixtures;
+    uint64_t n_points;
+    uint64_t n_columns;    // over all mixtures
+    uint64_t data_offset;  // of the matrix, in bytes
+};
+
+struct GridOptions {
+    double pH_min, pH_max;
+    size_t points;
+    unsigned threads;
+    bool binary;
+    double Kw;  // used for mixtures without their own Kw
+
+    GridOptions() : pH_min(0.0), pH_max(14.0), points(1401), threads(default_thread_count()), binary(false), Kw(1.01e-14) {}
+};
+
+// Evaluates mixture m into its columns at `out`, or fills them with NaN when the mixture
+// cannot be built.
+template <class Calc, class Species, class Factory>
+void evaluate_mixture_grid(const MixtureColumns &c, size_t m, const Factory &make_species, const GridEvaluator &grid,
+                           double Kw, double *out, size_t n_columns) {
+    try {
+        std::vector<Species> species = build_species<Species>(c, m, make_species);
+        Calc calc(species, c.Kw && c.Kw[m] > 0 ? c.Kw[m] : Kw);
+        grid.evaluate(calc.get_system(), out, grid.size());
+    } catch (const std::exception &) {
+        std::fill(out, out + n_columns * grid.size(), std::numeric_limits<double>::quiet_NaN());
+    }
+}
+
+inline void print_grid_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --grid <input> <output> [--range pH_min,pH_max] [--points N] [--binary] [--threads N]\n",
+            program);
+    fprintf(stderr, "           [--kw Kw]\n");
+    fprintf(stderr, "Evaluates the balance residual and the alpha fractions of every mixture of a batch input\n");
+    fprintf(stderr, "over a uniform pH grid (default 0 to 14, 1401 points). The CSV output has one line per\n");
+    fprintf(stderr, "mixture and point; --binary writes the columns of all mixtures into one column-major matrix.\n");
+}
+
+// Command-line entry point of the grid mode, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int grid_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    if (argc < 4) {
+        print_grid_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        GridOptions options;
+        for (int i = 4; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--range" && i + 1 < argc) {
+                std::string range = argv[++i];
+                size_t comma = range.find(',');
+                if (comma == std::string::npos) {
+                    throw std::invalid_argument("Expected --range pH_min,pH_max");
+                }
+                options.pH_min = option_number(arg, range.substr(0, comma).c_str());
+                options.pH_max = option_number(arg, range.substr(comma + 1).c_str());
+            } else if (arg == "--points" && i + 1 < argc) {
+                options.points = static_cast<size_t>(option_integer(arg, argv[++i], 1));
+            } else if (arg == "--binary") {
+                options.binary = true;
+            } else if (arg == "--threads" && i + 1 < argc) {
+                options.threads = option_threads(arg, argv[++i]);
+            } else if (arg == "--kw" && i + 1 < argc) {
+                options.Kw = option_positive(arg, argv[++i]);
+            } else {
+                print_grid_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (!(options.pH_min <= options.pH_max)) {
+            throw std::invalid_argument("The pH range must not be empty");
+        }
+
+        MixtureTable table;
+        std::unique_ptr<MappedMixtures> mapped;
+        MixtureColumns c;
+        if (is_mixture_binary(argv[2])) {
+            mapped.reset(new MappedMixtures(argv[2]));
+            c = mapped->columns();
+        } else {
+            table = read_mixtures_csv(argv[2], n_weights);
+            c = table.columns();
+        }
+
+        double step = options.points > 1 ? (options.pH_max - options.pH_min) / (options.points - 1) : 0.0;
+        GridEvaluator grid(options.pH_min, step, options.points);
+        const size_t n = grid.size();
+
+        // Columns of every mixture: pH, residual and one per alpha term.
+        std::vector<uint64_t> column_begin(c.n_mixtures + 1, 0);
+        for (size_t m = 0; m < c.n_mixtures; ++m) {
+            uint64_t rows = c.row_begin[m + 1] - c.row_begin[m];
+            uint64_t terms = c.value_begin[c.row_begin[m + 1]] - c.value_begin[c.row_begin[m]] + rows;
+            column_begin[m + 1] = column_begin[m] + 2 + terms;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (options.binary) {
+            GridFileHeader header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, kGridMagic, sizeof(header.magic));
+            header.version = kGridVersion;
+            header.n_mixtures = c.n_mixtures;
+            header.n_points = n;
+            header.n_columns = column_begin[c.n_mixtures];
+            size_t ids = sizeof(header) + 2 * c.n_mixtures * sizeof(uint64_t);
+            header.data_offset = (ids + 63) & ~uint64_t(63);
+
+            MappedOutputFile file(argv[3], header.data_offset + header.n_columns * n * sizeof(double));
+            char *base = file.get_data();
+            std::memcpy(base, &header, sizeof(header));
+            std::memcpy(base + sizeof(header), c.mixture_id, c.n_mixtures * sizeof(uint64_t));
+            std::memcpy(base + sizeof(header) + c.n_mixtures * sizeof(uint64_t), column_begin.data(),
+                        c.n_mixtures * sizeof(uint64_t));
+            double *matrix = reinterpret_cast<double *>(base + header.data_offset);
+
+            parallel_for(0, c.n_mixtures, options.threads, [&](size_t m) {
+                evaluate_mixture_grid<Calc, Species>(c, m, make_species, grid, options.Kw, matrix + column_begin[m] * n,
+                                                     column_begin[m + 1] - column_begin[m]);
+            }, 1);
+            file.sync();
+        } else {
+            FILE *out = fopen(argv[3], "w");
+            if (!out) {
+                throw std::runtime_error(std::string("Cannot open ") + argv[3]);
+            }
+            fprintf(out, "mixture,pH,residual,alphas\n");
+            std::vector<double> columns;
+            for (size_t m = 0; m < c.n_mixtures; ++m) {
+                size_t n_columns = column_begin[m + 1] - column_begin[m];
+                columns.resize(n_columns * n);
+                evaluate_mixture_grid<Calc, Species>(c, m, make_species, grid, options.Kw, columns.data(), n_columns);
+
+                std::vector<size_t> n_terms;
+                for (uint64_t r = c.row_begin[m]; r < c.row_begin[m + 1]; ++r) {
+                    n_terms.push_back(c.value_begin[r + 1] - c.value_begin[r] + 1);
+                }
+                for (size_t p = 0; p < n; ++p) {
+                    fprintf(out, "%llu,%.6f,%.6e,", (unsigned long long)c.mixture_id[m], columns[p], columns[n + p]);
+                    size_t column = 2;
+                    for (size_t s = 0; s < n_terms.size(); ++s) {
+                        for (size_t i = 0; i < n_terms[s]; ++i, ++column) {
+                            fprintf(out, "%s%.6e", i ? ";" : (s ? "|" : ""), columns[column * n + p]);
+                        }
+                    }
+                    fprintf(out, "\n");
+                }
+            }
+            fclose(out);
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "Evaluated %llu mixtures at %zu points in %.3f s: %.1f M values/s\n",
+                (unsigned long long)c.n_mixtures, n, seconds,
+                seconds > 0 ? column_begin[c.n_mixtures] * n / seconds * 1e-6 : 0.0);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_GRID_H
@@ -0,0 +1,251 @@
+#ifndef PH_JSON_H
+#define PH_JSON_H
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Minimal JSON reader for the server protocol: one document per line, parsed into a tree.
+// Every value remembers where it came from in the source text, so values can be echoed back
+// verbatim (request ids).
+
+struct JsonValue {
+    enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string text;  // string contents, unescaped
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue> > members;
+    size_t begin, end;  // source text of the value
+
+    JsonValue() : type(kNull), boolean(false), number(0.0), begin(0), end(0) {}
+
+    // Member `key` of an object, null when absent or not an object.
+    const JsonValue *get(const std::string &key) const {
+        if (type != kObject) {
+            return nullptr;
+        }
+        for (const auto &m : members) {
+            if (m.first == key) {
+                return &m.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+   public:
+    explicit JsonParser(const std::string &source) : s(source), pos(0) {}
+
+    JsonValue parse() {
+        JsonValue value = parse_value(0);
+        skip_space();
+        if (pos != s.size()) {
+            fail("trailing characters");
+        }
+        return value;
+    }
+
+   private:
+    static const int kMaxDepth = 64;
+
+    void fail(const char *what) const {
+        throw std::invalid_argument("Invalid JSON at offset " + std::to_string(pos) + ": " + what);
+    }
+
+    void skip_space() {
+        while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\n' || s[pos] == '\r')) {
+            ++pos;
+        }
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos < s.size() && s[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool literal(const char *word) {
+        size_t n = std::char_traits<char>::length(word);
+        if (s.compare(pos, n, word) != 0) {
+            return false;
+        }
+        pos += n;
+        return true;
+    }
+
+    JsonValue parse_value(int depth) {
+        if (depth > kMaxDepth) {
+            fail("nested too deeply");
+        }
+        skip_space();
+        if (pos >= s.size()) {
+            fail("unexpected end");
+        }
+
+        JsonValue v;
+        v.begin = pos;
+        char c = s[pos];
+        if (c == '{') {
+            ++pos;
+            v.type = JsonValue::kObject;
+            if (!consume('}')) {
+                do {
+                    skip_space();
+                    if (pos >= s.size() || s[pos] != '"') {
+                        fail("expected a member name");
+                    }
+                    std::string key = parse_string();
+                    if (!consume(':')) {
+                        fail("expected ':'");
+                    }
+                    v.members.push_back(std::make_pair(key, parse_value(depth + 1)));
+                } while (consume(','));
+                if (!consume('}')) {
+                    fail("expected ',' or '}'");
+                }
+            }
+        } else if (c == '[') {
+            ++pos;
+            v.type = JsonValue::kArray;
+            if (!consume(']')) {
+                do {
+                    v.items.push_back(parse_value(depth + 1));
+                } while (consume(','));
+                if (!consume(']')) {
+                    fail("expected ',' or ']'");
+                }
+            }
+        } else if (c == '"') {
+            v.type = JsonValue::kString;
+            v.text = parse_string();
+        } else if (literal("true") || literal("false")) {
+            v.type = JsonValue::kBool;
+            v.boolean = s[v.begin] == 't';
+        } else if (literal("null")) {
+            v.type = JsonValue::kNull;
+        } else {
+            v.type = JsonValue::kNumber;
+            v.number = parse_number();
+        }
+        v.end = pos;
+        return v;
+    }
+
+    double parse_number() {
+        size_t start = pos;
+        while (pos < s.size() && (std::isdigit(static_cast<unsigned char>(s[pos])) || s[pos] == '-' || s[pos] == '+' ||
+                                  s[pos] == '.' || s[pos] == 'e' || s[pos] == 'E')) {
+            ++pos;
+        }
+        std::string token = s.substr(start, pos - start);
+        char *end = nullptr;
+        double x = std::strtod(token.c_str(), &end);
+        if (token.empty() || *end != '\0') {
+            pos = start;
+            fail("invalid value");
+        }
+        return x;
+    }
+
+    std::string parse_string() {
+        ++pos;  // opening quote
+        std::string out;
+        while (pos < s.size() && s[pos] != '"') {
+            char c = s[pos++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= s.size()) {
+                break;
+            }
+            char e = s[pos++];
+            switch (e) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': append_utf8(out, parse_hex4()); break;
+                default: fail("invalid escape");
+            }
+        }
+        if (pos >= s.size()) {
+            fail("unterminated string");
+        }
+        ++pos;  // closing quote
+        return out;
+    }
+
+    unsigned parse_hex4() {
+        if (pos + 4 > s.size()) {
+            fail("invalid \\u escape");
+        }
+        unsigned code = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = s[pos++];
+            code <<= 4;
+            if (c >= '0' && c <= '9') {
+                code |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                code |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                code |= c - 'A' + 10;
+            } else {
+                fail("invalid \\u escape");
+            }
+        }
+        return code;
+    }
+
+    // Code points of the basic plane; surrogate pairs are passed through unpaired.
+    static void append_utf8(std::string &out, unsigned code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    const std::string &s;
+    size_t pos;
+};
+
+// `text` as a JSON string literal, quotes included.
+inline std::string json_quote(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(c));
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+#endif  // PH_JSON_H
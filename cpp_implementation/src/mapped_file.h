@@ -0,0 +1,113 @@
+#ifndef PH_MAPPED_FILE_H
+#define PH_MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+   public:
+    explicit MappedFile(const std::string &path) : data(nullptr), length(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map " + path);
+            }
+            data = static_cast<const char *>(p);
+            madvise(p, length, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (data) {
+            munmap(const_cast<char *>(data), length);
+        }
+    }
+
+    const char *get_data() const {
+        return data;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+   private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const char *data;
+    size_t length;
+};
+
+// Writable shared mapping of a file created, or truncated, at `length` bytes. Whatever is
+// written through get_data() ends up in the file; sync() waits until it has.
+class MappedOutputFile {
+   public:
+    MappedOutputFile(const std::string &path, size_t length) : data(nullptr), length(length) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot resize " + path);
+        }
+        if (length > 0) {
+            void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map " + path);
+            }
+            data = static_cast<char *>(p);
+        }
+        close(fd);
+    }
+
+    ~MappedOutputFile() {
+        if (data) {
+            munmap(data, length);
+        }
+    }
+
+    char *get_data() const {
+        return data;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    void sync() const {
+        if (data && msync(data, length, MS_SYNC) != 0) {
+            throw std::runtime_error("Failed to write a mapped file");
+        }
+    }
+
+   private:
+    MappedOutputFile(const MappedOutputFile &);
+    MappedOutputFile &operator=(const MappedOutputFile &);
+
+    char *data;
+    size_t length;
+};
+
+#endif  // PH_MAPPED_FILE_H
@@ -0,0 +1,119 @@
+#ifndef PH_MIXTURE_HANDLE_H
+#define PH_MIXTURE_HANDLE_H
+
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "solver.h"
+#include "temperature.h"
+
+// Mutable mixture for callers that change one component at a time and re-solve, such as a
+// dosing controller. The handle keeps the residual and slope of the last root up to date
+// through every edit. An edit evaluates only the species it touches
+// (System::species_residual) or the water term, so the next solve starts from the Newton step
+// of the last root without a full evaluation (solve_from); a small change then takes two or
+// three evaluations. Species are addressed by position as in the calculator: removing one
+// moves those after it down by one.
+//
+//     MixtureHandle<CBE_calc, Acid> mixture(species);
+//     mixture.solve();
+//     mixture.set_conc(1, 0.031);
+//     double pH = mixture.solve().pH;
+
+template <class Calc, class Species>
+class MixtureHandle {
+   public:
+    explicit MixtureHandle(const std::vector<Species> &species = std::vector<Species>(), double Kw = 1.01e-14,
+                           double celsius = kReferenceTemperature)
+        : calc(species, Kw, celsius), tol(1e-12), solved(false) {}
+
+    // Appends a species and returns its position.
+    size_t add_species(const Species &s) {
+        calc.add_species(s);
+        size_t index = size() - 1;
+        follow(index, 1.0);
+        return index;
+    }
+
+    void remove_species(size_t index) {
+        check_index(index);
+        follow(index, -1.0);
+        calc.remove_species(index);
+    }
+
+    void set_conc(size_t index, double conc) {
+        check_index(index);
+        follow(index, -1.0);
+        calc.set_conc(index, conc);
+        follow(index, 1.0);
+    }
+
+    // `Kw` at 25 C, as for the calculator.
+    void set_Kw(double Kw) {
+        follow_water(-1.0);
+        calc.set_Kw(Kw);
+        follow_water(1.0);
+    }
+
+    // Absolute tolerance on pH of the solves.
+    void set_tol(double tol) {
+        this->tol = tol;
+    }
+
+    // Re-solves from the last root, or over the whole search range when there is none yet or
+    // the last solve failed.
+    const SolveResult &solve() {
+        last = solved ? calc.solve_from(last.pH, last.residual, last.slope, tol) : calc.solve(7.0, true, 0, tol);
+        solved = last.converged;
+        return last;
+    }
+
+    // The last solve; after edits, its residual and slope are those of the edited mixture at
+    // its pH.
+    const SolveResult &get_result() const {
+        return last;
+    }
+
+    size_t size() const {
+        return calc.get_system().size();
+    }
+
+    const Calc &get_calc() const {
+        return calc;
+    }
+
+   private:
+    void check_index(size_t index) const {
+        if (index >= size()) {
+            throw std::invalid_argument("No such species.");
+        }
+    }
+
+    // Adds `sign` times the contribution of species `index` at the last root.
+    void follow(size_t index, double sign) {
+        if (solved) {
+            double d;
+            double x = calc.get_system().species_residual(index, last.pH, &d);
+            last.residual += sign * x;
+            last.slope += sign * d;
+        }
+    }
+
+    // The same for the -Kw/h part of the water term.
+    void follow_water(double sign) {
+        if (solved) {
+            double oh = calc.get_system().get_Kw() * std::pow(10, last.pH);
+            last.residual -= sign * oh;
+            last.slope -= sign * std::log(10.0) * oh;
+        }
+    }
+
+    Calc calc;
+    double tol;
+    SolveResult last;
+    bool solved;  // `last` is a root the edits since have been followed from
+};
+
+#endif  // PH_MIXTURE_HANDLE_H
@@ -0,0 +1,412 @@
+#ifndef PH_MIXTURE_IO_H
+#define PH_MIXTURE_IO_H
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+// Columnar storage of many mixtures for the batch mode.
+//
+// Every species is one row; the rows of a mixture are contiguous. Ka or pKa values of all
+// rows are concatenated into one column and addressed through value_begin. The integer
+// weights are the same ones the interactive prompts ask for: weight0 is the charge (CBE)
+// or the maximum proton (PBE), weight1 the reference proton (PBE only, 0 for the CBE).
+
+// Non-owning view of the columns, as consumed by the solver.
+struct MixtureColumns {
+    uint64_t n_mixtures;
+    uint64_t n_rows;
+    uint64_t n_values;
+    const uint64_t *mixture_id;   // [n_mixtures]
+    const double *Kw;             // [n_mixtures], 0 for the default; null in version 1 files
+    const uint64_t *row_begin;    // [n_mixtures + 1]
+    const uint64_t *value_begin;  // [n_rows + 1]
+    const double *values;         // [n_values]
+    const double *conc;           // [n_rows]
+    const int32_t *weight0;       // [n_rows]
+    const int32_t *weight1;       // [n_rows]
+    const uint8_t *is_pKa;        // [n_rows], 1 for pKa values, 0 for Ka values
+};
+
+class MixtureTable {
+   public:
+    MixtureTable() : row_begin(1, 0), value_begin(1, 0) {}
+
+    // Rows are appended to the current mixture as long as the id does not change.
+    void add_row(uint64_t mixture, bool pKa, const std::vector<double> &vals, int w0, int w1, double c) {
+        if (mixture_id.empty() || mixture_id.back() != mixture) {
+            if (!mixture_id.empty()) {
+                row_begin.push_back(conc.size());
+            }
+            mixture_id.push_back(mixture);
+            Kw.push_back(0.0);
+        }
+        values.insert(values.end(), vals.begin(), vals.end());
+        value_begin.push_back(values.size());
+        conc.push_back(c);
+        weight0.push_back(w0);
+        weight1.push_back(w1);
+        is_pKa.push_back(pKa ? 1 : 0);
+    }
+
+    MixtureColumns columns() const {
+        MixtureColumns c;
+        c.n_mixtures = mixture_id.size();
+        c.n_rows = conc.size();
+        c.n_values = values.size();
+        c.mixture_id = mixture_id.data();
+        c.Kw = Kw.data();
+        c.row_begin = row_begin.data();
+        c.value_begin = value_begin.data();
+        c.values = values.data();
+        c.conc = conc.data();
+        c.weight0 = weight0.data();
+        c.weight1 = weight1.data();
+        c.is_pKa = is_pKa.data();
+        return c;
+    }
+
+    // row_begin holds the start of every mixture; the end marker is appended on demand.
+    void finish() {
+        if (row_begin.size() == mixture_id.size()) {
+            row_begin.push_back(conc.size());
+        }
+    }
+
+    std::vector<uint64_t> mixture_id;
+    std::vector<double> Kw;
+    std::vector<uint64_t> row_begin;
+    std::vector<uint64_t> value_begin;
+    std::vector<double> values;
+    std::vector<double> conc;
+    std::vector<int32_t> weight0;
+    std::vector<int32_t> weight1;
+    std::vector<uint8_t> is_pKa;
+};
+
+// CSV input, one species per line:
+//     CBE: mixture,type,values,charge,conc
+//     PBE: mixture,type,values,proton,proton_ref,conc
+// `type` is Ka or pKa and `values` is a ';'-separated list. Blank lines, lines starting
+// with '#' and a header line are skipped.
+inline MixtureTable read_mixtures_csv(const std::string &path, int n_weights) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    MixtureTable table;
+    std::string line;
+    std::vector<std::string> fields;
+    std::vector<double> vals;
+    size_t line_no = 0;
+    const size_t n_fields = 4 + n_weights;
+
+    while (std::getline(in, line)) {
+        ++line_no;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        fields.clear();
+        size_t start = 0;
+        for (;;) {
+            size_t comma = line.find(',', start);
+            fields.push_back(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+
+        char *end;
+        uint64_t mixture = std::strtoull(fields[0].c_str(), &end, 10);
+        if (end == fields[0].c_str()) {
+            if (line_no == 1) {
+                continue;  // header
+            }
+            throw std::runtime_error("Invalid mixture id on line " + std::to_string(line_no));
+        }
+        if (fields.size() != n_fields) {
+            throw std::runtime_error("Expected " + std::to_string(n_fields) + " fields on line " + std::to_string(line_no));
+        }
+
+        bool pKa;
+        if (fields[1] == "pKa") {
+            pKa = true;
+        } else if (fields[1] == "Ka") {
+            pKa = false;
+        } else {
+            throw std::runtime_error("Unknown value type '" + fields[1] + "' on line " + std::to_string(line_no));
+        }
+
+        vals.clear();
+        const char *p = fields[2].c_str();
+        while (*p) {
+            double v = std::strtod(p, &end);
+            if (end == p) {
+                throw std::runtime_error("Invalid Ka/pKa list on line " + std::to_string(line_no));
+            }
+            vals.push_back(v);
+            p = *end == ';' ? end + 1 : end;
+        }
+
+        int w[2] = {0, 0};
+        for (int k = 0; k < n_weights; ++k) {
+            const std::string &field = fields[3 + k];
+            long v = std::strtol(field.c_str(), &end, 10);
+            if (end == field.c_str() || *end != '\0' || v < INT_MIN || v > INT_MAX) {
+                throw std::runtime_error("Invalid weight '" + field + "' on line " + std::to_string(line_no));
+            }
+            w[k] = static_cast<int>(v);
+        }
+        const std::string &conc = fields[3 + n_weights];
+        double c = std::strtod(conc.c_str(), &end);
+        if (end == conc.c_str() || *end != '\0' || !std::isfinite(c) || c < 0) {
+            throw std::runtime_error("Invalid concentration '" + conc + "' on line " + std::to_string(line_no));
+        }
+        table.add_row(mixture, pKa, vals, w[0], w[1], c);
+    }
+
+    table.finish();
+    return table;
+}
+
+// Conversion of the interactive prompt input (the format of io_test/*.sam.in): any number
+// of sessions, each giving the number of components, then per component the Ka/pKa choice,
+// the values, the weights and the concentration, then Kw and the report answer.
+inline MixtureTable read_mixtures_prompt(const std::string &path, int n_weights) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    MixtureTable table;
+    std::vector<double> vals;
+    uint64_t mixture = 0;
+    int num_components;
+    while (in >> num_components) {
+        if (num_components <= 0) {
+            throw std::runtime_error("Invalid number of components in session " + std::to_string(mixture + 1));
+        }
+        while (num_components) {
+            int choice, n;
+            if (!(in >> choice)) {
+                throw std::runtime_error("Truncated session " + std::to_string(mixture + 1));
+            }
+            if (choice != 1 && choice != 2) {
+                continue;  // the prompt asks again
+            }
+            if (!(in >> n) || n <= 0) {
+                throw std::runtime_error("Invalid number of Ka/pKa values in session " + std::to_string(mixture + 1));
+            }
+            vals.resize(n);
+            for (int i = 0; i < n; ++i) {
+                in >> vals[i];
+            }
+            int w0 = 0, w1 = 0;
+            double c;
+            in >> w0;
+            if (n_weights > 1) {
+                in >> w1;
+            }
+            in >> c;
+            if (!in) {
+                throw std::runtime_error("Truncated session " + std::to_string(mixture + 1));
+            }
+            table.add_row(mixture, choice == 2, vals, w0, w1, c);
+            num_components--;
+        }
+
+        double Kw;
+        int report;
+        if (!(in >> Kw)) {
+            throw std::runtime_error("Missing Kw in session " + std::to_string(mixture + 1));
+        }
+        table.Kw.back() = Kw;
+        in >> report;
+        in.clear();
+        mixture++;
+    }
+
+    table.finish();
+    return table;
+}
+
+// Binary columnar file: a fixed header followed by the columns in MixtureColumns order,
+// each padded to a multiple of 8 bytes so they can be used in place from a mapping.
+// Version 1 has no Kw column. All values are little-endian.
+const char kMixtureMagic[8] = {'P', 'H', 'M', 'I', 'X', 'C', 'O', 'L'};
+const uint32_t kMixtureVersion = 2;
+
+struct MixtureFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t n_mixtures;
+    uint64_t n_rows;
+    uint64_t n_values;
+};
+
+inline bool has_magic(const std::string &path, const char *magic) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    char buf[8];
+    bool ok = fread(buf, 1, sizeof(buf), f) == sizeof(buf) && std::memcmp(buf, magic, sizeof(buf)) == 0;
+    fclose(f);
+    return ok;
+}
+
+inline bool is_mixture_binary(const std::string &path) {
+    return has_magic(path, kMixtureMagic);
+}
+
+inline size_t padded_size(size_t bytes) {
+    return (bytes + 7) & ~size_t(7);
+}
+
+template <class T>
+void write_column(FILE *f, const T *data, size_t n) {
+    static const char zeros[8] = {0};
+    size_t bytes = n * sizeof(T);
+    size_t pad = padded_size(bytes) - bytes;
+    if ((bytes && fwrite(data, 1, bytes, f) != bytes) || (pad && fwrite(zeros, 1, pad, f) != pad)) {
+        throw std::runtime_error("Failed to write mixture column");
+    }
+}
+
+inline void write_mixtures_binary(const std::string &path, const MixtureColumns &c) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    MixtureFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMixtureMagic, sizeof(header.magic));
+    header.version = kMixtureVersion;
+    header.n_mixtures = c.n_mixtures;
+    header.n_rows = c.n_rows;
+    header.n_values = c.n_values;
+
+    std::vector<double> default_Kw;
+    const double *Kw = c.Kw;
+    if (!Kw) {
+        default_Kw.assign(c.n_mixtures, 0.0);
+        Kw = default_Kw.data();
+    }
+
+    try {
+        write_column(f, &header, 1);
+        write_column(f, c.mixture_id, c.n_mixtures);
+        write_column(f, Kw, c.n_mixtures);
+        write_column(f, c.row_begin, c.n_mixtures + 1);
+        write_column(f, c.value_begin, c.n_rows + 1);
+        write_column(f, c.values, c.n_values);
+        write_column(f, c.conc, c.n_rows);
+        write_column(f, c.weight0, c.n_rows);
+        write_column(f, c.weight1, c.n_rows);
+        write_column(f, c.is_pKa, c.n_rows);
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+// Zero-copy view of a binary mixture file: the columns point straight into the mapping.
+class MappedMixtures {
+   public:
+    explicit MappedMixtures(const std::string &path) : file(path) {
+        if (file.size() < sizeof(MixtureFileHeader)) {
+            throw std::runtime_error(path + " is not a mixture file");
+        }
+        MixtureFileHeader header;
+        std::memcpy(&header, file.get_data(), sizeof(header));
+        if (std::memcmp(header.magic, kMixtureMagic, sizeof(header.magic)) != 0) {
+            throw std::runtime_error(path + " is not a mixture file");
+        }
+        if (header.version < 1 || header.version > kMixtureVersion) {
+            throw std::runtime_error("Unsupported mixture file version " + std::to_string(header.version));
+        }
+
+        if (header.n_mixtures >= file.size() || header.n_rows >= file.size() || header.n_values >= file.size()) {
+            throw std::runtime_error("Truncated mixture file");
+        }
+
+        offset = padded_size(sizeof(header));
+        view.n_mixtures = header.n_mixtures;
+        view.n_rows = header.n_rows;
+        view.n_values = header.n_values;
+        view.mixture_id = column<uint64_t>(header.n_mixtures);
+        view.Kw = header.version >= 2 ? column<double>(header.n_mixtures) : nullptr;
+        view.row_begin = column<uint64_t>(header.n_mixtures + 1);
+        view.value_begin = column<uint64_t>(header.n_rows + 1);
+        view.values = column<double>(header.n_values);
+        view.conc = column<double>(header.n_rows);
+        view.weight0 = column<int32_t>(header.n_rows);
+        view.weight1 = column<int32_t>(header.n_rows);
+        view.is_pKa = column<uint8_t>(header.n_rows);
+
+        // build_species indexes the rows and values through these without further checks.
+        if (!valid_offsets(view.row_begin, header.n_mixtures, header.n_rows) ||
+            !valid_offsets(view.value_begin, header.n_rows, header.n_values)) {
+            throw std::runtime_error(path + " has inconsistent offsets");
+        }
+    }
+
+    const MixtureColumns &columns() const {
+        return view;
+    }
+
+   private:
+    // n + 1 offsets starting at 0, non-decreasing and ending at `total`.
+    static bool valid_offsets(const uint64_t *begin, uint64_t n, uint64_t total) {
+        if (begin[0] != 0 || begin[n] != total) {
+            return false;
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            if (begin[i + 1] < begin[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <class T>
+    const T *column(uint64_t n) {
+        // Header counts are untrusted: the size must neither overflow nor pass the end.
+        if (n > (file.size() - offset) / sizeof(T)) {
+            throw std::runtime_error("Truncated mixture file");
+        }
+        size_t bytes = padded_size(n * sizeof(T));
+        if (bytes > file.size() - offset) {
+            throw std::runtime_error("Truncated mixture file");
+        }
+        const T *p = reinterpret_cast<const T *>(file.get_data() + offset);
+        offset += bytes;
+        return p;
+    }
+
+    MappedFile file;
+    MixtureColumns view;
+    size_t offset;
+};
+
+#endif  // PH_MIXTURE_IO_H
@@ -0,0 +1,225 @@
+#ifndef PH_PARALLEL_H
+#define PH_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline unsigned default_thread_count() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+// Runs f(i) for every i in [begin, end) on `threads` workers. Indices are handed out in
+// chunks from a shared counter, so uneven solve times balance out across workers.
+template <class F>
+void parallel_for(size_t begin, size_t end, unsigned threads, const F &f, size_t chunk = 64) {
+    if (end <= begin) {
+        return;
+    }
+    size_t n_chunks = (end - begin + chunk - 1) / chunk;
+    threads = static_cast<unsigned>(std::min<size_t>(std::max(threads, 1u), n_chunks));
+
+    std::atomic<size_t> next(begin);
+    auto worker = [&]() {
+        for (;;) {
+            size_t lo = next.fetch_add(chunk);
+            if (lo >= end) {
+                break;
+            }
+            size_t hi = std::min(lo + chunk, end);
+            for (size_t i = lo; i < hi; ++i) {
+                f(i);
+            }
+        }
+    };
+
+    if (threads == 1) {
+        worker();
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto &t : pool) {
+        t.join();
+    }
+}
+
+// Persistent pool for splitting a single solve: a call to run() hands out `n_tasks` task
+// indices and returns once all are done, typically a few microseconds of work each, so the
+// threads are kept alive between calls and spin briefly before going to sleep.
+//
+// Every worker starts on its own contiguous share of the tasks and, once that is exhausted,
+// steals the upper half of the largest share left, so a worker that was descheduled or got
+// the expensive tasks does not hold up the others. The calling thread works as worker 0.
+// run() is safe to call from several threads; a caller that finds the pool busy, or that is
+// already running tasks of a pool, runs all its tasks on its own.
+class WorkStealingPool {
+   public:
+    explicit WorkStealingPool(unsigned threads = default_thread_count())
+        : shares(std::max(threads, 1u)), generation(0), pending(0), job(nullptr), context(nullptr), stop(false) {
+        for (unsigned w = 1; w < shares.size(); ++w) {
+            workers.push_back(std::thread(&WorkStealingPool::work, this, w));
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            stop = true;
+            generation++;
+        }
+        wake.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    unsigned size() const {
+        return static_cast<unsigned>(shares.size());
+    }
+
+    // Runs f(task) for every task in [0, n_tasks). `f` must not throw.
+    template <class F>
+    void run(size_t n_tasks, const F &f) {
+        std::unique_lock<std::mutex> busy(run_mutex, std::try_to_lock);
+        if (!busy.owns_lock() || in_worker() || shares.size() == 1 || n_tasks < 2) {
+            for (size_t t = 0; t < n_tasks; ++t) {
+                f(t);
+            }
+            return;
+        }
+
+        const size_t n_shares = shares.size();
+        for (size_t w = 0; w < n_shares; ++w) {
+            std::lock_guard<std::mutex> lock(shares[w].mutex);
+            shares[w].begin = n_tasks * w / n_shares;
+            shares[w].end = n_tasks * (w + 1) / n_shares;
+        }
+        context = &f;
+        job = &call<F>;
+        pending.store(n_shares - 1);
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            generation++;
+        }
+        wake.notify_all();
+
+        in_worker() = true;
+        drain(0);
+        in_worker() = false;
+        while (pending.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+
+   private:
+    static const int kSpin = 1 << 12;  // polls of the generation before a worker sleeps
+
+    // Tasks [begin, end) not yet taken from one worker's share. Padded to a cache line.
+    struct Share {
+        std::mutex mutex;
+        size_t begin, end;
+        char pad[64];
+
+        Share() : begin(0), end(0) {}
+    };
+
+    template <class F>
+    static void call(const void *f, size_t task) {
+        (*static_cast<const F *>(f))(task);
+    }
+
+    static bool &in_worker() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    bool take(size_t w, size_t &task) {
+        std::lock_guard<std::mutex> lock(shares[w].mutex);
+        if (shares[w].begin == shares[w].end) {
+            return false;
+        }
+        task = shares[w].begin++;
+        return true;
+    }
+
+    // Moves the upper half of the largest other share to worker w; false once all are empty.
+    bool steal(size_t w) {
+        size_t victim = w, most = 0;
+        for (size_t v = 0; v < shares.size(); ++v) {
+            std::lock_guard<std::mutex> lock(shares[v].mutex);
+            if (v != w && shares[v].end - shares[v].begin > most) {
+                victim = v, most = shares[v].end - shares[v].begin;
+            }
+        }
+        if (victim == w) {
+            return false;
+        }
+
+        size_t begin, end;
+        {
+            std::lock_guard<std::mutex> lock(shares[victim].mutex);
+            if (shares[victim].begin == shares[victim].end) {
+                return true;  // taken meanwhile, look again
+            }
+            end = shares[victim].end;
+            begin = shares[victim].begin + (end - shares[victim].begin) / 2;
+            shares[victim].end = begin;
+        }
+        std::lock_guard<std::mutex> lock(shares[w].mutex);
+        shares[w].begin = begin;
+        shares[w].end = end;
+        return true;
+    }
+
+    void drain(size_t w) {
+        size_t task;
+        do {
+            while (take(w, task)) {
+                job(context, task);
+            }
+        } while (steal(w));
+    }
+
+    void work(size_t w) {
+        in_worker() = true;
+        unsigned long seen = 0;
+        for (;;) {
+            for (int i = 0; i < kSpin && generation.load() == seen; ++i) {
+                std::this_thread::yield();
+            }
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                wake.wait(lock, [&]() { return generation.load() != seen; });
+                seen = generation.load();
+                if (stop) {
+                    return;
+                }
+            }
+            drain(w);
+            pending.fetch_sub(1);
+        }
+    }
+
+    std::vector<Share> shares;
+    std::vector<std::thread> workers;
+    std::mutex run_mutex;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::atomic<unsigned long> generation;
+    std::atomic<size_t> pending;
+    void (*job)(const void *, size_t);
+    const void *context;
+    bool stop;
+};
+
+#endif  // PH_PARALLEL_H
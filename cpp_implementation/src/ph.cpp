@@ -0,0 +1,127 @@
+#include "ph.h"
+
+namespace {
+
+template <class Calc>
+PhResult solve_calc(Calc &calc, size_t n_species, const PhOptions &options) {
+    PhResult result;
+    result.ionic_strength = 0.0;
+    calc.set_pool(options.pool);
+
+    SolveResult r;
+    double pH_conc;
+    if (options.activity.kind == ActivityModel::kIdeal) {
+        r = options.cache ? options.cache->solve(calc, options.tol) : calc.solve(options.guess, options.guess_est, 1500, options.tol);
+        result.pH = pH_conc = r.pH;
+        result.converged = r.converged;
+    } else {
+        ActivitySolveResult a = solve_activity(calc, options.activity, options.tol);
+        r = a.solve;
+        pH_conc = r.pH;
+        result.pH = a.pH;
+        result.converged = a.converged;
+        result.ionic_strength = a.ionic_strength;
+    }
+    result.residual = r.residual;
+    result.iterations = r.iterations;
+    result.evaluations = r.evaluations;
+    result.condition = r.condition;
+    result.buffer_capacity = -r.slope;
+
+    if (options.alphas) {
+        const System &system = calc.get_system();
+        result.alphas.resize(n_species);
+        double alpha[kMaxAlphaTerms];
+        for (size_t s = 0; s < n_species; ++s) {
+            system.alpha(s, pH_conc, alpha);
+            const System::Group &group = system.get_groups()[system.get_slot(s).group];
+            result.alphas[s].assign(alpha, alpha + group.n_terms);
+        }
+    }
+    if (options.sensitivities) {
+        result.sensitivities.resize(n_species);
+        calc.get_system().sensitivities(pH_conc, r.slope, result.sensitivities.data());
+    }
+    if (options.verify) {
+        result.check = calc.check_balance(r, options.tol);
+    }
+    return result;
+}
+
+// Enthalpies of a database system, for species whose constants hold at `celsius`; none in
+// version 1 files, whose constants are those at 25 C.
+void add_thermo(AcidSpecies &species, const SpeciesDatabase::System &system, double celsius) {
+    if (system.dH) {
+        species.set_thermo(std::vector<double>(system.dH, system.dH + system.n_Ka),
+                           std::vector<double>(system.dCp, system.dCp + system.n_Ka), celsius);
+    }
+}
+
+template <class Calc, class Species>
+std::vector<DoseResult> dose_calc(const std::vector<Species> &analyte, const std::vector<Species> &titrant,
+                                  const std::vector<double> &targets, double Kw, const DoseOptions &options) {
+    std::vector<Species> species(analyte);
+    species.insert(species.end(), titrant.begin(), titrant.end());
+    std::vector<double> nominal;
+    for (const auto &s : species) {
+        nominal.push_back(s.get_conc());
+    }
+
+    Calc calc(species, Kw, options.temperature);
+    std::vector<DoseResult> results;
+    for (double pH : targets) {
+        results.push_back(solve_dose(calc, nominal, analyte.size(), pH, options));
+    }
+    return results;
+}
+
+}  // namespace
+
+PhResult solve_cbe(const std::vector<Acid> &species, double Kw, const PhOptions &options) {
+    CBE_calc calc(species, Kw, options.temperature);
+    return solve_calc(calc, species.size(), options);
+}
+
+PhResult solve_pbe(const std::vector<PBE_Acid> &acids, double Kw, const PhOptions &options) {
+    PBE_calc calc(acids, Kw, options.temperature);
+    return solve_calc(calc, acids.size(), options);
+}
+
+std::vector<DoseResult> dose_cbe(const std::vector<Acid> &analyte, const std::vector<Acid> &titrant,
+                                 const std::vector<double> &targets, double Kw, const DoseOptions &options) {
+    return dose_calc<CBE_calc>(analyte, titrant, targets, Kw, options);
+}
+
+std::vector<DoseResult> dose_pbe(const std::vector<PBE_Acid> &analyte, const std::vector<PBE_Acid> &titrant,
+                                 const std::vector<double> &targets, double Kw, const DoseOptions &options) {
+    return dose_calc<PBE_calc>(analyte, titrant, targets, Kw, options);
+}
+
+Acid make_cbe_species(const SpeciesDatabase::System &system, int held, double conc, double celsius) {
+    double pKa[kMaxAlphaTerms], Ka[kMaxAlphaTerms], Ka_prod[kMaxAlphaTerms];
+    system_constants_at(system, celsius, pKa, Ka, Ka_prod);
+    Acid acid(pKa, Ka, Ka_prod, system.n_Ka, system.charge, conc);
+    acid.set_protons(static_cast<int>(system.n_Ka), held);
+    add_thermo(acid, system, celsius);
+    return acid;
+}
+
+PBE_Acid make_pbe_species(const SpeciesDatabase::System &system, int held, double conc, double celsius) {
+    double pKa[kMaxAlphaTerms], Ka[kMaxAlphaTerms], Ka_prod[kMaxAlphaTerms];
+    system_constants_at(system, celsius, pKa, Ka, Ka_prod);
+    int n_Ka = static_cast<int>(system.n_Ka);
+    PBE_Acid acid(pKa, Ka, Ka_prod, system.n_Ka, n_Ka, held, conc);
+    acid.set_charge(system.charge);
+    add_thermo(acid, system, celsius);
+    return acid;
+}
+
+PhResult solve_cbe(const SpeciesDatabase &db, const std::string &mixture, double Kw, const PhOptions &options) {
+    std::vector<MixtureComponent> components = parse_mixture_spec(db, mixture);
+    return solve_cbe(build_species<Acid>(db, components, make_cbe_species, options.temperature), Kw, options);
+}
+
+PhResult solve_pbe(const SpeciesDatabase &db, const std::string &mixture, double Kw, const PhOptions &options) {
+    std::vector<MixtureComponent> components = parse_mixture_spec(db, mixture);
+    return solve_pbe(build_species<PBE_Acid>(db, components, make_pbe_species, options.temperature), Kw, options);
+}
@@ -0,0 +1,88 @@
+#ifndef PH_PH_H
+#define PH_PH_H
+
+#include <string>
+#include <vector>
+
+#include "CBE.h"
+#include "PBE.h"
+#include "activity.h"
+#include "dose.h"
+#include "grid.h"
+#include "mixture_handle.h"
+#include "solve_cache.h"
+#include "species_db.h"
+
+// Non-interactive solve API, built into exec/libph.a and exec/libph.so. Nothing here
+// prints; failures are reported through PhResult::converged, invalid input by exceptions.
+//
+//     std::vector<Acid> species = {Acid({}, {1.97, 6.82, 12.5}, 0, 0.01), Acid({}, {9.25}, 1, 0.03)};
+//     PhResult r = solve_cbe(species);
+//     if (r.converged) use(r.pH, r.alphas);
+
+struct PhOptions {
+    double guess;        // initial pH, ignored with guess_est
+    bool guess_est;      // bracket the root over the search range instead of around guess
+    double tol;          // absolute tolerance on pH
+    bool alphas;         // fill PhResult::alphas
+    bool sensitivities;  // fill PhResult::sensitivities
+    bool verify;         // fill PhResult::check; needs both the charges and the proton levels
+    double temperature;  // in C; Kw and the constants of species without enthalpy data are kept
+    ActivityModel activity;
+    SolveCache *cache;       // optional, shared between calls and threads; ideal model only
+    WorkStealingPool *pool;  // optional, splits the solve of one large mixture, see System::set_pool
+
+    PhOptions()
+        : guess(7.0),
+          guess_est(true),
+          tol(1e-12),
+          alphas(true),
+          sensitivities(false),
+          verify(false),
+          temperature(kReferenceTemperature),
+          activity(),
+          cache(nullptr),
+          pool(nullptr) {}
+};
+
+struct PhResult {
+    double pH;               // -log10 a(H3O+); equal to -log10[H3O+] for the ideal model
+    double residual;         // signed balance residual at the solution
+    int iterations;
+    int evaluations;
+    bool converged;
+    double ionic_strength;   // 0 for the ideal model
+    double condition;        // pH shift per unit relative error in the balance, see System::condition
+    double buffer_capacity;  // strong base per unit of pH, in mol/L
+    std::vector<std::vector<double> > alphas;  // per species, in the order given
+    std::vector<double> sensitivities;         // dpH/dc per species in L/mol, see System::sensitivities
+    BalanceCheck check;                        // the other balance, see BalanceCalc::check_balance
+};
+
+PhResult solve_cbe(const std::vector<Acid> &species, double Kw = 1.01e-14, const PhOptions &options = PhOptions());
+PhResult solve_pbe(const std::vector<PBE_Acid> &acids, double Kw = 1.01e-14, const PhOptions &options = PhOptions());
+
+// Titrant doses bringing the analyte to each target pH, see solve_dose; the species of both
+// are given at their concentrations in the analyte solution and in the titrant.
+std::vector<DoseResult> dose_cbe(const std::vector<Acid> &analyte, const std::vector<Acid> &titrant,
+                                 const std::vector<double> &targets, double Kw = 1.01e-14,
+                                 const DoseOptions &options = DoseOptions());
+std::vector<DoseResult> dose_pbe(const std::vector<PBE_Acid> &analyte, const std::vector<PBE_Acid> &titrant,
+                                 const std::vector<double> &targets, double Kw = 1.01e-14,
+                                 const DoseOptions &options = DoseOptions());
+
+// Species of one part of a database compound, built from the precomputed tables at `celsius`.
+// They carry both the charges and the proton levels, so activity corrections and
+// PhOptions::verify work for either balance, and the enthalpies of their steps.
+Acid make_cbe_species(const SpeciesDatabase::System &system, int held, double conc,
+                      double celsius = kReferenceTemperature);
+PBE_Acid make_pbe_species(const SpeciesDatabase::System &system, int held, double conc,
+                          double celsius = kReferenceTemperature);
+
+// Mixtures given as "Na2HPO4 0.01, NH4Cl 0.03", see parse_mixture_spec.
+PhResult solve_cbe(const SpeciesDatabase &db, const std::string &mixture, double Kw = 1.01e-14,
+                   const PhOptions &options = PhOptions());
+PhResult solve_pbe(const SpeciesDatabase &db, const std::string &mixture, double Kw = 1.01e-14,
+                   const PhOptions &options = PhOptions());
+
+#endif  // PH_PH_H
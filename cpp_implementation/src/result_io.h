@@ -0,0 +1,225 @@
+#ifndef PH_RESULT_IO_H
+#define PH_RESULT_IO_H
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "mapped_file.h"
+#include "solver.h"
+
+// Writers for batch results. The CSV writer is line oriented; the binary writer appends
+// fixed-size records after a header, so a partially written file can be resumed from the
+// last complete record and read back in place through MappedResults.
+
+const char kResultMagic[8] = {'P', 'H', 'R', 'E', 'S', 'U', 'L', 'T'};
+const uint32_t kResultVersion = 2;
+
+// Version 1 ends after n_mixtures; such files can be read but not resumed.
+struct ResultFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t n_mixtures;   // number of mixtures in the input the file belongs to
+    uint64_t fingerprint;  // of the input and solve options, see batch_fingerprint
+};
+
+inline size_t result_header_size(uint32_t version) {
+    return version == 1 ? offsetof(ResultFileHeader, fingerprint) : sizeof(ResultFileHeader);
+}
+
+struct ResultRecord {
+    uint64_t mixture_id;
+    double pH;
+    double residual;
+    int32_t iterations;
+    int32_t evaluations;
+    uint32_t converged;
+    uint32_t reserved;
+};
+
+inline ResultRecord make_result_record(uint64_t mixture_id, const SolveResult &r) {
+    ResultRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.mixture_id = mixture_id;
+    record.pH = r.pH;
+    record.residual = r.residual;
+    record.iterations = r.iterations;
+    record.evaluations = r.evaluations;
+    record.converged = r.converged ? 1 : 0;
+    return record;
+}
+
+class ResultWriter {
+   public:
+    virtual ~ResultWriter() {}
+    // `columns` holds the optional CSV columns, already formatted and comma separated.
+    virtual void write(uint64_t mixture_id, const SolveResult &r, const std::string &columns) = 0;
+    virtual void flush() = 0;
+};
+
+class CsvResultWriter : public ResultWriter {
+   public:
+    CsvResultWriter(const std::string &path, bool alphas, bool sensitivities = false)
+        : extra(alphas || sensitivities) {
+        out = fopen(path.c_str(), "w");
+        if (!out) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        fprintf(out, "mixture,pH,residual,iterations,evaluations,converged%s%s\n", alphas ? ",alphas" : "",
+                sensitivities ? ",buffer_capacity,sensitivities" : "");
+    }
+
+    ~CsvResultWriter() {
+        fclose(out);
+    }
+
+    void write(uint64_t mixture_id, const SolveResult &r, const std::string &columns) {
+        fprintf(out, "%llu,%.12f,%.6e,%d,%d,%d", (unsigned long long)mixture_id, r.pH, r.residual, r.iterations,
+                r.evaluations, r.converged ? 1 : 0);
+        if (extra) {
+            fprintf(out, ",%s", columns.c_str());
+        }
+        fprintf(out, "\n");
+    }
+
+    void flush() {
+        fflush(out);
+    }
+
+   private:
+    FILE *out;
+    bool extra;
+};
+
+class BinaryResultWriter : public ResultWriter {
+   public:
+    // With `resume`, an existing file for the same input, i.e. with the same `fingerprint`, is
+    // kept up to its last complete record and `completed()` tells how many mixtures are
+    // already solved; a file of another input is rejected.
+    BinaryResultWriter(const std::string &path, uint64_t n_mixtures, uint64_t fingerprint, bool resume) : done(0) {
+        if (resume && access(path.c_str(), F_OK) == 0) {
+            done = complete_records(path, n_mixtures, fingerprint);
+            if (truncate(path.c_str(), sizeof(ResultFileHeader) + done * sizeof(ResultRecord)) != 0) {
+                throw std::runtime_error("Cannot truncate " + path);
+            }
+            out = fopen(path.c_str(), "ab");
+        } else {
+            out = fopen(path.c_str(), "wb");
+            if (out) {
+                ResultFileHeader header;
+                std::memset(&header, 0, sizeof(header));
+                std::memcpy(header.magic, kResultMagic, sizeof(header.magic));
+                header.version = kResultVersion;
+                header.record_size = sizeof(ResultRecord);
+                header.n_mixtures = n_mixtures;
+                header.fingerprint = fingerprint;
+                if (fwrite(&header, sizeof(header), 1, out) != 1) {
+                    fclose(out);
+                    throw std::runtime_error("Failed to write the header of " + path);
+                }
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+    }
+
+    ~BinaryResultWriter() {
+        fclose(out);
+    }
+
+    void write(uint64_t mixture_id, const SolveResult &r, const std::string &) {
+        ResultRecord record = make_result_record(mixture_id, r);
+        if (fwrite(&record, sizeof(record), 1, out) != 1) {
+            throw std::runtime_error("Failed to write result record");
+        }
+    }
+
+    void flush() {
+        fflush(out);
+    }
+
+    uint64_t completed() const {
+        return done;
+    }
+
+   private:
+    static uint64_t complete_records(const std::string &path, uint64_t n_mixtures, uint64_t fingerprint) {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        ResultFileHeader header;
+        bool ok = fread(&header, sizeof(header), 1, f) == 1;
+        fclose(f);
+        if (!ok || std::memcmp(header.magic, kResultMagic, sizeof(header.magic)) != 0 ||
+            header.version != kResultVersion || header.record_size != sizeof(ResultRecord)) {
+            throw std::runtime_error(path + " is not a result file that can be resumed");
+        }
+        if (header.n_mixtures != n_mixtures) {
+            throw std::runtime_error(path + " belongs to an input with a different number of mixtures");
+        }
+        if (header.fingerprint != fingerprint) {
+            throw std::runtime_error(path + " belongs to a different input or was solved with different options");
+        }
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            throw std::runtime_error("Cannot stat " + path);
+        }
+        uint64_t records = (static_cast<uint64_t>(st.st_size) - sizeof(header)) / sizeof(ResultRecord);
+        return records < n_mixtures ? records : n_mixtures;
+    }
+
+    FILE *out;
+    uint64_t done;
+};
+
+// Zero-copy view of a binary result file; a trailing partial record is ignored.
+class MappedResults {
+   public:
+    explicit MappedResults(const std::string &path) : file(path), records(nullptr), n(0) {
+        const size_t v1_size = result_header_size(1);
+        if (file.size() < v1_size) {
+            throw std::runtime_error(path + " is not a result file");
+        }
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(&header, file.get_data(), v1_size);
+        if (std::memcmp(header.magic, kResultMagic, sizeof(header.magic)) != 0 || header.version < 1 ||
+            header.version > kResultVersion || header.record_size != sizeof(ResultRecord) ||
+            file.size() < result_header_size(header.version)) {
+            throw std::runtime_error(path + " is not a result file");
+        }
+        const size_t header_size = result_header_size(header.version);
+        std::memcpy(&header, file.get_data(), header_size);
+        records = reinterpret_cast<const ResultRecord *>(file.get_data() + header_size);
+        n = (file.size() - header_size) / sizeof(ResultRecord);
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    uint64_t expected() const {
+        return header.n_mixtures;
+    }
+
+    const ResultRecord &operator[](size_t i) const {
+        return records[i];
+    }
+
+   private:
+    MappedFile file;
+    ResultFileHeader header;
+    const ResultRecord *records;
+    size_t n;
+};
+
+#endif  // PH_RESULT_IO_H
@@ -0,0 +1,421 @@
+#ifndef PH_SERVER_H
+#define PH_SERVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cli.h"
+#include "json.h"
+
+// Server mode: a long-lived process answering newline-delimited JSON requests on stdin or on
+// a Unix domain socket, one request per line:
+//
+//     {"id": 7, "species": [{"pKa": [1.97, 6.82, 12.5], "charge": 0, "conc": 0.01},
+//                           {"Ka": [5.6e-10], "charge": 1, "conc": 0.03}], "alphas": true}
+//
+// PBE species give "proton" and "proton_ref" instead of "charge", as the batch CSV columns do;
+// "kw" and "alphas" are optional. Each request is answered by one line,
+//
+//     {"id": 7, "pH": 8.952950275964, "converged": true, "iterations": 4, "evaluations": 7,
+//      "alphas": [[...], [...]]}
+//
+// or {"id": 7, "error": "..."}, with the id copied verbatim. A reader thread per input splits
+// lines into a bounded queue that a pool of workers drains, so responses are written in
+// completion order, not request order, and clients match them up by id. Reading stops while
+// the queue is full, so a client has to read responses while it is still sending requests.
+
+// Where the responses of one input go. Written whole lines at a time by the workers.
+class ServerConnection {
+   public:
+    ServerConnection(int fd, bool owned) : fd(fd), owned(owned) {}
+
+    ~ServerConnection() {
+        if (owned) {
+            close(fd);
+        }
+    }
+
+    // Lost clients are ignored; their remaining responses are dropped.
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t done = 0;
+        while (done < line.size()) {
+            ssize_t n = write(fd, line.data() + done, line.size() - done);
+            if (n <= 0) {
+                return;
+            }
+            done += static_cast<size_t>(n);
+        }
+    }
+
+   private:
+    int fd;
+    bool owned;  // a socket closed with the connection, not stdin/stdout
+    std::mutex mutex;
+};
+
+struct ServerJob {
+    std::shared_ptr<ServerConnection> connection;
+    std::string line;
+};
+
+// Bounded so that a fast client cannot queue up unbounded memory; readers wait instead.
+class ServerQueue {
+   public:
+    explicit ServerQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // False once the queue is closed; the job is dropped then.
+    bool push(ServerJob job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this]() { return jobs.size() < capacity || closed; });
+        if (closed) {
+            return false;
+        }
+        jobs.push_back(std::move(job));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // False once the queue is closed and drained.
+    bool pop(ServerJob &job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return !jobs.empty() || closed; });
+        if (jobs.empty()) {
+            return false;
+        }
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+   private:
+    size_t capacity;
+    bool closed;
+    std::deque<ServerJob> jobs;
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+};
+
+struct ServerStats {
+    std::atomic<size_t> requests;
+    std::atomic<size_t> errors;
+
+    ServerStats() : requests(0), errors(0) {}
+};
+
+inline double json_number(const JsonValue *v, const char *name) {
+    if (!v || v->type != JsonValue::kNumber) {
+        throw std::invalid_argument(std::string("Missing or invalid \"") + name + "\"");
+    }
+    return v->number;
+}
+
+// An integer field such as a charge; fractions and values outside the int range are rejected.
+inline int json_int(const JsonValue *v, const char *name) {
+    double x = json_number(v, name);
+    if (!(x >= INT_MIN && x <= INT_MAX) || x != std::floor(x)) {
+        throw std::invalid_argument(std::string("\"") + name + "\" must be an integer");
+    }
+    return static_cast<int>(x);
+}
+
+inline double json_positive(const JsonValue *v, const char *name) {
+    double x = json_number(v, name);
+    if (!(x > 0) || !std::isfinite(x)) {
+        throw std::invalid_argument(std::string("\"") + name + "\" must be a finite number > 0");
+    }
+    return x;
+}
+
+// Builds the species of one request with the same factory as the batch mode.
+template <class Species, class Factory>
+std::vector<Species> parse_server_species(const JsonValue &request, int n_weights, const Factory &make_species) {
+    const JsonValue *list = request.get("species");
+    if (!list || list->type != JsonValue::kArray || list->items.empty()) {
+        throw std::invalid_argument("Missing or empty \"species\"");
+    }
+
+    const char *weight_names[2] = {n_weights == 1 ? "charge" : "proton", "proton_ref"};
+    std::vector<Species> species;
+    std::vector<double> values;
+    for (const JsonValue &item : list->items) {
+        const JsonValue *pKa = item.get("pKa");
+        const JsonValue *Ka = pKa ? nullptr : item.get("Ka");
+        const JsonValue *constants = pKa ? pKa : Ka;
+        if (!constants || constants->type != JsonValue::kArray) {
+            throw std::invalid_argument("Every species needs a \"pKa\" or \"Ka\" array");
+        }
+        values.clear();
+        for (const JsonValue &x : constants->items) {
+            values.push_back(json_number(&x, pKa ? "pKa" : "Ka"));
+        }
+
+        int weight[2] = {0, 0};
+        for (int w = 0; w < n_weights; ++w) {
+            weight[w] = json_int(item.get(weight_names[w]), weight_names[w]);
+        }
+        species.push_back(make_species(values, pKa != nullptr, weight[0], weight[1], json_number(item.get("conc"), "conc")));
+    }
+    return species;
+}
+
+// Answers one request line; never throws.
+template <class Calc, class Species, class Factory>
+std::string answer_request(const std::string &line, int n_weights, const Factory &make_species, const BatchOptions &options,
+                           ServerStats &stats) {
+    std::string id = "null";
+    char buf[160];
+    try {
+        JsonValue request = JsonParser(line).parse();
+        if (request.type != JsonValue::kObject) {
+            throw std::invalid_argument("A request must be a JSON object");
+        }
+        const JsonValue *id_value = request.get("id");
+        if (id_value) {
+            id = line.substr(id_value->begin, id_value->end - id_value->begin);
+        }
+
+        std::vector<Species> species = parse_server_species<Species>(request, n_weights, make_species);
+        const JsonValue *kw = request.get("kw");
+        Calc calc(species, kw ? json_positive(kw, "kw") : options.Kw);
+        double pH_conc;
+        SolveResult r = solve_with_options(calc, options, pH_conc);
+
+        snprintf(buf, sizeof(buf), ", \"pH\": %.12f, \"converged\": %s, \"iterations\": %d, \"evaluations\": %d", r.pH,
+                 r.converged ? "true" : "false", r.iterations, r.evaluations);
+        std::string response = "{\"id\": " + id + buf;
+
+        const JsonValue *alphas = request.get("alphas");
+        if (alphas && alphas->type == JsonValue::kBool && alphas->boolean) {
+            response += ", \"alphas\": [";
+            double alpha[kMaxAlphaTerms];
+            for (size_t s = 0; s < species.size(); ++s) {
+                calc.get_system().alpha(s, pH_conc, alpha);
+                for (size_t i = 0; i < species[s].get_alpha_size(); ++i) {
+                    snprintf(buf, sizeof(buf), "%s%.6e", i ? ", " : (s ? "], [" : "["), alpha[i]);
+                    response += buf;
+                }
+            }
+            response += "]]";
+        }
+        stats.requests++;
+        return response + "}\n";
+    } catch (const std::exception &e) {
+        stats.requests++;
+        stats.errors++;
+        return "{\"id\": " + id + ", \"error\": " + json_quote(e.what()) + "}\n";
+    }
+}
+
+// Longest request line accepted; longer lines are answered with an error and skipped, so
+// that a client that never sends a newline cannot make the reader buffer without bound.
+const size_t kMaxRequestLine = 1 << 22;
+
+// Splits the input of `connection` into lines and queues them until end of input or until
+// the queue is closed.
+inline void read_requests(const std::shared_ptr<ServerConnection> &connection, int fd, ServerQueue &queue) {
+    const std::string too_long = "{\"id\": null, \"error\": \"request too long\"}\n";
+    std::string pending;
+    size_t scanned = 0;      // bytes of `pending` known to hold no newline
+    bool skipping = false;   // dropping the rest of a line that was too long
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pending.append(chunk, static_cast<size_t>(n));
+
+        size_t start = 0, eol;
+        while ((eol = pending.find('\n', std::max(start, scanned))) != std::string::npos) {
+            if (skipping) {
+                skipping = false;
+            } else if (eol - start > kMaxRequestLine) {
+                connection->send(too_long);
+            } else if (eol > start) {
+                ServerJob job = {connection, pending.substr(start, eol - start)};
+                if (!queue.push(std::move(job))) {
+                    return;
+                }
+            }
+            start = eol + 1;
+        }
+        pending.erase(0, start);
+        if (!skipping && pending.size() > kMaxRequestLine) {
+            connection->send(too_long);
+            skipping = true;
+        }
+        if (skipping) {
+            pending.clear();
+        }
+        scanned = pending.size();
+    }
+    if (!skipping && pending.find_first_not_of(" \t\r") != std::string::npos) {
+        ServerJob job = {connection, pending};
+        queue.push(std::move(job));  // dropped when the server is shutting down
+    }
+}
+
+inline void print_server_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --serve [--socket path] [--threads N] [--kw Kw] [--activity ideal|dh|davies] [--cache entries]\n",
+            program);
+    fprintf(stderr, "Reads one JSON request per line from stdin, or from every client of the Unix socket, and\n");
+    fprintf(stderr, "writes one JSON response per line in completion order.\n");
+}
+
+// Command-line entry point of the server mode, shared by the CBE and PBE executables.
+// Binds a Unix socket at `path` and listens on it; returns -1 after reporting an error.
+inline int listen_on(const std::string &path) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Cannot create a socket at %s: the path is too long\n", path.c_str());
+        return -1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Error: Cannot create a socket at %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", path.c_str(), strerror(errno));
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+template <class Calc, class Species, class Factory>
+int server_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    BatchOptions options;
+    std::string socket_path;
+    size_t cache_entries = 0;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--socket" && i + 1 < argc) {
+                socket_path = argv[++i];
+            } else if (arg == "--threads" && i + 1 < argc) {
+                options.threads = option_threads(arg, argv[++i]);
+            } else if (arg == "--kw" && i + 1 < argc) {
+                options.Kw = option_positive(arg, argv[++i]);
+            } else if (arg == "--activity" && i + 1 < argc) {
+                options.activity = parse_activity_model(argv[++i]);
+            } else if (arg == "--cache" && i + 1 < argc) {
+                cache_entries = static_cast<size_t>(option_integer(arg, argv[++i], 1));
+            } else {
+                print_server_usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+
+    std::unique_ptr<SolveCache> cache;
+    if (cache_entries) {
+        SolveCacheOptions cache_options;
+        cache_options.capacity = cache_entries;
+        cache.reset(new SolveCache(cache_options));
+        options.cache = cache.get();
+    }
+
+    signal(SIGPIPE, SIG_IGN);  // a client that goes away must not end the server
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<ServerQueue> queue = std::make_shared<ServerQueue>(16 * options.threads + 256);
+    ServerStats stats;
+    // The listener is set up before the workers start, so that a failure leaves no threads
+    // to join.
+    int listener = -1;
+    if (!socket_path.empty()) {
+        listener = listen_on(socket_path);
+        if (listener < 0) {
+            return 1;
+        }
+        fprintf(stderr, "Listening on %s with %u workers\n", socket_path.c_str(), options.threads);
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < options.threads; ++t) {
+        workers.push_back(std::thread([&]() {
+            ServerJob job;
+            while (queue->pop(job)) {
+                job.connection->send(answer_request<Calc, Species>(job.line, n_weights, make_species, options, stats));
+                job.connection.reset();
+            }
+        }));
+    }
+
+    if (listener < 0) {
+        read_requests(std::make_shared<ServerConnection>(STDOUT_FILENO, false), STDIN_FILENO, *queue);
+    } else {
+        // Runs until killed; every client gets its own detached reader thread, which shares
+        // the queue so that it stays valid until the last reader is gone. Running out of
+        // descriptors or memory is usually temporary under load, so accept() backs off and
+        // retries instead of ending the server.
+        for (;;) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+                fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+                break;
+            }
+            std::shared_ptr<ServerConnection> connection = std::make_shared<ServerConnection>(client, true);
+            std::thread([connection, client, queue]() { read_requests(connection, client, *queue); }).detach();
+        }
+        close(listener);
+    }
+
+    queue->close();
+    for (auto &t : workers) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "Answered %zu requests (%zu errors) in %.3f s: %.0f requests/s\n", stats.requests.load(),
+            stats.errors.load(), seconds, seconds > 0 ? stats.requests / seconds : 0.0);
+    return 0;
+}
+
+#endif  // PH_SERVER_H
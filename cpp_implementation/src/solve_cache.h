@@ -0,0 +1,377 @@
+#ifndef PH_SOLVE_CACHE_H
+#define PH_SOLVE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "solver.h"
+#include "system.h"
+
+// Memoised solves. A mixture is canonicalised from its System: every species becomes the
+// record [n_terms, weights..., log10 Ka product bits..., q(conc)] (log10, so that products out
+// of the double range stay distinct), the records are ordered by their hash so the order
+// species were added in does not matter, and Kw and the activity scale are appended.
+// Concentrations are quantised on a log scale, q = round(ln(conc) / ln(1 + conc_tol)), so
+// mixtures within the relative tolerance share an entry. Activity-corrected systems get their
+// own entries.
+//
+// The same key with a coarser quantisation (warm_tol) indexes the last pH seen for nearly
+// the same composition, which is used as a warm start on a miss.
+//
+// Each entry keeps the tolerance it was solved to and only answers requests for that
+// tolerance or a looser one; a stricter request re-solves from the cached pH and replaces it.
+
+const char kCacheMagic[8] = {'P', 'H', 'C', 'A', 'C', 'H', 'E', '3'};
+const char kCacheMagicV2[8] = {'P', 'H', 'C', 'A', 'C', 'H', 'E', '2'};  // entries without a tolerance
+
+struct SolveCacheOptions {
+    size_t capacity;  // entries over all shards
+    double conc_tol;  // relative concentration difference treated as equal
+    double warm_tol;  // relative concentration difference still used for warm starts
+    size_t shards;    // independently locked parts of the store
+
+    SolveCacheOptions() : capacity(1 << 16), conc_tol(1e-9), warm_tol(0.05), shards(16) {}
+};
+
+struct SolveCacheStats {
+    size_t hits;
+    size_t warm_hits;  // misses that found a warm-start pH
+    size_t misses;
+    size_t evictions;
+    size_t size;
+};
+
+struct SolveCacheKey {
+    std::vector<int64_t> data;
+    uint64_t hash;
+    uint64_t warm_hash;
+};
+
+inline uint64_t cache_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 29);
+}
+
+inline int64_t cache_bits(double x) {
+    int64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+class SolveCache {
+   public:
+    explicit SolveCache(const SolveCacheOptions &options = SolveCacheOptions())
+        : options(options),
+          step(std::log1p(options.conc_tol)),
+          warm_step(std::log1p(std::max(options.warm_tol, options.conc_tol))),
+          shards(std::max<size_t>(1, options.shards)),
+          hits(0),
+          warm_hits(0),
+          misses(0),
+          evictions(0) {
+        per_shard = std::max<size_t>(1, options.capacity / shards.size());
+    }
+
+    SolveCacheKey make_key(const System &system) const {
+        const std::vector<System::Group> &groups = system.get_groups();
+        const size_t n = system.size();
+        struct Record {
+            uint64_t hash;
+            int64_t q;
+            size_t species;
+            bool operator<(const Record &o) const {
+                return hash < o.hash || (hash == o.hash && species < o.species);
+            }
+        };
+        std::vector<Record> order(n);
+        size_t length = 2;
+        for (size_t sp = 0; sp < n; ++sp) {
+            const System::Slot &slot = system.get_slot(sp);
+            const System::Group &group = groups[slot.group];
+            int64_t q = quantise(group.conc[slot.index]);
+            uint64_t h = group.n_terms;
+            for (size_t i = 0; i < group.n_terms; ++i) {
+                size_t k = i * group.stride + slot.index;
+                h = (h ^ static_cast<uint64_t>(static_cast<int64_t>(group.weight[k]))) * 0x100000001b3ULL;
+                h = (h ^ static_cast<uint64_t>(cache_bits(group.log_ka_prod_base[k]))) * 0x100000001b3ULL;
+            }
+            Record record = {cache_mix(h, static_cast<uint64_t>(q)), q, sp};
+            order[sp] = record;
+            length += 2 + 2 * group.n_terms;
+        }
+        std::sort(order.begin(), order.end());
+
+        SolveCacheKey key;
+        key.data.resize(length);
+        int64_t *out = key.data.data();
+        for (const auto &record : order) {
+            const System::Slot &slot = system.get_slot(record.species);
+            const System::Group &group = groups[slot.group];
+            *out++ = static_cast<int64_t>(group.n_terms);
+            for (size_t i = 0; i < group.n_terms; ++i) {
+                *out++ = static_cast<int64_t>(group.weight[i * group.stride + slot.index]);
+            }
+            for (size_t i = 0; i < group.n_terms; ++i) {
+                *out++ = cache_bits(group.log_ka_prod_base[i * group.stride + slot.index]);
+            }
+            *out++ = record.q;
+        }
+        *out++ = cache_bits(system.get_Kw());
+        *out = cache_bits(system.get_log_gamma_unit());
+        hash_key(key);
+        return key;
+    }
+
+    // True on a hit, an entry solved to `tol` or tighter. On a miss, `warm_pH` receives the
+    // pH of the same mixture solved more loosely, or else of a similar mixture, if one is
+    // known and NaN otherwise.
+    bool lookup(const SolveCacheKey &key, SolveResult &result, double &warm_pH, double tol = 1e-12) {
+        {
+            Shard &shard = shard_of(key.hash);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(key.hash);
+            if (it != shard.index.end() && it->second->key == key.data) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                if (it->second->tol <= tol) {
+                    result = it->second->result;
+                    hits++;
+                    return true;
+                }
+                warm_pH = it->second->result.pH;
+                misses++;
+                warm_hits++;
+                return false;
+            }
+        }
+        misses++;
+
+        // One lock at a time, so concurrent lookups cannot deadlock.
+        Shard &warm_shard = shard_of(key.warm_hash);
+        std::lock_guard<std::mutex> lock(warm_shard.mutex);
+        auto it = warm_shard.warm.find(key.warm_hash);
+        warm_pH = it == warm_shard.warm.end() ? std::numeric_limits<double>::quiet_NaN() : it->second;
+        if (!std::isnan(warm_pH)) {
+            warm_hits++;
+        }
+        return false;
+    }
+
+    // `tol` is the tolerance `result` was solved to. An entry of the same mixture solved to a
+    // tighter tolerance is kept.
+    void insert(const SolveCacheKey &key, const SolveResult &result, double tol) {
+        {
+            Shard &shard = shard_of(key.hash);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(key.hash);
+            if (it != shard.index.end()) {
+                if (it->second->key != key.data || tol <= it->second->tol) {
+                    it->second->key = key.data;
+                    it->second->result = result;
+                    it->second->tol = tol;
+                }
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            } else {
+                Entry entry = {key.data, key.hash, result, tol};
+                shard.lru.push_front(entry);
+                shard.index[key.hash] = shard.lru.begin();
+                if (shard.lru.size() > per_shard) {
+                    shard.index.erase(shard.lru.back().hash);
+                    shard.lru.pop_back();
+                    evictions++;
+                }
+            }
+        }
+        if (result.converged) {
+            Shard &warm_shard = shard_of(key.warm_hash);
+            std::lock_guard<std::mutex> lock(warm_shard.mutex);
+            if (warm_shard.warm.size() >= per_shard) {
+                warm_shard.warm.clear();
+            }
+            warm_shard.warm[key.warm_hash] = result.pH;
+        }
+    }
+
+    // Solves `calc` through the cache. Hits report zero evaluations.
+    template <class Calc>
+    SolveResult solve(const Calc &calc, double tol = 1e-12) {
+        SolveCacheKey key = make_key(calc.get_system());
+        SolveResult result;
+        double warm_pH;
+        if (lookup(key, result, warm_pH, tol)) {
+            result.iterations = result.evaluations = result.bracket_evaluations = 0;
+            return result;
+        }
+        result = std::isnan(warm_pH) ? calc.solve(7.0, false, 0, tol) : calc.solve_warm(warm_pH, 0.05, tol);
+        if (result.converged) {
+            insert(key, result, tol);
+        }
+        return result;
+    }
+
+    SolveCacheStats get_stats() const {
+        SolveCacheStats stats = {hits, warm_hits, misses, evictions, 0};
+        for (const auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.size += shard.lru.size();
+        }
+        return stats;
+    }
+
+    // Persistence: entries are written least recently used first, so loading them in file
+    // order restores the LRU order. A file written with another conc_tol is rejected. Entries
+    // of version 2 files have no tolerance and are only used as warm starts.
+    void save(const std::string &path) const {
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        fwrite(kCacheMagic, 1, sizeof(kCacheMagic), f);
+        fwrite(&options.conc_tol, sizeof(double), 1, f);
+        for (const auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.lru.rbegin(); it != shard.lru.rend(); ++it) {
+                uint32_t n = static_cast<uint32_t>(it->key.size());
+                fwrite(&n, sizeof(n), 1, f);
+                fwrite(it->key.data(), sizeof(int64_t), n, f);
+                fwrite(&it->tol, sizeof(double), 1, f);
+                write_result(f, it->result);
+            }
+        }
+        if (fclose(f) != 0) {
+            throw std::runtime_error("Failed to write " + path);
+        }
+    }
+
+    // Returns the number of entries loaded; a missing file loads nothing.
+    size_t load(const std::string &path) {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return 0;
+        }
+        char magic[8];
+        double conc_tol;
+        bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic);
+        const bool has_tol = ok && std::memcmp(magic, kCacheMagic, sizeof(magic)) == 0;
+        if (!ok || (!has_tol && std::memcmp(magic, kCacheMagicV2, sizeof(magic)) != 0) ||
+            fread(&conc_tol, sizeof(double), 1, f) != 1) {
+            fclose(f);
+            throw std::runtime_error(path + " is not a solve cache file");
+        }
+        if (conc_tol != options.conc_tol) {
+            fclose(f);
+            throw std::runtime_error(path + " was written with a different concentration tolerance");
+        }
+
+        size_t loaded = 0;
+        uint32_t n;
+        SolveCacheKey key;
+        while (fread(&n, sizeof(n), 1, f) == 1 && n < (1u << 24)) {
+            key.data.resize(n);
+            SolveResult result;
+            double tol = std::numeric_limits<double>::infinity();
+            if (fread(key.data.data(), sizeof(int64_t), n, f) != n || (has_tol && fread(&tol, sizeof(double), 1, f) != 1) ||
+                !read_result(f, result)) {
+                break;
+            }
+            hash_key(key);
+            insert(key, result, tol);
+            loaded++;
+        }
+        fclose(f);
+        return loaded;
+    }
+
+   private:
+    struct Entry {
+        std::vector<int64_t> key;
+        uint64_t hash;
+        SolveResult result;
+        double tol;  // the result was solved to
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> lru;  // most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        std::unordered_map<uint64_t, double> warm;
+    };
+
+    int64_t quantise(double conc) const {
+        if (!(conc > 0)) {
+            return std::numeric_limits<int64_t>::min();
+        }
+        return static_cast<int64_t>(std::llround(std::log(conc) / step));
+    }
+
+    // Hashes the key, and the key with every concentration requantised on the warm scale.
+    void hash_key(SolveCacheKey &key) const {
+        const uint64_t prime = 0x100000001b3ULL;
+        uint64_t h = 0, w = 0;
+        const double ratio = step / warm_step;
+        size_t p = 0;
+        while (p + 2 < key.data.size()) {
+            size_t n_terms = static_cast<size_t>(key.data[p]);
+            for (size_t j = 0; j < 1 + 2 * n_terms; ++j, ++p) {
+                uint64_t v = static_cast<uint64_t>(key.data[p]);
+                h = (h ^ v) * prime;
+                w = (w ^ v) * prime;
+            }
+            int64_t q = key.data[p++];
+            h = (h ^ static_cast<uint64_t>(q)) * prime;
+            w = (w ^ (q == std::numeric_limits<int64_t>::min() ? static_cast<uint64_t>(q)
+                                                                : static_cast<uint64_t>(std::llround(q * ratio)))) *
+                prime;
+        }
+        for (; p < key.data.size(); ++p) {
+            h = (h ^ static_cast<uint64_t>(key.data[p])) * prime;
+            w = (w ^ static_cast<uint64_t>(key.data[p])) * prime;
+        }
+        key.hash = cache_mix(h, 0);
+        key.warm_hash = cache_mix(w, 0x5741524dULL);
+    }
+
+    Shard &shard_of(uint64_t hash) {
+        return shards[(hash >> 48) % shards.size()];
+    }
+
+    static void write_result(FILE *f, const SolveResult &r) {
+        double values[4] = {r.pH, r.residual, r.slope, r.condition};
+        int32_t counts[4] = {r.iterations, r.evaluations, r.bracket_evaluations, r.converged ? 1 : 0};
+        fwrite(values, sizeof(double), 4, f);
+        fwrite(counts, sizeof(int32_t), 4, f);
+    }
+
+    static bool read_result(FILE *f, SolveResult &r) {
+        double values[4];
+        int32_t counts[4];
+        if (fread(values, sizeof(double), 4, f) != 4 || fread(counts, sizeof(int32_t), 4, f) != 4) {
+            return false;
+        }
+        r.pH = values[0], r.residual = values[1], r.slope = values[2], r.condition = values[3];
+        r.iterations = counts[0], r.evaluations = counts[1], r.bracket_evaluations = counts[2];
+        r.converged = counts[3] != 0;
+        return true;
+    }
+
+    SolveCacheOptions options;
+    double step, warm_step;
+    std::vector<Shard> shards;
+    size_t per_shard;
+    std::atomic<size_t> hits, warm_hits, misses, evictions;
+};
+
+#endif  // PH_SOLVE_CACHE_H
@@ -0,0 +1,341 @@
+#ifndef PH_SOLVER_H
+#define PH_SOLVER_H
+
+#include <cmath>
+#include <vector>
+
+#include "parallel.h"
+#include "trace.h"
+
+// Root-finding engine shared by CBE_calc and PBE_calc.
+//
+// Both balance equations are strictly decreasing in pH when written as a signed
+// residual (positive charge / proton excess on the acidic side), so the root can
+// always be bracketed and then polished with safeguarded Newton steps.
+
+struct SolveResult {
+    double pH;
+    double residual;          // signed residual at pH
+    double slope;             // d(residual)/d(pH) at pH
+    int iterations;           // Newton / bisection steps after bracketing
+    int evaluations;          // total residual evaluations, bracketing included
+    int bracket_evaluations;  // evaluations spent finding the bracket
+    bool converged;
+    double condition;         // pH shift per unit relative error in the balance, see System::condition
+
+    SolveResult()
+        : pH(0.0),
+          residual(0.0),
+          slope(0.0),
+          iterations(0),
+          evaluations(0),
+          bracket_evaluations(0),
+          converged(false),
+          condition(0.0) {}
+};
+
+// pH interval known to contain the root, with the residual and slope at both ends.
+struct Bracket {
+    double lo, hi;
+    double r_lo, r_hi;
+    double d_lo, d_hi;
+    int evaluations;
+    bool found;
+
+    Bracket() : lo(0.0), hi(0.0), r_lo(0.0), r_hi(0.0), d_lo(0.0), d_hi(0.0), evaluations(0), found(false) {}
+};
+
+// pH range searched when no initial guess is trusted. Wider than 0-14 so concentrated
+// acids and bases are covered; roots outside are still found by expanding the range.
+const double kSearchMinPH = -2.0;
+const double kSearchMaxPH = 16.0;
+
+// Extends a bracket whose ends have the same sign outwards, on that side, with doubling
+// steps; false when no sign change turns up. On success b.found is set.
+template <class Residual>
+bool extend_range(const Residual &f, Bracket &b) {
+    double step = b.hi - b.lo;
+    for (int i = 0; i < 64 && b.r_lo < 0; ++i, step *= 2.0) {
+        b.hi = b.lo, b.r_hi = b.r_lo, b.d_hi = b.d_lo;
+        b.lo -= step;
+        b.r_lo = f(b.lo, &b.d_lo);
+        b.evaluations++;
+    }
+    for (int i = 0; i < 64 && b.r_hi > 0; ++i, step *= 2.0) {
+        b.lo = b.hi, b.r_lo = b.r_hi, b.d_lo = b.d_hi;
+        b.hi += step;
+        b.r_hi = f(b.hi, &b.d_hi);
+        b.evaluations++;
+    }
+    b.found = b.r_lo >= 0 && b.r_hi <= 0;
+    return b.found;
+}
+
+// Bracket search over [lo, hi]: both ends are evaluated and the interval is halved on the
+// side of the sign change until it is narrower than `width`, i.e. log2((hi - lo) / width)
+// evaluations. If both ends have the same sign the root lies outside and the range is
+// extended on that side with doubling steps.
+template <class Residual>
+Bracket bracket_range(const Residual &f, double lo, double hi, double width) {
+    Bracket b;
+    b.lo = lo;
+    b.hi = hi;
+    b.r_lo = f(lo, &b.d_lo);
+    b.r_hi = f(hi, &b.d_hi);
+    b.evaluations = 2;
+    if (!extend_range(f, b)) {
+        return b;
+    }
+
+    while (b.hi - b.lo > width && b.r_lo != 0.0 && b.r_hi != 0.0) {
+        double mid = 0.5 * (b.lo + b.hi);
+        double d;
+        double r = f(mid, &d);
+        b.evaluations++;
+        if (r > 0) {
+            b.lo = mid, b.r_lo = r, b.d_lo = d;
+        } else {
+            b.hi = mid, b.r_hi = r, b.d_hi = d;
+        }
+    }
+    return b;
+}
+
+// bracket_range on a thread pool: both ends are evaluated at once, and every round then
+// evaluates pool.size() evenly spaced interior points, one task each, keeping the piece
+// with the sign change. The bracket shrinks by a factor of size() + 1 per round instead of
+// 2, for more evaluations in total but fewer rounds. `f` must be safe to call concurrently.
+template <class Residual>
+Bracket bracket_range_parallel(const Residual &f, double lo, double hi, double width, WorkStealingPool &pool) {
+    const size_t n = pool.size();
+    std::vector<double> x(n + 1), r(n + 1), d(n + 1);
+
+    Bracket b;
+    x[0] = lo;
+    x[1] = hi;
+    pool.run(2, [&](size_t i) { r[i] = f(x[i], &d[i]); });
+    b.lo = lo, b.r_lo = r[0], b.d_lo = d[0];
+    b.hi = hi, b.r_hi = r[1], b.d_hi = d[1];
+    b.evaluations = 2;
+    if (!extend_range(f, b)) {
+        return b;
+    }
+
+    while (b.hi - b.lo > width && b.r_lo != 0.0 && b.r_hi != 0.0) {
+        for (size_t i = 1; i <= n; ++i) {
+            x[i] = b.lo + (b.hi - b.lo) * i / (n + 1);
+        }
+        pool.run(n, [&](size_t i) { r[i + 1] = f(x[i + 1], &d[i + 1]); });
+        b.evaluations += static_cast<int>(n);
+
+        size_t i = 1;
+        while (i <= n && r[i] > 0) {
+            ++i;
+        }
+        if (i > 1) {
+            b.lo = x[i - 1], b.r_lo = r[i - 1], b.d_lo = d[i - 1];
+        }
+        if (i <= n) {
+            b.hi = x[i], b.r_hi = r[i], b.d_hi = d[i];
+        }
+    }
+    return b;
+}
+
+// Bracket search outwards from a guess with residual r and slope d. `step` is the first
+// step away from the guess and doubles until the sign changes.
+template <class Residual>
+Bracket bracket_guess(const Residual &f, double guess, double r, double d, double step) {
+    Bracket b;
+    b.lo = b.hi = guess;
+    b.r_lo = b.r_hi = r;
+    b.d_lo = b.d_hi = d;
+
+    for (int i = 0; i < 64 && !b.found; ++i, step *= 2.0) {
+        double x = r > 0 ? b.lo + step : b.hi - step;
+        double dx;
+        double rx = f(x, &dx);
+        b.evaluations++;
+        if (r > 0) {
+            b.found = rx <= 0;
+            if (b.found) {
+                b.hi = x, b.r_hi = rx, b.d_hi = dx;
+            } else {
+                b.lo = x, b.r_lo = rx, b.d_lo = dx;
+            }
+        } else {
+            b.found = rx >= 0;
+            if (b.found) {
+                b.lo = x, b.r_lo = rx, b.d_lo = dx;
+            } else {
+                b.hi = x, b.r_hi = rx, b.d_hi = dx;
+            }
+        }
+    }
+    return b;
+}
+
+// Converged once the Newton step implied by the residual r and slope d is below tol.
+inline bool within_tol(double r, double d, double tol) {
+    return r == 0.0 || (d < 0 && std::fabs(r) <= tol * -d);
+}
+
+// Safeguarded Newton inside a bracket: Newton steps from the end with the smaller residual,
+// falling back to bisection whenever a step leaves the bracket or does not shrink fast enough.
+template <class Residual>
+void polish_bracket(const Residual &f, const Bracket &b, double tol, int max_iterations, SolveResult &result) {
+    double lo = b.lo, hi = b.hi;
+    bool from_lo = std::fabs(b.r_lo) < std::fabs(b.r_hi);
+    double x = from_lo ? lo : hi;
+    double r = from_lo ? b.r_lo : b.r_hi;
+    double d = from_lo ? b.d_lo : b.d_hi;
+
+    if (within_tol(r, d, tol) || hi - lo <= tol) {
+        result.converged = true;
+    }
+#ifdef PH_TRACE
+    trace_step(kTraceBracket, x, r, d);
+#endif
+
+    double dx_old = hi - lo;
+    double dx = dx_old;
+    for (int it = 1; it <= max_iterations && !result.converged; ++it) {
+        result.iterations = it;
+        double newton = x - r / d;
+        bool use_bisection = !(d < 0) || !(newton > lo && newton < hi) || std::fabs(2.0 * r) > std::fabs(dx_old * d);
+
+        dx_old = dx;
+        if (use_bisection) {
+            dx = 0.5 * (hi - lo);
+            x = lo + dx;
+        } else {
+            dx = newton - x;
+            x = newton;
+        }
+
+        r = f(x, &d);
+        result.evaluations++;
+#ifdef PH_TRACE
+        trace_step(use_bisection ? kTraceBisection : kTraceNewton, x, r, d);
+#endif
+
+        if (r > 0) {
+            lo = x;
+        } else if (r < 0) {
+            hi = x;
+        }
+
+        if (within_tol(r, d, tol) || std::fabs(dx) <= tol || hi - lo <= tol) {
+            result.converged = true;
+        }
+    }
+
+    result.pH = x;
+    result.residual = r;
+    result.slope = d;
+}
+
+// `f(pH, &dres)` must return the signed residual and store d(residual)/d(pH) in dres.
+// `tol` is the absolute tolerance on pH. `step` is the first bracketing step away from the
+// guess; it doubles until the sign changes, so a small step suits an accurate warm start.
+template <class Residual>
+SolveResult solve_bracketed(const Residual &f, double guess, double tol = 1e-12, int max_iterations = 100, double step = 1.0) {
+    SolveResult result;
+    double d;
+    double r = f(guess, &d);
+    result.evaluations = 1;
+    if (within_tol(r, d, tol)) {
+        result.pH = guess;
+        result.residual = r;
+        result.slope = d;
+        result.converged = true;
+        return result;
+    }
+
+    Bracket b = bracket_guess(f, guess, r, d, step);
+    result.evaluations += b.evaluations;
+    result.bracket_evaluations = result.evaluations;
+    if (!b.found) {
+        result.pH = guess;
+        result.residual = r;
+        result.slope = d;
+        return result;
+    }
+
+    polish_bracket(f, b, tol, max_iterations, result);
+    return result;
+}
+
+// Warm start from a point x whose residual r and slope d are already known, e.g. the last
+// root of a system that has changed a little since: the Newton step from x gives the guess
+// and, when that does not bracket the root with x, the first bracketing step. A small change
+// is then bracketed by the first evaluation and polished by one or two more.
+template <class Residual>
+SolveResult solve_from(const Residual &f, double x, double r, double d, double tol = 1e-12, int max_iterations = 100) {
+    SolveResult result;
+    if (within_tol(r, d, tol)) {
+        result.pH = x;
+        result.residual = r;
+        result.slope = d;
+        result.converged = true;
+        return result;
+    }
+
+    double step = d < 0 ? -r / d : (r > 0 ? 1.0 : -1.0);
+    if (!(std::fabs(step) <= 1.0)) {
+        step = r > 0 ? 1.0 : -1.0;
+    }
+    double guess = x + step;
+    double dg;
+    double rg = f(guess, &dg);
+    result.evaluations = 1;
+    if (within_tol(rg, dg, tol)) {
+        result.pH = guess;
+        result.residual = rg;
+        result.slope = dg;
+        result.converged = true;
+        return result;
+    }
+
+    Bracket b;
+    if ((r > 0) != (rg > 0)) {
+        b.found = true;
+        b.lo = r > 0 ? x : guess, b.r_lo = r > 0 ? r : rg, b.d_lo = r > 0 ? d : dg;
+        b.hi = r > 0 ? guess : x, b.r_hi = r > 0 ? rg : r, b.d_hi = r > 0 ? dg : d;
+    } else {
+        b = bracket_guess(f, guess, rg, dg, std::fabs(step));
+        result.evaluations += b.evaluations;
+    }
+    result.bracket_evaluations = result.evaluations;
+    if (!b.found) {
+        result.pH = guess;
+        result.residual = rg;
+        result.slope = dg;
+        return result;
+    }
+
+    polish_bracket(f, b, tol, max_iterations, result);
+    return result;
+}
+
+// Same as solve_bracketed, but without a guess: the root is first bracketed in
+// [lo, hi] down to `width` with bracket_range, or bracket_range_parallel given a `pool`.
+template <class Residual>
+SolveResult solve_in_range(const Residual &f, double lo, double hi, double width, double tol = 1e-12, int max_iterations = 100,
+                           WorkStealingPool *pool = nullptr) {
+    SolveResult result;
+    Bracket b = pool ? bracket_range_parallel(f, lo, hi, width, *pool) : bracket_range(f, lo, hi, width);
+    result.evaluations = result.bracket_evaluations = b.evaluations;
+    if (!b.found) {
+        bool low = std::fabs(b.r_lo) < std::fabs(b.r_hi);
+        result.pH = low ? b.lo : b.hi;
+        result.residual = low ? b.r_lo : b.r_hi;
+        result.slope = low ? b.d_lo : b.d_hi;
+        return result;
+    }
+
+    polish_bracket(f, b, tol, max_iterations, result);
+    return result;
+}
+
+#endif  // PH_SOLVER_H
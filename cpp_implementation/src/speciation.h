@@ -0,0 +1,801 @@
+#ifndef PH_SPECIATION_H
+#define PH_SPECIATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "CBE.h"
+#include "cli.h"
+#include "solver.h"
+#include "system.h"
+
+// Speciation with complexation and precipitation on top of the acid-base core.
+//
+// A component is an acid-base system as in the species database: the charge of its fully
+// protonated form and its pKa values, or no pKa at all for a component with a single form such
+// as a metal ion. Its free forms are spread over the alpha fractions as usual; complexes and
+// solids are built from its reference form, the fully deprotonated one (the only one for a
+// single-form component):
+//     complex    sum_j n_j A_j + n_H H+ = C      [C] = K * prod_j a_j^n_j * h^n_H
+//     solid      S = sum_j n_j A_j + n_H H+      saturation index log10(prod_j a_j^n_j * h^n_H / Ksp)
+// where a_j = alpha_ref,j(pH) * X_j and X_j is the sum of the free forms of component j.
+// Hydroxo species take a negative n_H.
+//
+// The unknowns are log10 X_j of every component that takes part in a reaction, the pH and the
+// amount of every precipitated solid. The equations are the mass balance of each of those
+// components, the charge balance, with the components that react with nothing evaluated on a
+// System as in CBE_calc, and a saturation index of 0 for each precipitated solid. They are
+// solved with damped Newton steps. The pH dimension goes through the alpha fractions: the
+// derivative of log10 a_j with respect to pH is the mean number of protons bound to the free
+// forms, and that of their mean charge is a covariance, as in System::residual.
+//
+// The Jacobian is assembled from the sparse stoichiometry, each complex touching only the rows
+// and columns of its own components and the pH. With a few dozen unknowns it is then factored
+// densely, which at this size costs less than a sparse factorisation would.
+//
+// Precipitation uses an active set: after each converged solve the solid with the most negative
+// amount dissolves, or else the most supersaturated solid precipitates, until neither applies.
+
+struct SpeciationComponent {
+    std::string name;
+    int charge;               // of the fully protonated form
+    std::vector<double> pKa;  // empty for a component with one form, e.g. a metal ion
+    double total;             // analytical concentration in mol/L
+};
+
+struct SpeciationReaction {
+    std::string name;
+    double log_K;                                // log10 of the formation constant or solubility product
+    std::vector<std::pair<size_t, int> > parts;  // (component, coefficient) of the reference forms
+    int protons;                                 // coefficient of H+, negative for hydroxo species
+};
+
+struct SpeciationModel {
+    std::vector<SpeciationComponent> components;
+    std::vector<SpeciationReaction> complexes;  // formation constants
+    std::vector<SpeciationReaction> solids;     // solubility products
+    double Kw;
+
+    SpeciationModel() : Kw(1.01e-14) {}
+
+    // Index of the component called `name`, or components.size().
+    size_t find_component(const std::string &name) const {
+        size_t c = 0;
+        while (c < components.size() && components[c].name != name) {
+            ++c;
+        }
+        return c;
+    }
+};
+
+struct SpeciationOptions {
+    double tol;          // on every balance, relative to its largest term; on saturation indices
+    int max_iterations;  // Newton iterations per set of precipitated solids
+    bool precipitation;  // let supersaturated solids precipitate
+
+    SpeciationOptions() : tol(1e-12), max_iterations(200), precipitation(true) {}
+};
+
+struct SpeciationResult {
+    double pH;
+    std::vector<double> free;                 // per component, the sum of its free forms
+    std::vector<std::vector<double> > forms;  // per component, each free form from the fully protonated one
+    std::vector<double> complexes;
+    std::vector<double> solids;      // precipitated amount in mol/L, 0 for dissolved solids
+    std::vector<double> saturation;  // log10(IAP / Ksp), 0 for precipitated solids
+    double residual;                 // largest relative balance error
+    int iterations;                  // Newton iterations over all sets of solids
+    int phase_changes;               // solids precipitated or dissolved
+    bool converged;
+};
+
+class SpeciationSolver {
+   public:
+    SpeciationSolver(const SpeciationModel &model, const SpeciationOptions &options = SpeciationOptions())
+        : model(model), options(options), background(model.Kw) {
+        const size_t n_components = model.components.size();
+        std::vector<bool> reacts(n_components, false);
+        check_reactions(model.complexes, reacts);
+        check_reactions(model.solids, reacts);
+
+        unknown.assign(n_components, -1);
+        acid_index.assign(n_components, -1);
+        for (size_t c = 0; c < n_components; ++c) {
+            const SpeciationComponent &component = model.components[c];
+            if (!(component.total >= 0.0)) {
+                throw std::invalid_argument("Invalid total concentration of " + component.name);
+            }
+            if (!component.pKa.empty()) {
+                acid_index[c] = static_cast<long>(acids.size());
+                acids.push_back(Acid({}, component.pKa, component.charge, component.total));
+            }
+            if (reacts[c]) {
+                if (!(component.total > 0.0)) {
+                    throw std::invalid_argument("Component " + component.name + " reacts and needs a positive total");
+                }
+                unknown[c] = static_cast<long>(active.size());
+                active.push_back(c);
+            } else if (acid_index[c] >= 0) {
+                const Acid &acid = acids[acid_index[c]];
+                background.add_species(acid.get_Ka_prod(), acid.get_charge_vector(), component.total, acid.get_charge_vector(),
+                                       acid.get_pKa());
+            } else {
+                std::vector<int> z(1, component.charge);
+                background.add_species(std::vector<double>(1, 1.0), z, component.total, z);
+            }
+        }
+
+        complex_charge.resize(model.complexes.size());
+        for (size_t r = 0; r < model.complexes.size(); ++r) {
+            int z = model.complexes[r].protons;
+            for (const auto &part : model.complexes[r].parts) {
+                z += part.second * reference_charge(part.first);
+            }
+            complex_charge[r] = z;
+        }
+        state.resize(n_components);
+    }
+
+    SpeciationResult solve() {
+        SpeciationResult result;
+        result.iterations = 0;
+        result.phase_changes = 0;
+        result.converged = false;
+        result.residual = std::numeric_limits<double>::infinity();
+
+        std::vector<double> x = initial_guess();
+        const size_t n_solids = model.solids.size();
+        const int max_phase_changes = static_cast<int>(2 * n_solids + 8);
+        for (;;) {
+            if (!newton(x, result.iterations, result.residual)) {
+                break;
+            }
+
+            // The solid with the most negative amount dissolves first.
+            size_t worst = n_solids;
+            double worst_amount = 0.0;
+            for (size_t i = 0; i < solids.size(); ++i) {
+                if (x[n_base() + i] < worst_amount) {
+                    worst = i;
+                    worst_amount = x[n_base() + i];
+                }
+            }
+            if (worst < n_solids && result.phase_changes < max_phase_changes) {
+                solids.erase(solids.begin() + worst);
+                x.erase(x.begin() + n_base() + worst);
+                result.phase_changes++;
+                continue;
+            }
+
+            // Otherwise the most supersaturated one precipitates, as long as the phase rule allows.
+            size_t best = n_solids;
+            double best_si = options.tol;
+            if (options.precipitation && solids.size() < active.size()) {
+                update_state(x[active.size()], x);
+                for (size_t s = 0; s < n_solids; ++s) {
+                    double si = saturation_index(s, x[active.size()]);
+                    if (si > best_si && std::find(solids.begin(), solids.end(), s) == solids.end()) {
+                        best = s;
+                        best_si = si;
+                    }
+                }
+            }
+            if (best < n_solids && result.phase_changes < max_phase_changes) {
+                solids.push_back(best);
+                x.push_back(0.0);
+                result.phase_changes++;
+                continue;
+            }
+
+            result.converged = worst == n_solids && best == n_solids;
+            break;
+        }
+
+        fill_result(x, result);
+        return result;
+    }
+
+   private:
+    static const int kSweeps = 30;        // fixed-point sweeps of the initial guess
+    static const int kLineSearch = 30;    // step halvings
+    static constexpr double kMaxStep = 2.0;  // largest Newton step in log10 units and pH
+
+    // Acid-base state of the free forms of one component at the current pH.
+    struct FormState {
+        double X;          // sum of the free forms
+        double log_ref;    // log10 of the alpha fraction of the reference form
+        double n_bound;    // mean number of bound protons, d(log_ref)/d(pH)
+        double z_mean;     // mean charge
+        double dz_mean;    // d(z_mean)/d(pH)
+    };
+
+    void check_reactions(const std::vector<SpeciationReaction> &reactions, std::vector<bool> &reacts) const {
+        for (const auto &reaction : reactions) {
+            if (reaction.parts.empty()) {
+                throw std::invalid_argument("Reaction " + reaction.name + " has no components");
+            }
+            for (const auto &part : reaction.parts) {
+                if (part.first >= model.components.size()) {
+                    throw std::invalid_argument("Reaction " + reaction.name + " refers to an unknown component");
+                }
+                reacts[part.first] = true;
+            }
+        }
+    }
+
+    int reference_charge(size_t c) const {
+        const SpeciationComponent &component = model.components[c];
+        return component.charge - static_cast<int>(component.pKa.size());
+    }
+
+    // Unknowns before the solid amounts: the active components and the pH.
+    size_t n_base() const {
+        return active.size() + 1;
+    }
+
+    void form_state(size_t c, double pH, FormState &f) const {
+        if (acid_index[c] < 0) {
+            f.log_ref = 0.0;
+            f.n_bound = 0.0;
+            f.z_mean = model.components[c].charge;
+            f.dz_mean = 0.0;
+            return;
+        }
+
+        const Acid &acid = acids[acid_index[c]];
+        const size_t n = acid.get_alpha_size();
+        double alpha[kMaxAlphaTerms];
+        acid.alpha_at_pH(pH, alpha);
+        double n_bound = 0.0, z_mean = 0.0, zb = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            double bound = static_cast<double>(n - 1 - i);
+            double z = model.components[c].charge - static_cast<double>(i);
+            n_bound += bound * alpha[i];
+            z_mean += z * alpha[i];
+            zb += z * bound * alpha[i];
+        }
+        f.log_ref = std::log10(std::max(alpha[n - 1], std::numeric_limits<double>::min()));
+        f.n_bound = n_bound;
+        f.z_mean = z_mean;
+        f.dz_mean = -std::log(10.0) * (zb - z_mean * n_bound);  // d/d(ln h) is the covariance
+    }
+
+    void update_state(double pH, const std::vector<double> &x) {
+        for (size_t j = 0; j < active.size(); ++j) {
+            form_state(active[j], pH, state[active[j]]);
+            state[active[j]].X = std::pow(10, x[j]);
+        }
+    }
+
+    // log10 of the ion activity product of `reaction` over the reference forms.
+    double log_product(const SpeciationReaction &reaction, const std::vector<double> &x, double pH) const {
+        double log_c = reaction.log_K - reaction.protons * pH;
+        for (const auto &part : reaction.parts) {
+            size_t j = static_cast<size_t>(unknown[part.first]);
+            log_c += part.second * (x[j] + state[part.first].log_ref);
+        }
+        return log_c;
+    }
+
+    double saturation_index(size_t s, double pH) const {
+        const SpeciationReaction &solid = model.solids[s];
+        double log_iap = -solid.protons * pH;
+        for (const auto &part : solid.parts) {
+            log_iap += part.second * (std::log10(state[part.first].X) + state[part.first].log_ref);
+        }
+        return log_iap - solid.log_K;
+    }
+
+    // Balances F and, given J, their Jacobian (row-major, n x n), both divided by the row scales.
+    void evaluate(const std::vector<double> &x, std::vector<double> &F, std::vector<double> *J) {
+        const double ln10 = std::log(10.0);
+        const size_t n_u = active.size();
+        const size_t n = x.size();
+        const size_t q = n_u;  // charge balance row and pH column
+        const double pH = x[q];
+        update_state(pH, x);
+
+        F.assign(n, 0.0);
+        scale.assign(n, 0.0);
+        if (J) {
+            J->assign(n * n, 0.0);
+        }
+        double *A = J ? J->data() : nullptr;
+
+        double dbg;
+        F[q] = background.residual(pH, &dbg);
+        scale[q] = background.condition(pH, 1.0);  // the sum of the magnitudes of its terms
+        if (J) {
+            A[q * n + q] = dbg;
+        }
+
+        for (size_t j = 0; j < n_u; ++j) {
+            const FormState &f = state[active[j]];
+            F[j] += f.X - model.components[active[j]].total;
+            scale[j] = model.components[active[j]].total;
+            F[q] += f.X * f.z_mean;
+            scale[q] += f.X * std::fabs(f.z_mean);
+            if (J) {
+                A[j * n + j] += ln10 * f.X;
+                A[q * n + j] += ln10 * f.X * f.z_mean;
+                A[q * n + q] += f.X * f.dz_mean;
+            }
+        }
+
+        for (size_t r = 0; r < model.complexes.size(); ++r) {
+            const SpeciationReaction &complex = model.complexes[r];
+            const double C = std::pow(10, log_product(complex, x, pH));
+            const double z = complex_charge[r];
+            double dlog_dpH = -complex.protons;
+            for (const auto &part : complex.parts) {
+                dlog_dpH += part.second * state[part.first].n_bound;
+            }
+
+            F[q] += z * C;
+            scale[q] += std::fabs(z) * C;
+            for (const auto &row : complex.parts) {
+                const size_t i = static_cast<size_t>(unknown[row.first]);
+                F[i] += row.second * C;
+                if (!J) {
+                    continue;
+                }
+                for (const auto &col : complex.parts) {
+                    A[i * n + static_cast<size_t>(unknown[col.first])] += ln10 * row.second * col.second * C;
+                }
+                A[i * n + q] += ln10 * row.second * C * dlog_dpH;
+            }
+            if (J) {
+                for (const auto &col : complex.parts) {
+                    A[q * n + static_cast<size_t>(unknown[col.first])] += ln10 * z * col.second * C;
+                }
+                A[q * n + q] += ln10 * z * C * dlog_dpH;
+            }
+        }
+
+        for (size_t k = 0; k < solids.size(); ++k) {
+            const SpeciationReaction &solid = model.solids[solids[k]];
+            const size_t row = n_base() + k;
+            const double amount = x[row];
+            F[row] = saturation_index(solids[k], pH);
+            scale[row] = 1.0;
+            double dsi_dpH = -solid.protons;
+            for (const auto &part : solid.parts) {
+                const size_t j = static_cast<size_t>(unknown[part.first]);
+                F[j] += part.second * amount;
+                dsi_dpH += part.second * state[part.first].n_bound;
+                if (J) {
+                    A[j * n + row] += part.second;
+                    A[row * n + j] += part.second;
+                }
+            }
+            if (J) {
+                A[row * n + q] = dsi_dpH;
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            F[i] /= scale[i];
+            if (J) {
+                for (size_t k = 0; k < n; ++k) {
+                    A[i * n + k] /= scale[i];
+                }
+            }
+        }
+    }
+
+    static double merit(const std::vector<double> &F) {
+        double m = 0.0;
+        for (double f : F) {
+            m += f * f;
+        }
+        return m;
+    }
+
+    // Gaussian elimination with partial pivoting; b receives the solution.
+    static bool solve_dense(std::vector<double> &A, std::vector<double> &b) {
+        const size_t n = b.size();
+        for (size_t k = 0; k < n; ++k) {
+            size_t p = k;
+            for (size_t i = k + 1; i < n; ++i) {
+                if (std::fabs(A[i * n + k]) > std::fabs(A[p * n + k])) {
+                    p = i;
+                }
+            }
+            if (!(A[p * n + k] != 0.0) || !std::isfinite(A[p * n + k])) {
+                return false;
+            }
+            if (p != k) {
+                for (size_t j = 0; j < n; ++j) {
+                    std::swap(A[k * n + j], A[p * n + j]);
+                }
+                std::swap(b[k], b[p]);
+            }
+            for (size_t i = k + 1; i < n; ++i) {
+                double m = A[i * n + k] / A[k * n + k];
+                if (m == 0.0) {
+                    continue;
+                }
+                for (size_t j = k + 1; j < n; ++j) {
+                    A[i * n + j] -= m * A[k * n + j];
+                }
+                b[i] -= m * b[k];
+            }
+        }
+        for (size_t k = n; k-- > 0;) {
+            double s = b[k];
+            for (size_t j = k + 1; j < n; ++j) {
+                s -= A[k * n + j] * b[j];
+            }
+            b[k] = s / A[k * n + k];
+        }
+        return true;
+    }
+
+    // Damped Newton for the current set of solids; true once every scaled balance is within tol.
+    bool newton(std::vector<double> &x, int &iterations, double &residual) {
+        std::vector<double> F, J, d, x_try, F_try;
+        for (int it = 0; it <= options.max_iterations; ++it) {
+            evaluate(x, F, &J);
+            residual = 0.0;
+            for (double f : F) {
+                residual = std::max(residual, std::fabs(f));
+            }
+            if (residual <= options.tol) {
+                return true;
+            }
+            if (it == options.max_iterations || !std::isfinite(residual)) {
+                return false;
+            }
+
+            d.resize(F.size());
+            for (size_t i = 0; i < F.size(); ++i) {
+                d[i] = -F[i];
+            }
+            if (!solve_dense(J, d)) {
+                return false;
+            }
+
+            double largest = 0.0;
+            for (size_t i = 0; i < n_base(); ++i) {
+                largest = std::max(largest, std::fabs(d[i]));
+            }
+            double t = largest > kMaxStep ? kMaxStep / largest : 1.0;
+            const double m0 = merit(F);
+            for (int k = 0; k < kLineSearch; ++k, t *= 0.5) {
+                x_try = x;
+                for (size_t i = 0; i < x.size(); ++i) {
+                    x_try[i] += t * d[i];
+                }
+                evaluate(x_try, F_try, nullptr);
+                if (merit(F_try) < m0) {
+                    break;
+                }
+            }
+            x.swap(x_try);
+            iterations++;
+        }
+        return false;
+    }
+
+    // pH of the mixture without any reaction, then a few sweeps that scale each free total by
+    // the ratio of its analytical total to the total it currently implies, at that pH.
+    std::vector<double> initial_guess() {
+        System plain(background);
+        for (size_t j = 0; j < active.size(); ++j) {
+            const size_t c = active[j];
+            if (acid_index[c] >= 0) {
+                const Acid &acid = acids[acid_index[c]];
+                plain.add_species(acid.get_Ka_prod(), acid.get_charge_vector(), model.components[c].total);
+            } else {
+                plain.add_species(std::vector<double>(1, 1.0), std::vector<int>(1, model.components[c].charge),
+                                  model.components[c].total);
+            }
+        }
+        auto f = [&plain](double pH, double *dres) { return plain.residual(pH, dres); };
+        SolveResult start = solve_in_range(f, kSearchMinPH, kSearchMaxPH, 1e-2);
+
+        std::vector<double> x(n_base());
+        x[active.size()] = start.converged ? start.pH : 7.0;
+        for (size_t j = 0; j < active.size(); ++j) {
+            x[j] = std::log10(model.components[active[j]].total);
+        }
+
+        std::vector<double> total(active.size());
+        std::vector<int> order(active.size(), 1);
+        for (const auto &complex : model.complexes) {
+            for (const auto &part : complex.parts) {
+                int &o = order[static_cast<size_t>(unknown[part.first])];
+                o = std::max(o, std::abs(part.second));
+            }
+        }
+        const double pH = x[active.size()];
+        for (int sweep = 0; sweep < kSweeps; ++sweep) {
+            update_state(pH, x);
+            for (size_t j = 0; j < active.size(); ++j) {
+                total[j] = state[active[j]].X;
+            }
+            for (const auto &complex : model.complexes) {
+                const double C = std::pow(10, log_product(complex, x, pH));
+                for (const auto &part : complex.parts) {
+                    total[static_cast<size_t>(unknown[part.first])] += part.second * C;
+                }
+            }
+            for (size_t j = 0; j < active.size(); ++j) {
+                x[j] += std::log10(model.components[active[j]].total / total[j]) / order[j];
+            }
+        }
+        return x;
+    }
+
+    void fill_result(const std::vector<double> &x, SpeciationResult &result) {
+        const double pH = x[active.size()];
+        update_state(pH, x);
+        result.pH = pH;
+
+        const size_t n_components = model.components.size();
+        result.free.assign(n_components, 0.0);
+        result.forms.assign(n_components, std::vector<double>());
+        for (size_t c = 0; c < n_components; ++c) {
+            double X = unknown[c] >= 0 ? state[c].X : model.components[c].total;
+            result.free[c] = X;
+            if (acid_index[c] >= 0) {
+                std::vector<double> alpha = acids[acid_index[c]].alpha(pH);
+                for (double &a : alpha) {
+                    a *= X;
+                }
+                result.forms[c] = alpha;
+            } else {
+                result.forms[c].assign(1, X);
+            }
+        }
+
+        result.complexes.resize(model.complexes.size());
+        for (size_t r = 0; r < model.complexes.size(); ++r) {
+            result.complexes[r] = std::pow(10, log_product(model.complexes[r], x, pH));
+        }
+        result.solids.assign(model.solids.size(), 0.0);
+        result.saturation.resize(model.solids.size());
+        for (size_t s = 0; s < model.solids.size(); ++s) {
+            result.saturation[s] = saturation_index(s, pH);
+        }
+        for (size_t k = 0; k < solids.size(); ++k) {
+            result.solids[solids[k]] = x[n_base() + k];
+            result.saturation[solids[k]] = 0.0;  // at equilibrium by construction
+        }
+    }
+
+    const SpeciationModel &model;
+    SpeciationOptions options;
+    System background;             // components without reactions, and water
+    std::vector<Acid> acids;       // of the components with pKa values
+    std::vector<long> acid_index;  // per component, into acids or -1
+    std::vector<long> unknown;     // per component, its unknown or -1 for the background
+    std::vector<size_t> active;    // components with an unknown
+    std::vector<int> complex_charge;
+    std::vector<size_t> solids;    // precipitated solids, in the order of their unknowns
+    std::vector<FormState> state;  // per component, at the last evaluated pH
+    std::vector<double> scale;     // row scales of the last evaluation
+};
+
+inline SpeciationResult solve_speciation(const SpeciationModel &model, const SpeciationOptions &options = SpeciationOptions()) {
+    SpeciationSolver solver(model, options);
+    return solver.solve();
+}
+
+// A whole field of a model file as a finite number or an integer in int range.
+inline double speciation_number(const std::string &field, const char *what, size_t line_no) {
+    char *end = nullptr;
+    double v = std::strtod(field.c_str(), &end);
+    if (end == field.c_str() || *end != '\0' || !std::isfinite(v)) {
+        throw std::runtime_error(std::string("Invalid ") + what + " '" + field + "' on line " + std::to_string(line_no));
+    }
+    return v;
+}
+
+inline int speciation_integer(const std::string &field, const char *what, size_t line_no) {
+    char *end = nullptr;
+    long v = std::strtol(field.c_str(), &end, 10);
+    if (end == field.c_str() || *end != '\0' || v < INT_MIN || v > INT_MAX) {
+        throw std::runtime_error(std::string("Invalid ") + what + " '" + field + "' on line " + std::to_string(line_no));
+    }
+    return static_cast<int>(v);
+}
+
+// Splits "Ca:1;carbonate:1;H:-1" into the reaction's parts; H is the proton.
+inline void parse_reaction_parts(const SpeciationModel &model, const std::string &text, size_t line_no,
+                                 SpeciationReaction &reaction) {
+    reaction.protons = 0;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t semi = text.find(';', pos);
+        std::string part = text.substr(pos, semi == std::string::npos ? std::string::npos : semi - pos);
+        size_t colon = part.find(':');
+        std::string name = part.substr(0, colon);
+        int count = colon == std::string::npos ? 1 : speciation_integer(part.substr(colon + 1), "count", line_no);
+        if (count == 0) {
+            throw std::runtime_error("Invalid count '" + part.substr(colon + 1) + "' on line " + std::to_string(line_no));
+        }
+        if (name == "H") {
+            reaction.protons += count;
+        } else {
+            size_t c = model.find_component(name);
+            if (c == model.components.size()) {
+                throw std::runtime_error("Unknown component '" + name + "' on line " + std::to_string(line_no));
+            }
+            reaction.parts.push_back(std::make_pair(c, count));
+        }
+        if (semi == std::string::npos) {
+            break;
+        }
+        pos = semi + 1;
+    }
+}
+
+// Reads a model, one record per line:
+//     component,<name>,<charge of the fully protonated form>,<pKa;pKa;...>,<total>
+//     complex,<name>,<log10 K>,<component:count;...>
+//     solid,<name>,<log10 Ksp>,<component:count;...>
+//     kw,<Kw>
+// The pKa list of a single-form component is left empty; in reactions, H stands for H+.
+// Components have to be defined before the reactions using them.
+inline SpeciationModel read_speciation_csv(const std::string &path) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    SpeciationModel model;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (;;) {
+            size_t comma = line.find(',', start);
+            fields.push_back(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+
+        if (fields[0] == "component" && fields.size() == 5) {
+            SpeciationComponent component;
+            component.name = fields[1];
+            component.charge = speciation_integer(fields[2], "charge", line_no);
+            const char *p = fields[3].c_str();
+            while (*p) {
+                char *end;
+                double v = std::strtod(p, &end);
+                if (end == p) {
+                    throw std::runtime_error("Invalid pKa list on line " + std::to_string(line_no));
+                }
+                component.pKa.push_back(v);
+                p = *end == ';' ? end + 1 : end;
+            }
+            component.total = speciation_number(fields[4], "total", line_no);
+            if (component.total < 0) {
+                throw std::runtime_error("Invalid total '" + fields[4] + "' on line " + std::to_string(line_no));
+            }
+            if (model.find_component(component.name) != model.components.size() || component.name == "H") {
+                throw std::runtime_error("Duplicate component '" + component.name + "' on line " + std::to_string(line_no));
+            }
+            model.components.push_back(component);
+        } else if ((fields[0] == "complex" || fields[0] == "solid") && fields.size() == 4) {
+            SpeciationReaction reaction;
+            reaction.name = fields[1];
+            reaction.log_K = speciation_number(fields[2], "log10 K", line_no);
+            parse_reaction_parts(model, fields[3], line_no, reaction);
+            (fields[0] == "complex" ? model.complexes : model.solids).push_back(reaction);
+        } else if (fields[0] == "kw" && fields.size() == 2) {
+            model.Kw = speciation_number(fields[1], "Kw", line_no);
+            if (model.Kw <= 0) {
+                throw std::runtime_error("Invalid Kw '" + fields[1] + "' on line " + std::to_string(line_no));
+            }
+        } else {
+            throw std::runtime_error("Invalid record on line " + std::to_string(line_no));
+        }
+    }
+    return model;
+}
+
+// Name of free form i of component c: the name itself for a single form, else with the charge.
+inline std::string speciation_form_name(const SpeciationComponent &component, size_t i) {
+    if (component.pKa.empty()) {
+        return component.name;
+    }
+    return component.name + "(" + std::to_string(component.charge - static_cast<int>(i)) + ")";
+}
+
+inline void write_speciation_csv(const std::string &path, const SpeciationModel &model, const SpeciationResult &r) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+    fprintf(out, "species,kind,value,saturation_index\n");
+    fprintf(out, "pH,pH,%.12f,\n", r.pH);
+    for (size_t c = 0; c < model.components.size(); ++c) {
+        for (size_t i = 0; i < r.forms[c].size(); ++i) {
+            fprintf(out, "%s,free,%.6e,\n", speciation_form_name(model.components[c], i).c_str(), r.forms[c][i]);
+        }
+    }
+    for (size_t k = 0; k < model.complexes.size(); ++k) {
+        fprintf(out, "%s,complex,%.6e,\n", model.complexes[k].name.c_str(), r.complexes[k]);
+    }
+    for (size_t s = 0; s < model.solids.size(); ++s) {
+        fprintf(out, "%s,solid,%.6e,%.4f\n", model.solids[s].name.c_str(), r.solids[s], r.saturation[s]);
+    }
+    fclose(out);
+}
+
+inline void print_speciation_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --speciate <model.csv> <output.csv> [--no-precipitation] [--tol T]\n", program);
+    fprintf(stderr, "Model records: component,name,charge,pKa;...,total  complex,name,logK,parts  solid,name,logKsp,parts\n");
+    fprintf(stderr, "               kw,Kw   with parts written as component:count;...;H:count\n");
+}
+
+// Command-line entry point of the speciation mode of the CBE executable.
+inline int speciation_main(int argc, char **argv) {
+    if (argc < 4) {
+        print_speciation_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        SpeciationOptions options;
+        for (int i = 4; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--no-precipitation") {
+                options.precipitation = false;
+            } else if (arg == "--tol" && i + 1 < argc) {
+                options.tol = option_positive(arg, argv[++i]);
+            } else {
+                print_speciation_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        SpeciationModel model = read_speciation_csv(argv[2]);
+        auto start = std::chrono::steady_clock::now();
+        SpeciationResult r = solve_speciation(model, options);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!r.converged) {
+            throw std::runtime_error("Failed to converge (largest relative balance error " + std::to_string(r.residual) + ")");
+        }
+        write_speciation_csv(argv[3], model, r);
+
+        size_t precipitated = 0;
+        for (double amount : r.solids) {
+            precipitated += amount > 0 ? 1 : 0;
+        }
+        fprintf(stderr,
+                "Speciated %zu components, %zu complexes and %zu solids in %.3f ms: pH %.4f after %d Newton iterations, "
+                "%zu solids precipitated\n",
+                model.components.size(), model.complexes.size(), model.solids.size(), seconds * 1e3, r.pH, r.iterations,
+                precipitated);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_SPECIATION_H
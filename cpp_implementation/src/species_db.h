@@ -0,0 +1,650 @@
+#ifndef PH_SPECIES_DB_H
+#define PH_SPECIES_DB_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "alpha.h"
+#include "balance.h"
+#include "cli.h"
+#include "mapped_file.h"
+#include "mixture_io.h"
+#include "solver.h"
+#include "temperature.h"
+
+// Species database: acid-base systems (pKa list and charge of the fully protonated form) and
+// compounds made of parts of those systems, e.g. Na2HPO4 = 2 Na+ + HPO4 2-. It is written
+// from a text source (pKa_data/species.csv) into a binary file whose tables are used in place
+// from a mapping: sorted Ka values and cumulative Ka products are precomputed per system and
+// compounds are found by name or formula through an open-addressing hash index.
+//
+// Version 2 adds the enthalpy and heat capacity change of every step and their log10 K shifts
+// tabulated over temperature (log_k_table_fill), so that mixtures at other temperatures are
+// built without evaluating the van 't Hoff terms. Steps without data have zero enthalpy and
+// keep their constants.
+
+const char kSpeciesMagic[8] = {'P', 'H', 'S', 'P', 'E', 'C', 'D', 'B'};
+const uint32_t kSpeciesVersion = 2;
+
+struct SpeciesFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t n_systems;
+    uint64_t n_values;  // pKa values over all systems
+    uint64_t n_compounds;
+    uint64_t n_parts;
+    uint64_t n_index;  // hash slots, a power of two
+    uint64_t n_chars;  // string pool
+};
+
+// FNV-1a, used for the name index.
+inline uint64_t species_hash(const char *s, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Owning tables as built from the text source. Systems own value_begin[s]..value_begin[s+1]
+// of pKa/Ka/dH/dCp, value_begin[s]+s..value_begin[s+1]+s of Ka_prod (one more term each) and
+// kLogKTablePoints entries of log_k_table per value.
+struct SpeciesTable {
+    std::vector<std::string> system_key;
+    std::vector<uint32_t> system_name;  // offsets into chars
+    std::vector<int32_t> system_charge;
+    std::vector<uint64_t> value_begin;
+    std::vector<double> pKa, Ka, Ka_prod;
+    std::vector<double> dH, dCp, log_k_table;
+
+    std::vector<uint32_t> name, formula;  // offsets into chars
+    std::vector<uint64_t> part_begin;
+    std::vector<int32_t> part_system, part_held;
+    std::vector<double> part_count;
+    std::vector<uint32_t> index;  // compound + 1, 0 for an empty slot
+    std::string chars;
+
+    SpeciesTable() : value_begin(1, 0), part_begin(1, 0) {}
+
+    // `enthalpy` and `heat_capacity` are given per pKa value, in the same order, or left empty
+    // for zero.
+    void add_system(const std::string &key, int charge, std::vector<double> values,
+                    const std::vector<double> &enthalpy = std::vector<double>(),
+                    const std::vector<double> &heat_capacity = std::vector<double>()) {
+        if (values.empty() || values.size() >= kMaxAlphaTerms) {
+            throw std::invalid_argument("System " + key + " needs 1 to " + std::to_string(kMaxAlphaTerms - 1) + " pKa values");
+        }
+        if ((!enthalpy.empty() && enthalpy.size() != values.size()) ||
+            (!heat_capacity.empty() && heat_capacity.size() != values.size())) {
+            throw std::invalid_argument("System " + key + " needs one enthalpy and heat capacity per pKa value");
+        }
+        std::vector<size_t> order(values.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&values](size_t a, size_t b) { return values[a] < values[b]; });
+        std::vector<double> sorted(values.size()), h(values.size(), 0.0), cp(values.size(), 0.0);
+        for (size_t i = 0; i < order.size(); ++i) {
+            sorted[i] = values[order[i]];
+            h[i] = enthalpy.empty() ? 0.0 : enthalpy[order[i]];
+            cp[i] = heat_capacity.empty() ? 0.0 : heat_capacity[order[i]];
+        }
+        values.swap(sorted);
+        std::vector<double> ka(values.size());
+        std::transform(values.begin(), values.end(), ka.begin(), [](double p) { return std::pow(10, -p); });
+        std::vector<double> prod = ka_cumulative_products(ka);
+
+        system_key.push_back(key);
+        system_name.push_back(add_string(key));
+        system_charge.push_back(charge);
+        pKa.insert(pKa.end(), values.begin(), values.end());
+        Ka.insert(Ka.end(), ka.begin(), ka.end());
+        Ka_prod.insert(Ka_prod.end(), prod.begin(), prod.end());
+        dH.insert(dH.end(), h.begin(), h.end());
+        dCp.insert(dCp.end(), cp.begin(), cp.end());
+        size_t table_begin = log_k_table.size();
+        log_k_table.resize(table_begin + values.size() * kLogKTablePoints);
+        log_k_table_fill(h.data(), cp.data(), values.size(), log_k_table.data() + table_begin);
+        value_begin.push_back(pKa.size());
+    }
+
+    int find_system(const std::string &key) const {
+        for (size_t s = 0; s < system_key.size(); ++s) {
+            if (system_key[s] == key) {
+                return static_cast<int>(s);
+            }
+        }
+        return -1;
+    }
+
+    void add_compound(const std::string &n, const std::string &f) {
+        name.push_back(add_string(n));
+        formula.push_back(add_string(f));
+        part_begin.push_back(part_system.size());
+    }
+
+    void add_part(int system, int held, double count) {
+        size_t n_Ka = value_begin[system + 1] - value_begin[system];
+        if (held < 0 || held > static_cast<int>(n_Ka)) {
+            throw std::invalid_argument("System " + system_key[system] + " cannot hold " + std::to_string(held) + " protons");
+        }
+        part_system.push_back(system);
+        part_held.push_back(held);
+        part_count.push_back(count);
+        part_begin.back() = part_system.size();
+    }
+
+    // Index with at most 50% load; both the name and the formula of a compound are keys.
+    void build_index() {
+        size_t n_keys = 2 * name.size();
+        size_t slots = 16;
+        while (slots < 2 * n_keys) {
+            slots *= 2;
+        }
+        index.assign(slots, 0);
+        for (size_t c = 0; c < name.size(); ++c) {
+            insert_key(name[c], c);
+            if (std::strcmp(chars.c_str() + formula[c], chars.c_str() + name[c]) != 0) {
+                insert_key(formula[c], c);
+            }
+        }
+    }
+
+   private:
+    uint32_t add_string(const std::string &s) {
+        uint32_t offset = static_cast<uint32_t>(chars.size());
+        chars += s;
+        chars += '\0';
+        return offset;
+    }
+
+    void insert_key(uint32_t offset, size_t compound) {
+        const char *key = chars.c_str() + offset;
+        size_t mask = index.size() - 1;
+        for (size_t i = species_hash(key, std::strlen(key)) & mask;; i = (i + 1) & mask) {
+            if (index[i] == 0) {
+                index[i] = static_cast<uint32_t>(compound + 1);
+                return;
+            }
+            size_t other = index[i] - 1;
+            if (std::strcmp(chars.c_str() + name[other], key) == 0 || std::strcmp(chars.c_str() + formula[other], key) == 0) {
+                throw std::invalid_argument(std::string("Duplicate compound ") + key);
+            }
+        }
+    }
+};
+
+// ';'-separated numbers of one field.
+inline std::vector<double> read_value_list(const std::string &field, const char *what, size_t line_no) {
+    std::vector<double> values;
+    const char *p = field.c_str();
+    for (;;) {
+        char *end;
+        double v = std::strtod(p, &end);
+        if (end == p) {
+            throw std::runtime_error(std::string("Invalid ") + what + " list on line " + std::to_string(line_no));
+        }
+        values.push_back(v);
+        if (*end != ';') {
+            break;
+        }
+        p = end + 1;
+    }
+    return values;
+}
+
+// Reads the text source: `system,key,charge,pKa;...[,dH;...[,dCp;...]]` and
+// `compound,name,formula,parts` lines, with parts written as `system:held[:count]` separated
+// by ';'. Enthalpies are in kJ/mol and heat capacity changes in J/(mol K), one per pKa value.
+inline SpeciesTable read_species_csv(const std::string &path) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    SpeciesTable table;
+    std::string line;
+    size_t line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (;;) {
+            size_t comma = line.find(',', start);
+            fields.push_back(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+        if (fields.size() != 4 && !(fields[0] == "system" && fields.size() <= 6)) {
+            throw std::runtime_error("Expected 4 fields on line " + std::to_string(line_no));
+        }
+
+        if (fields[0] == "system") {
+            std::vector<double> values = read_value_list(fields[3], "pKa", line_no);
+            std::vector<double> enthalpy, heat_capacity;
+            if (fields.size() > 4) {
+                enthalpy = read_value_list(fields[4], "enthalpy", line_no);
+            }
+            if (fields.size() > 5) {
+                heat_capacity = read_value_list(fields[5], "heat capacity", line_no);
+            }
+            table.add_system(fields[1], std::atoi(fields[2].c_str()), values, enthalpy, heat_capacity);
+        } else if (fields[0] == "compound") {
+            table.add_compound(fields[1], fields[2]);
+            size_t pos = 0;
+            while (pos <= fields[3].size()) {
+                size_t semi = fields[3].find(';', pos);
+                std::string part = fields[3].substr(pos, semi == std::string::npos ? std::string::npos : semi - pos);
+                size_t colon = part.find(':');
+                int system = colon == std::string::npos ? -1 : table.find_system(part.substr(0, colon));
+                if (system < 0) {
+                    throw std::runtime_error("Unknown system in '" + part + "' on line " + std::to_string(line_no));
+                }
+                size_t colon2 = part.find(':', colon + 1);
+                int held = std::atoi(part.c_str() + colon + 1);
+                double count = colon2 == std::string::npos ? 1.0 : std::strtod(part.c_str() + colon2 + 1, nullptr);
+                table.add_part(system, held, count);
+                if (semi == std::string::npos) {
+                    break;
+                }
+                pos = semi + 1;
+            }
+        } else {
+            throw std::runtime_error("Unknown record '" + fields[0] + "' on line " + std::to_string(line_no));
+        }
+    }
+
+    table.build_index();
+    return table;
+}
+
+inline void write_species_db(const std::string &path, const SpeciesTable &t) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("Cannot open " + path);
+    }
+
+    SpeciesFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kSpeciesMagic, sizeof(header.magic));
+    header.version = kSpeciesVersion;
+    header.n_systems = t.system_charge.size();
+    header.n_values = t.pKa.size();
+    header.n_compounds = t.name.size();
+    header.n_parts = t.part_system.size();
+    header.n_index = t.index.size();
+    header.n_chars = t.chars.size() + 1;
+
+    try {
+        write_column(f, &header, 1);
+        write_column(f, t.system_name.data(), header.n_systems);
+        write_column(f, t.system_charge.data(), header.n_systems);
+        write_column(f, t.value_begin.data(), header.n_systems + 1);
+        write_column(f, t.pKa.data(), header.n_values);
+        write_column(f, t.Ka.data(), header.n_values);
+        write_column(f, t.Ka_prod.data(), header.n_values + header.n_systems);
+        write_column(f, t.dH.data(), header.n_values);
+        write_column(f, t.dCp.data(), header.n_values);
+        write_column(f, t.log_k_table.data(), header.n_values * kLogKTablePoints);
+        write_column(f, t.name.data(), header.n_compounds);
+        write_column(f, t.formula.data(), header.n_compounds);
+        write_column(f, t.part_begin.data(), header.n_compounds + 1);
+        write_column(f, t.part_system.data(), header.n_parts);
+        write_column(f, t.part_held.data(), header.n_parts);
+        write_column(f, t.part_count.data(), header.n_parts);
+        write_column(f, t.index.data(), header.n_index);
+        write_column(f, t.chars.c_str(), header.n_chars);
+    } catch (...) {
+        fclose(f);
+        throw;
+    }
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+// Read-only view of a compiled database, used in place from a mapping.
+class SpeciesDatabase {
+   public:
+    // Precomputed tables of one acid-base system, Ka sorted descending.
+    struct System {
+        const char *name;
+        size_t n_Ka;
+        const double *pKa;
+        const double *Ka;
+        const double *Ka_prod;      // n_Ka + 1 cumulative products
+        const double *dH;           // matching pKa; null in version 1 files, as are the next two
+        const double *dCp;
+        const double *log_k_table;  // n_Ka * kLogKTablePoints, see log_k_table_shifts
+        int charge;                 // charge of the fully protonated form
+    };
+
+    struct Part {
+        size_t system;
+        int held;  // protons held as added, counted from the fully deprotonated form
+        double count;
+    };
+
+    explicit SpeciesDatabase(const std::string &path) : file(path), offset(0) {
+        if (file.size() < sizeof(SpeciesFileHeader)) {
+            throw std::runtime_error(path + " is not a species database");
+        }
+        std::memcpy(&header, file.get_data(), sizeof(header));
+        if (std::memcmp(header.magic, kSpeciesMagic, sizeof(header.magic)) != 0) {
+            throw std::runtime_error(path + " is not a species database");
+        }
+        if (header.version < 1 || header.version > kSpeciesVersion) {
+            throw std::runtime_error("Unsupported species database version " + std::to_string(header.version));
+        }
+        if (header.n_index == 0 || (header.n_index & (header.n_index - 1)) != 0) {
+            throw std::runtime_error(path + " has an invalid index");
+        }
+
+        offset = padded_size(sizeof(header));
+        system_name = column<uint32_t>(header.n_systems);
+        system_charge = column<int32_t>(header.n_systems);
+        value_begin = column<uint64_t>(header.n_systems + 1);
+        pKa = column<double>(header.n_values);
+        Ka = column<double>(header.n_values);
+        Ka_prod = column<double>(header.n_values + header.n_systems);
+        dH = dCp = log_k_table = nullptr;
+        if (header.version >= 2) {
+            dH = column<double>(header.n_values);
+            dCp = column<double>(header.n_values);
+            log_k_table = column<double>(header.n_values * kLogKTablePoints);
+        }
+        name_offset = column<uint32_t>(header.n_compounds);
+        formula_offset = column<uint32_t>(header.n_compounds);
+        part_begin = column<uint64_t>(header.n_compounds + 1);
+        part_system = column<int32_t>(header.n_parts);
+        part_held = column<int32_t>(header.n_parts);
+        part_count = column<double>(header.n_parts);
+        index = column<uint32_t>(header.n_index);
+        chars = column<char>(header.n_chars);
+
+        if (value_begin[header.n_systems] != header.n_values || part_begin[header.n_compounds] != header.n_parts ||
+            chars[header.n_chars - 1] != '\0') {
+            throw std::runtime_error(path + " has inconsistent offsets");
+        }
+    }
+
+    size_t n_compounds() const {
+        return header.n_compounds;
+    }
+
+    // Compound with the given name or formula, or -1.
+    long find(const std::string &key) const {
+        size_t mask = header.n_index - 1;
+        for (size_t i = species_hash(key.data(), key.size()) & mask;; i = (i + 1) & mask) {
+            if (index[i] == 0) {
+                return -1;
+            }
+            size_t c = index[i] - 1;
+            if (key == chars + name_offset[c] || key == chars + formula_offset[c]) {
+                return static_cast<long>(c);
+            }
+        }
+    }
+
+    const char *get_name(size_t compound) const {
+        return chars + name_offset[compound];
+    }
+
+    const char *get_formula(size_t compound) const {
+        return chars + formula_offset[compound];
+    }
+
+    size_t n_parts(size_t compound) const {
+        return part_begin[compound + 1] - part_begin[compound];
+    }
+
+    Part get_part(size_t compound, size_t i) const {
+        size_t p = part_begin[compound] + i;
+        Part part = {static_cast<size_t>(part_system[p]), part_held[p], part_count[p]};
+        return part;
+    }
+
+    System get_system(size_t s) const {
+        System system;
+        system.name = chars + system_name[s];
+        system.n_Ka = value_begin[s + 1] - value_begin[s];
+        system.pKa = pKa + value_begin[s];
+        system.Ka = Ka + value_begin[s];
+        system.Ka_prod = Ka_prod + value_begin[s] + s;
+        system.dH = dH ? dH + value_begin[s] : nullptr;
+        system.dCp = dCp ? dCp + value_begin[s] : nullptr;
+        system.log_k_table = log_k_table ? log_k_table + value_begin[s] * kLogKTablePoints : nullptr;
+        system.charge = system_charge[s];
+        return system;
+    }
+
+   private:
+    template <class T>
+    const T *column(uint64_t n) {
+        size_t bytes = padded_size(n * sizeof(T));
+        if (offset + bytes > file.size()) {
+            throw std::runtime_error("Truncated species database");
+        }
+        const T *p = reinterpret_cast<const T *>(file.get_data() + offset);
+        offset += bytes;
+        return p;
+    }
+
+    MappedFile file;
+    SpeciesFileHeader header;
+    size_t offset;
+    const uint32_t *system_name;
+    const int32_t *system_charge;
+    const uint64_t *value_begin;
+    const double *pKa, *Ka, *Ka_prod;
+    const double *dH, *dCp, *log_k_table;
+    const uint32_t *name_offset, *formula_offset;
+    const uint64_t *part_begin;
+    const int32_t *part_system, *part_held;
+    const double *part_count;
+    const uint32_t *index;
+    const char *chars;
+};
+
+// Constants of `system` at `celsius` from its log K table: pKa and Ka in the order of the
+// system's steps and the n_Ka + 1 cumulative products. The stored constants at 25 C, and for
+// version 1 files, which have no table.
+inline void system_constants_at(const SpeciesDatabase::System &system, double celsius, double *pKa, double *Ka,
+                                double *Ka_prod) {
+    double shift[kMaxAlphaTerms];
+    if (system.log_k_table && celsius != kReferenceTemperature) {
+        log_k_table_shifts(system.log_k_table, system.dH, system.dCp, system.n_Ka, celsius, shift);
+    } else {
+        std::fill(shift, shift + system.n_Ka, 0.0);
+    }
+    Ka_prod[0] = 1.0;
+    for (size_t i = 0; i < system.n_Ka; ++i) {
+        pKa[i] = system.pKa[i] - shift[i];
+        Ka[i] = shift[i] == 0.0 ? system.Ka[i] : std::pow(10, -pKa[i]);
+        Ka_prod[i + 1] = Ka_prod[i] * Ka[i];
+    }
+}
+
+// Default location of the compiled database, overridden by $PH_SPECIES_DB.
+inline std::string default_species_db() {
+    const char *env = std::getenv("PH_SPECIES_DB");
+    return env && *env ? env : "exec/species.db";
+}
+
+struct MixtureComponent {
+    size_t compound;
+    double conc;
+};
+
+// Parses "Na2HPO4 0.01, NH4Cl 0.03": comma-separated compounds, each a name or formula
+// followed by its concentration.
+inline std::vector<MixtureComponent> parse_mixture_spec(const SpeciesDatabase &db, const std::string &spec) {
+    std::vector<MixtureComponent> components;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t comma = spec.find(',', pos);
+        std::string item = spec.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        pos = comma == std::string::npos ? spec.size() : comma + 1;
+
+        size_t first = item.find_first_not_of(" \t");
+        size_t last = item.find_last_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        item = item.substr(first, last - first + 1);
+        size_t space = item.find_last_of(" \t");
+        if (space == std::string::npos) {
+            throw std::invalid_argument("Missing concentration for '" + item + "'");
+        }
+
+        std::string key = item.substr(0, item.find_last_not_of(" \t", space) + 1);
+        char *end;
+        double conc = std::strtod(item.c_str() + space + 1, &end);
+        if (*end != '\0' || !(conc >= 0)) {
+            throw std::invalid_argument("Invalid concentration for '" + key + "'");
+        }
+        long c = db.find(key);
+        if (c < 0) {
+            throw std::invalid_argument("Unknown compound '" + key + "'");
+        }
+        MixtureComponent component = {static_cast<size_t>(c), conc};
+        components.push_back(component);
+    }
+    return components;
+}
+
+// One species per compound part. `make_species(system, held, conc, celsius)` builds the
+// species type of the calculator from the precomputed tables, at `celsius`.
+template <class Species, class Factory>
+std::vector<Species> build_species(const SpeciesDatabase &db, const std::vector<MixtureComponent> &components,
+                                   const Factory &make_species, double celsius = kReferenceTemperature) {
+    std::vector<Species> species;
+    for (const auto &component : components) {
+        for (size_t i = 0; i < db.n_parts(component.compound); ++i) {
+            SpeciesDatabase::Part part = db.get_part(component.compound, i);
+            species.push_back(make_species(db.get_system(part.system), part.held, part.count * component.conc, celsius));
+        }
+    }
+    return species;
+}
+
+inline void print_species_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --mix \"<name or formula> <conc>, ...\" [--db species.db] [--kw Kw] [--verify]\n",
+            program);
+    fprintf(stderr, "           [--temperature C[,C...]]\n");
+    fprintf(stderr, "       %s --compile-db <species.csv> <species.db>\n", program);
+    fprintf(stderr, "The database defaults to $PH_SPECIES_DB or exec/species.db. --verify also solves the other\n");
+    fprintf(stderr, "balance equation and prints where its root lies. --temperature solves the mixture at each\n");
+    fprintf(stderr, "temperature; Kw is given at 25 C.\n");
+}
+
+// Command-line entry point for mixtures given by name, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int species_main(int argc, char **argv, const Factory &make_species) {
+    if (argc < 3) {
+        print_species_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (std::string(argv[1]) == "--compile-db") {
+            if (argc != 4) {
+                print_species_usage(argv[0]);
+                return 1;
+            }
+            SpeciesTable table = read_species_csv(argv[2]);
+            write_species_db(argv[3], table);
+            fprintf(stderr, "Compiled %zu systems and %zu compounds into %s\n", table.system_charge.size(), table.name.size(),
+                    argv[3]);
+            return 0;
+        }
+
+        std::string db_path = default_species_db();
+        double Kw = 1.01e-14;
+        bool verify = false;
+        std::vector<double> temperatures;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--db" && i + 1 < argc) {
+                db_path = argv[++i];
+            } else if (arg == "--kw" && i + 1 < argc) {
+                Kw = option_positive(arg, argv[++i]);
+            } else if (arg == "--verify") {
+                verify = true;
+            } else if (arg == "--temperature" && i + 1 < argc) {
+                temperatures = parse_temperature_list(argv[++i]);
+            } else {
+                print_species_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        SpeciesDatabase db(db_path);
+        std::vector<MixtureComponent> components = parse_mixture_spec(db, argv[2]);
+        bool sweep = !temperatures.empty();
+        if (!sweep) {
+            temperatures.push_back(kReferenceTemperature);
+        }
+
+        for (double celsius : temperatures) {
+            // The species come at `celsius` from the database tables, so the calculator
+            // only moves Kw.
+            std::vector<Species> species = build_species<Species>(db, components, make_species, celsius);
+            Calc calc(species, Kw, celsius);
+            SolveResult r = calc.solve(7.0, true, 1500, 1e-12);
+            if (!r.converged) {
+                throw std::runtime_error("Failed to converge to the desired tolerance.");
+            }
+
+            if (sweep) {
+                printf("At %.2f C:\n", celsius);
+            }
+            printf("The pH is: %.12f\n", r.pH);
+            if (verify) {
+                BalanceCheck check = calc.check_balance(r, 1e-12);
+                if (!check.converged) {
+                    throw std::runtime_error("The other balance failed to converge.");
+                }
+                printf("The %s gives: %.12f (%+.1e)\n", balance_name(other_balance(calc.get_balance())), check.pH,
+                       check.disagreement);
+            }
+            size_t s = 0;
+            for (const auto &component : components) {
+                printf("%s (%s), %.4e M\n", db.get_name(component.compound), db.get_formula(component.compound),
+                       component.conc);
+                for (size_t i = 0; i < db.n_parts(component.compound); ++i, ++s) {
+                    std::vector<double> alpha = species[s].alpha(r.pH);
+                    printf("    %-14s", db.get_system(db.get_part(component.compound, i).system).name);
+                    for (double a : alpha) {
+                        printf(" %.5e", a);
+                    }
+                    printf("\n");
+                }
+            }
+        }
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_SPECIES_DB_H
@@ -0,0 +1,806 @@
+#ifndef PH_SYSTEM_H
+#define PH_SYSTEM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "alpha.h"
+#include "parallel.h"
+
+// Flattened structure-of-arrays form of a whole solution, behind BalanceCalc and so both
+// CBE_calc and PBE_calc.
+//
+// Species are grouped by their number of alpha terms. Inside a group the cumulative Ka
+// products and the weights are stored term-major with a padded stride,
+//     ka_prod[i * stride + s], weight[i * stride + s],
+// so that for a fixed term i the loop over species reads contiguous, 64-byte aligned
+// memory and vectorises. The power of [H3O+] belonging to term i is the same for every
+// species in the group and is computed once per evaluation.
+//
+// Each group also keeps the products in log10 form. Where the direct terms could leave the
+// double range (alpha_direct_safe fails for the group's largest exponent), the group is
+// evaluated in log space instead, one species at a time.
+//
+// Large systems can split each evaluation over a WorkStealingPool, see set_pool.
+//
+// Besides the weights of the balance being solved, a system can keep the weights of the
+// other balance as a second set, so that residual_pair evaluates both from the same terms.
+
+template <class T>
+struct AlignedAllocator {
+    typedef T value_type;
+    static const size_t alignment = 64;
+
+    template <class U>
+    struct rebind {
+        typedef AlignedAllocator<U> other;
+    };
+
+    AlignedAllocator() {}
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, alignment, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t) {
+        free(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const AlignedAllocator<T> &, const AlignedAllocator<U> &) {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const AlignedAllocator<T> &, const AlignedAllocator<U> &) {
+    return false;
+}
+
+typedef std::vector<double, AlignedAllocator<double> > AlignedVector;
+
+class System {
+   public:
+    // Species of one group share the number of alpha terms.
+    struct Group {
+        size_t n_terms;
+        size_t size;    // number of species
+        size_t stride;  // padded row length, multiple of 8
+        AlignedVector ka_prod;       // cumulative Ka products the residual uses
+        AlignedVector ka_prod_base;  // the same at zero ionic strength
+        AlignedVector weight;
+        AlignedVector charge_sq;    // squared charge of each term, for the ionic strength
+        AlignedVector gamma_exp;    // z_0^2 - z_i^2 - i, see set_log_gamma_unit
+        AlignedVector conc_weight;  // conc * weight, what the residual actually needs
+        AlignedVector conc;
+        AlignedVector weight_max;        // largest |weight| of each species, see condition
+        AlignedVector log_ka_prod_base;  // log10 of ka_prod_base, exact even where that overflows
+        AlignedVector conc_weight_2;     // conc * weight of the second set, empty without one
+        AlignedVector weight_2;
+        double log_prod_max;             // bound on |log10| of both products, see alpha_direct_safe
+        // Accumulates the contribution of species [begin, end) to the residual and to
+        // d(residual)/d(ln h), specialised on n_terms when the group is created.
+        void (*kernel)(const Group &group, size_t begin, size_t end, const double *h_pow, double &x, double &dx);
+
+        explicit Group(size_t n_terms)
+            : n_terms(n_terms), size(0), stride(0), log_prod_max(0.0), kernel(select_kernel(n_terms)) {}
+    };
+
+    // Where a species lives inside the groups.
+    struct Slot {
+        size_t group;
+        size_t index;
+    };
+
+    explicit System(double Kw = 1.01e-14)
+        : Kw(Kw),
+          Kw_base(Kw),
+          log_gamma_unit(0.0),
+          charges_known(true),
+          second_weights(true),
+          n_terms_total(0),
+          pool(nullptr) {}
+
+    // `Ka_prod` are the cumulative Ka products (Ka_prod[0] = 1), `weight` the balance weight
+    // of each alpha term (charge for the CBE, proton excess over the reference for the PBE)
+    // and `charge` the charge of each term, which may be left empty when it is not known.
+    // The ascending `pKa` the products come from give their exact log10 form; when left empty
+    // it is taken from Ka_prod, which loses the products that over- or underflowed there.
+    // `weight_2` are the weights of the other balance; the second set is only kept while
+    // every species gives it.
+    void add_species(const std::vector<double> &Ka_prod, const std::vector<int> &weight, double conc,
+                     const std::vector<int> &charge = std::vector<int>(),
+                     const std::vector<double> &pKa = std::vector<double>(),
+                     const std::vector<int> &weight_2 = std::vector<int>()) {
+        size_t n_terms = Ka_prod.size();
+        if (n_terms == 0 || n_terms > kMaxAlphaTerms || weight.size() != n_terms ||
+            (!charge.empty() && charge.size() != n_terms) || (!pKa.empty() && pKa.size() + 1 != n_terms) ||
+            (!weight_2.empty() && weight_2.size() != n_terms)) {
+            throw std::invalid_argument("Invalid species layout.");
+        }
+        if (charge.empty()) {
+            charges_known = false;
+        }
+        if (weight_2.empty() && second_weights) {
+            second_weights = false;
+            for (size_t g = 0; g < groups.size(); ++g) {
+                AlignedVector().swap(groups[g].conc_weight_2);
+                AlignedVector().swap(groups[g].weight_2);
+            }
+        }
+
+        size_t g = find_group(n_terms);
+        Group &group = groups[g];
+        if (group.size == group.stride) {
+            grow(group, second_weights);
+        }
+
+        double log_Ka_prod[kMaxAlphaTerms];
+        if (!pKa.empty()) {
+            ka_log_products(pKa.data(), pKa.size(), log_Ka_prod);
+        }
+
+        size_t s = group.size++;
+        group.weight_max[s] = 0.0;
+        for (size_t i = 0; i < n_terms; ++i) {
+            size_t k = i * group.stride + s;
+            double z = charge.empty() ? 0.0 : charge[i];
+            double z0 = charge.empty() ? 0.0 : charge[0];
+            group.ka_prod_base[k] = Ka_prod[i];
+            group.weight[k] = weight[i];
+            group.conc_weight[k] = conc * weight[i];
+            group.charge_sq[k] = z * z;
+            group.gamma_exp[k] = z0 * z0 - z * z - static_cast<double>(i);
+            group.ka_prod[k] = Ka_prod[i] * std::pow(10, log_gamma_unit * group.gamma_exp[k]);
+            group.log_ka_prod_base[k] = pKa.empty() ? std::log10(Ka_prod[i]) : log_Ka_prod[i];
+            group.log_prod_max = std::max(group.log_prod_max, log_range(group, k, log_gamma_unit));
+            group.weight_max[s] = std::max(group.weight_max[s], std::fabs(group.weight[k]));
+            if (second_weights) {
+                group.weight_2[k] = weight_2[i];
+                group.conc_weight_2[k] = conc * weight_2[i];
+            }
+        }
+        group.conc[s] = conc;
+        n_terms_total += n_terms;
+
+        Slot slot = {g, s};
+        slots.push_back(slot);
+    }
+
+    void set_conc(size_t species, double conc) {
+        const Slot &slot = slots[species];
+        Group &group = groups[slot.group];
+        for (size_t i = 0; i < group.n_terms; ++i) {
+            size_t k = i * group.stride + slot.index;
+            group.conc_weight[k] = conc * group.weight[k];
+            if (second_weights) {
+                group.conc_weight_2[k] = conc * group.weight_2[k];
+            }
+        }
+        group.conc[slot.index] = conc;
+    }
+
+    // Removes one species; the species added after it move down by one place, as in a
+    // vector. The member stored last in its group takes over its column. Whether the charges
+    // and the weights of the other balance are known is left as it was.
+    void remove_species(size_t species) {
+        if (species >= slots.size()) {
+            throw std::invalid_argument("No such species.");
+        }
+        const Slot slot = slots[species];
+        Group &group = groups[slot.group];
+        const size_t last = group.size - 1;
+        if (slot.index != last) {
+            move_column(group, last, slot.index, second_weights);
+            for (size_t sp = 0; sp < slots.size(); ++sp) {
+                if (slots[sp].group == slot.group && slots[sp].index == last) {
+                    slots[sp].index = slot.index;
+                    break;
+                }
+            }
+        }
+        group.size--;
+        n_terms_total -= group.n_terms;
+        slots.erase(slots.begin() + species);
+    }
+
+    // Kw at zero ionic strength; the value in use follows the current activity scale.
+    void set_Kw(double Kw) {
+        if (!(Kw > 0)) {
+            throw std::invalid_argument("Kw must be positive.");
+        }
+        Kw_base = Kw;
+        this->Kw = Kw * std::pow(10, -2.0 * log_gamma_unit);
+    }
+
+    // Replaces the constants of one species in place, given as its n_terms - 1 pKa values in
+    // step order. The group's range bound only grows, so a species that moves back towards
+    // ordinary constants may keep a group on the log-space path; the results stay exact.
+    void set_pKa(size_t species, const double *pKa) {
+        const Slot &slot = slots[species];
+        Group &group = groups[slot.group];
+        double log_Ka_prod[kMaxAlphaTerms];
+        ka_log_products(pKa, group.n_terms - 1, log_Ka_prod);
+        for (size_t i = 0; i < group.n_terms; ++i) {
+            size_t k = i * group.stride + slot.index;
+            group.log_ka_prod_base[k] = log_Ka_prod[i];
+            group.ka_prod_base[k] = std::pow(10, log_Ka_prod[i]);
+            group.ka_prod[k] = group.ka_prod_base[k] * std::pow(10, log_gamma_unit * group.gamma_exp[k]);
+            group.log_prod_max = std::max(group.log_prod_max, log_range(group, k, log_gamma_unit));
+        }
+    }
+
+    // Switches the equilibrium constants to the concentration scale for an ionic strength
+    // at which log10(gamma) = z^2 * f for an ion of charge z. For the step from charge
+    // z_(j-1) to z_j, Ka = Ka0 * gamma(z_(j-1)) / (gamma(H+) * gamma(z_j)); the products
+    // telescope, so the i-th cumulative product is scaled by 10^(f * (z_0^2 - z_i^2 - i)).
+    // The integer exponents take few distinct values and their powers are computed once.
+    void set_log_gamma_unit(double f) {
+        if (f == log_gamma_unit) {
+            return;
+        }
+        log_gamma_unit = f;
+        Kw = Kw_base * std::pow(10, -2.0 * f);
+
+        std::map<int, double> factor;
+        for (size_t g = 0; g < groups.size(); ++g) {
+            Group &group = groups[g];
+            group.log_prod_max = 0.0;
+            for (size_t k = 0; k < group.n_terms * group.stride; ++k) {
+                int e = static_cast<int>(group.gamma_exp[k]);
+                std::map<int, double>::iterator it = factor.find(e);
+                if (it == factor.end()) {
+                    it = factor.insert(std::make_pair(e, std::pow(10, f * e))).first;
+                }
+                group.ka_prod[k] = group.ka_prod_base[k] * it->second;
+                group.log_prod_max = std::max(group.log_prod_max, log_range(group, k, f));
+            }
+        }
+    }
+
+    // Ionic strength 0.5 * sum c z^2 at the given pH, counting H3O+ and OH-.
+    double ionic_strength(double pH) const {
+        double h3o = std::pow(10, -pH);
+        double I = h3o + Kw / h3o;
+
+        double h_pow[kMaxAlphaTerms];
+        h_pow[0] = 1.0;
+        for (size_t k = 1; k < kMaxAlphaTerms; ++k) {
+            h_pow[k] = h_pow[k - 1] * h3o;
+        }
+
+        for (size_t g = 0; g < groups.size(); ++g) {
+            const Group &group = groups[g];
+            const bool direct = alpha_direct_safe(pH, group.n_terms, group.log_prod_max);
+            for (size_t s = 0; s < group.size; ++s) {
+                double t[kMaxAlphaTerms];
+                species_terms(group, s, pH, h_pow, direct, t);
+                double den = 0.0, zsq = 0.0;
+                for (size_t i = 0; i < group.n_terms; ++i) {
+                    den += t[i];
+                    zsq += group.charge_sq[i * group.stride + s] * t[i];
+                }
+                I += group.conc[s] * zsq / den;
+            }
+        }
+        return 0.5 * I;
+    }
+
+    bool has_charges() const {
+        return charges_known;
+    }
+
+    // Whether every species gave the weights of the other balance, see residual_pair.
+    bool has_second_weights() const {
+        return second_weights;
+    }
+
+    double get_log_gamma_unit() const {
+        return log_gamma_unit;
+    }
+
+    // Signed balance residual; `dres` receives d(residual)/d(pH).
+    //
+    // With t_i = h^(n-1-i) * P_i, the derivative of sum_i w_i t_i / sum_i t_i with respect
+    // to ln h is the covariance of the weight and the bound-proton count n-1-i.
+    double residual(double pH, double *dres = nullptr) const {
+        double h3o = std::pow(10, -pH);
+        double oh = Kw / h3o;
+        double x = h3o - oh;
+        double dx = h3o + oh;  // d(residual)/d(ln h3o)
+
+        double h_pow[kMaxAlphaTerms];
+        h_pow[0] = 1.0;
+        for (size_t k = 1; k < kMaxAlphaTerms; ++k) {
+            h_pow[k] = h_pow[k - 1] * h3o;
+        }
+
+        if (pool && n_terms_total >= kParallelResidualTerms) {
+            residual_blocks(pH, h_pow, x, dx);
+        } else {
+            for (size_t g = 0; g < groups.size(); ++g) {
+                residual_range(groups[g], 0, groups[g].size, pH, h_pow, x, dx);
+            }
+        }
+
+        if (dres) {
+            *dres = -std::log(10.0) * dx;
+        }
+        return x;
+    }
+
+    // Both balances from one pass over the alpha terms: res[0] and dres[0] as residual() gives
+    // them, res[1] and dres[1] for the second weight set. The terms, their sum and the
+    // bound-proton moment are shared, only the weighted sums are taken twice, so this costs
+    // little more than residual(). Needs has_second_weights(); always serial.
+    void residual_pair(double pH, double res[2], double dres[2]) const {
+        double h3o = std::pow(10, -pH);
+        double oh = Kw / h3o;
+        double x[2] = {h3o - oh, h3o - oh};
+        double dx[2] = {h3o + oh, h3o + oh};
+
+        double h_pow[kMaxAlphaTerms];
+        h_pow[0] = 1.0;
+        for (size_t k = 1; k < kMaxAlphaTerms; ++k) {
+            h_pow[k] = h_pow[k - 1] * h3o;
+        }
+
+        for (size_t g = 0; g < groups.size(); ++g) {
+            const Group &group = groups[g];
+            if (alpha_direct_safe(pH, group.n_terms, group.log_prod_max)) {
+                residual_pair_direct(group, h_pow, x, dx);
+            } else {
+                residual_pair_log(group, pH, x, dx);
+            }
+        }
+
+        for (int b = 0; b < 2; ++b) {
+            res[b] = x[b];
+            dres[b] = -std::log(10.0) * dx[b];
+        }
+    }
+
+    // Contribution of one species to residual(), and to its slope in `dres`, so that an edit
+    // of that species can be followed without evaluating the whole system.
+    double species_residual(size_t species, double pH, double *dres = nullptr) const {
+        double h3o = std::pow(10, -pH);
+        double h_pow[kMaxAlphaTerms];
+        h_pow[0] = 1.0;
+        for (size_t k = 1; k < kMaxAlphaTerms; ++k) {
+            h_pow[k] = h_pow[k - 1] * h3o;
+        }
+
+        double x = 0.0, dx = 0.0;
+        const size_t s = slots[species].index;
+        residual_range(groups[slots[species].group], s, s + 1, pH, h_pow, x, dx);
+        if (dres) {
+            *dres = -std::log(10.0) * dx;
+        }
+        return x;
+    }
+
+    // Mean weight sum_i w_i alpha_i of every species, i.e. d(residual)/d(conc), in the order
+    // the species were added.
+    void weight_means(double pH, double *out) const {
+        double h3o = std::pow(10, -pH);
+        double h_pow[kMaxAlphaTerms];
+        h_pow[0] = 1.0;
+        for (size_t k = 1; k < kMaxAlphaTerms; ++k) {
+            h_pow[k] = h_pow[k - 1] * h3o;
+        }
+
+        for (size_t sp = 0; sp < slots.size(); ++sp) {
+            const Group &group = groups[slots[sp].group];
+            const size_t s = slots[sp].index;
+            double t[kMaxAlphaTerms];
+            species_terms(group, s, pH, h_pow, alpha_direct_safe(pH, group.n_terms, group.log_prod_max), t);
+            double den = 0.0, num = 0.0;
+            for (size_t i = 0; i < group.n_terms; ++i) {
+                den += t[i];
+                num += group.weight[i * group.stride + s] * t[i];
+            }
+            out[sp] = num / den;
+        }
+    }
+
+    // Sensitivity dpH/dc of a root at pH, where the residual has the slope d(residual)/d(pH),
+    // to the concentration of every species, in the order the species were added. From
+    // residual(pH, c) = 0, dpH/dc_s = -(d(residual)/dc_s) / slope = -weight_mean_s / slope,
+    // so the whole vector costs one pass over the species.
+    //
+    // The buffer capacity itself, the strong base per unit of pH, is -slope: a strong base
+    // is a species whose weight mean is 1 at every pH.
+    void sensitivities(double pH, double slope, double *out) const {
+        weight_means(pH, out);
+        for (size_t s = 0; s < slots.size(); ++s) {
+            out[s] /= -slope;
+        }
+    }
+
+    // Alpha fractions of one species with the constants currently in use.
+    void alpha(size_t species, double pH, double *out) const {
+        const Group &group = groups[slots[species].group];
+        const size_t n_terms = group.n_terms;
+        if (!alpha_direct_safe(pH, n_terms, group.log_prod_max)) {
+            species_terms(group, slots[species].index, pH, nullptr, false, out);
+        } else {
+            double h3o = std::pow(10, -pH);
+            double hp = 1.0;
+            for (size_t i = n_terms; i-- > 0;) {
+                out[i] = hp * group.ka_prod[i * group.stride + slots[species].index];
+                hp *= h3o;
+            }
+        }
+
+        double den = 0.0;
+        for (size_t i = n_terms; i-- > 0;) {
+            den += out[i];
+        }
+        for (size_t i = 0; i < n_terms; ++i) {
+            out[i] /= den;
+        }
+    }
+
+    // Condition of the root at pH, where the residual has the slope d(residual)/d(pH): the
+    // shift in pH caused by a relative error of 1 in every term of the balance, i.e. the sum
+    // of the terms' magnitudes over |slope|. Multiplied by the machine epsilon it bounds the
+    // accuracy any solver can reach. Ordinary solutions are close to 1; it grows where large
+    // contributions cancel with little buffering, e.g. a salt of a strong acid and base.
+    //
+    // Each species is counted with its largest |weight| instead of the mean over its forms, so
+    // this is an upper bound, within a factor of the largest weight, at the cost of a sum.
+    double condition(double pH, double slope) const {
+        double h3o = std::pow(10, -pH);
+        double scale = h3o + Kw / h3o;
+        for (size_t g = 0; g < groups.size(); ++g) {
+            const Group &group = groups[g];
+            for (size_t s = 0; s < group.size; ++s) {
+                scale += group.conc[s] * group.weight_max[s];
+            }
+        }
+        return scale / std::fabs(slope);
+    }
+
+    // Shares `pool` (not owned, may be null) for evaluations of this system. Each residual of
+    // a system with at least kParallelResidualTerms alpha terms is then split into blocks of
+    // kParallelBlock species, whose sums are added in a fixed order, so the result does not
+    // depend on the number of threads. Smaller systems are evaluated serially as before.
+    void set_pool(WorkStealingPool *pool) {
+        this->pool = pool;
+    }
+
+    // The pool when the system is large enough for the bracket search to evaluate several pH
+    // at once, see bracket_range_parallel; null otherwise.
+    WorkStealingPool *scan_pool() const {
+        return pool && pool->size() > 1 && n_terms_total >= kParallelScanTerms ? pool : nullptr;
+    }
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    double get_Kw() const {
+        return Kw;
+    }
+
+    const std::vector<Group> &get_groups() const {
+        return groups;
+    }
+
+    const Slot &get_slot(size_t species) const {
+        return slots[species];
+    }
+
+   private:
+    static const size_t kBlock = 64;
+
+    // Thresholds of the parallel paths in alpha terms. An evaluation costs about 4 ns per
+    // term, a hand-off to the pool one to a few microseconds while its workers are awake.
+    static const size_t kParallelResidualTerms = 2048;
+    static const size_t kParallelScanTerms = 512;
+    static const size_t kParallelBlock = 256;
+
+    void residual_range(const Group &group, size_t begin, size_t end, double pH, const double *h_pow, double &x,
+                        double &dx) const {
+        if (alpha_direct_safe(pH, group.n_terms, group.log_prod_max)) {
+            group.kernel(group, begin, end, h_pow, x, dx);
+        } else {
+            residual_log(group, begin, end, pH, x, dx);
+        }
+    }
+
+    // Species sums of residual() over blocks of kParallelBlock species, one pool task each.
+    void residual_blocks(double pH, const double *h_pow, double &x, double &dx) const {
+        std::vector<size_t> first(groups.size() + 1, 0);  // first block of each group
+        for (size_t g = 0; g < groups.size(); ++g) {
+            first[g + 1] = first[g] + (groups[g].size + kParallelBlock - 1) / kParallelBlock;
+        }
+        std::vector<double> sums(2 * first.back(), 0.0);
+
+        pool->run(first.back(), [&](size_t task) {
+            size_t g = 0;
+            while (first[g + 1] <= task) {
+                ++g;
+            }
+            size_t begin = (task - first[g]) * kParallelBlock;
+            size_t end = std::min(begin + kParallelBlock, groups[g].size);
+            residual_range(groups[g], begin, end, pH, h_pow, sums[2 * task], sums[2 * task + 1]);
+        });
+        for (size_t task = 0; task < first.back(); ++task) {
+            x += sums[2 * task];
+            dx += sums[2 * task + 1];
+        }
+    }
+
+    // Residual kernel for groups of N terms. Each species is accumulated in registers with the
+    // term loop unrolled, and its contributions are summed in species order as in the generic
+    // kernel. The unroll has to happen before vectorisation: left as a loop, GCC turns the N
+    // row loads into gathers, which is slower than the generic kernel.
+    template <size_t N>
+    static void residual_kernel(const Group &group, size_t begin, size_t end, const double *h_pow, double &x, double &dx) {
+        const double *P[N];
+        const double *cw[N];
+        double hp[N];
+        for (size_t i = 0; i < N; ++i) {
+            P[i] = group.ka_prod.data() + i * group.stride;
+            cw[i] = group.conc_weight.data() + i * group.stride;
+            hp[i] = h_pow[N - 1 - i];
+        }
+
+        for (size_t s = begin; s < end; ++s) {
+            double den = 0.0, bound = 0.0, wsum = 0.0, wbound = 0.0;
+#pragma GCC unroll 8
+            for (size_t i = 0; i < N; ++i) {
+                const double n_bound = static_cast<double>(N - 1 - i);
+                double t = hp[i] * P[i][s];
+                double wt = cw[i][s] * t;
+                den += t;
+                bound += n_bound * t;
+                wsum += wt;
+                wbound += n_bound * wt;
+            }
+            double inv = 1.0 / den;
+            x += wsum * inv;
+            dx += (wbound - wsum * bound * inv) * inv;
+        }
+    }
+
+    // Any number of terms, for species beyond the specialised orders.
+    static void residual_generic(const Group &group, size_t begin, size_t end, const double *h_pow, double &x, double &dx) {
+        const size_t n_terms = group.n_terms;
+        for (size_t s0 = begin; s0 < end; s0 += kBlock) {
+            const size_t nb = end - s0 < kBlock ? end - s0 : kBlock;
+            double den[kBlock], bound[kBlock], wsum[kBlock], wbound[kBlock];
+            for (size_t s = 0; s < nb; ++s) {
+                den[s] = bound[s] = wsum[s] = wbound[s] = 0.0;
+            }
+
+            for (size_t i = 0; i < n_terms; ++i) {
+                const double hp = h_pow[n_terms - 1 - i];
+                const double n_bound = static_cast<double>(n_terms - 1 - i);
+                const double *P = group.ka_prod.data() + i * group.stride + s0;
+                const double *cw = group.conc_weight.data() + i * group.stride + s0;
+                for (size_t s = 0; s < nb; ++s) {
+                    double t = hp * P[s];
+                    double wt = cw[s] * t;
+                    den[s] += t;
+                    bound[s] += n_bound * t;
+                    wsum[s] += wt;
+                    wbound[s] += n_bound * wt;
+                }
+            }
+
+            for (size_t s = 0; s < nb; ++s) {
+                double inv = 1.0 / den[s];
+                x += wsum[s] * inv;
+                dx += (wbound[s] - wsum[s] * bound[s] * inv) * inv;
+            }
+        }
+    }
+
+    // Both weight sets over a whole group, blocked as residual_generic.
+    static void residual_pair_direct(const Group &group, const double *h_pow, double *x, double *dx) {
+        const size_t n_terms = group.n_terms;
+        for (size_t s0 = 0; s0 < group.size; s0 += kBlock) {
+            const size_t nb = group.size - s0 < kBlock ? group.size - s0 : kBlock;
+            double den[kBlock], bound[kBlock], wsum[2][kBlock], wbound[2][kBlock];
+            for (size_t s = 0; s < nb; ++s) {
+                den[s] = bound[s] = wsum[0][s] = wbound[0][s] = wsum[1][s] = wbound[1][s] = 0.0;
+            }
+
+            for (size_t i = 0; i < n_terms; ++i) {
+                const double hp = h_pow[n_terms - 1 - i];
+                const double n_bound = static_cast<double>(n_terms - 1 - i);
+                const double *P = group.ka_prod.data() + i * group.stride + s0;
+                const double *cw = group.conc_weight.data() + i * group.stride + s0;
+                const double *cw2 = group.conc_weight_2.data() + i * group.stride + s0;
+                for (size_t s = 0; s < nb; ++s) {
+                    double t = hp * P[s];
+                    double wt = cw[s] * t;
+                    double wt2 = cw2[s] * t;
+                    den[s] += t;
+                    bound[s] += n_bound * t;
+                    wsum[0][s] += wt;
+                    wbound[0][s] += n_bound * wt;
+                    wsum[1][s] += wt2;
+                    wbound[1][s] += n_bound * wt2;
+                }
+            }
+
+            for (size_t s = 0; s < nb; ++s) {
+                double inv = 1.0 / den[s];
+                for (int b = 0; b < 2; ++b) {
+                    x[b] += wsum[b][s] * inv;
+                    dx[b] += (wbound[b][s] - wsum[b][s] * bound[s] * inv) * inv;
+                }
+            }
+        }
+    }
+
+    void residual_pair_log(const Group &group, double pH, double *x, double *dx) const {
+        const size_t n_terms = group.n_terms;
+        for (size_t s = 0; s < group.size; ++s) {
+            double t[kMaxAlphaTerms];
+            species_terms(group, s, pH, nullptr, false, t);
+            double den = 0.0, bound = 0.0, wsum[2] = {0.0, 0.0}, wbound[2] = {0.0, 0.0};
+            for (size_t i = 0; i < n_terms; ++i) {
+                const size_t k = i * group.stride + s;
+                const double n_bound = static_cast<double>(n_terms - 1 - i);
+                const double wt[2] = {group.conc_weight[k] * t[i], group.conc_weight_2[k] * t[i]};
+                den += t[i];
+                bound += n_bound * t[i];
+                for (int b = 0; b < 2; ++b) {
+                    wsum[b] += wt[b];
+                    wbound[b] += n_bound * wt[b];
+                }
+            }
+            double inv = 1.0 / den;
+            for (int b = 0; b < 2; ++b) {
+                x[b] += wsum[b] * inv;
+                dx[b] += (wbound[b] - wsum[b] * bound * inv) * inv;
+            }
+        }
+    }
+
+    // Same accumulation as the kernels above for groups outside the direct range, on terms
+    // from species_terms, which are scaled per species; the scale cancels in both sums.
+    void residual_log(const Group &group, size_t begin, size_t end, double pH, double &x, double &dx) const {
+        const size_t n_terms = group.n_terms;
+        for (size_t s = begin; s < end; ++s) {
+            double t[kMaxAlphaTerms];
+            species_terms(group, s, pH, nullptr, false, t);
+            double den = 0.0, bound = 0.0, wsum = 0.0, wbound = 0.0;
+            for (size_t i = 0; i < n_terms; ++i) {
+                const double n_bound = static_cast<double>(n_terms - 1 - i);
+                double wt = group.conc_weight[i * group.stride + s] * t[i];
+                den += t[i];
+                bound += n_bound * t[i];
+                wsum += wt;
+                wbound += n_bound * wt;
+            }
+            double inv = 1.0 / den;
+            x += wsum * inv;
+            dx += (wbound - wsum * bound * inv) * inv;
+        }
+    }
+
+    // Terms t_i = h^(n-1-i) * P_i of species s, from the powers `h_pow` of [H3O+] when
+    // `direct`, otherwise in log space and divided by the largest term, which callers only
+    // use in ratios.
+    void species_terms(const Group &group, size_t s, double pH, const double *h_pow, bool direct, double *t) const {
+        const size_t n_terms = group.n_terms;
+        if (direct) {
+            for (size_t i = 0; i < n_terms; ++i) {
+                t[i] = h_pow[n_terms - 1 - i] * group.ka_prod[i * group.stride + s];
+            }
+            return;
+        }
+
+        double top = -HUGE_VAL;
+        for (size_t i = 0; i < n_terms; ++i) {
+            size_t k = i * group.stride + s;
+            double log_P = group.log_ka_prod_base[k] + log_gamma_unit * group.gamma_exp[k];
+            t[i] = log_P - static_cast<double>(n_terms - 1 - i) * pH;
+            top = std::max(top, t[i]);
+        }
+        for (size_t i = 0; i < n_terms; ++i) {
+            t[i] = std::pow(10, t[i] - top);
+        }
+    }
+
+    static double log_range(const Group &group, size_t k, double f) {
+        double log_base = group.log_ka_prod_base[k];
+        return std::max(std::fabs(log_base), std::fabs(log_base + f * group.gamma_exp[k]));
+    }
+
+    typedef void (*Kernel)(const Group &, size_t, size_t, const double *, double &, double &);
+
+    static Kernel select_kernel(size_t n_terms) {
+        switch (n_terms) {
+            case 1: return residual_kernel<1>;
+            case 2: return residual_kernel<2>;
+            case 3: return residual_kernel<3>;
+            case 4: return residual_kernel<4>;
+            case 5: return residual_kernel<5>;
+            case 6: return residual_kernel<6>;
+            case 7: return residual_kernel<7>;
+            default: return residual_generic;
+        }
+    }
+
+    size_t find_group(size_t n_terms) {
+        for (size_t g = 0; g < groups.size(); ++g) {
+            if (groups[g].n_terms == n_terms) {
+                return g;
+            }
+        }
+        groups.push_back(Group(n_terms));
+        return groups.size() - 1;
+    }
+
+    static void grow_rows(AlignedVector &data, size_t n_rows, size_t old_stride, size_t new_stride) {
+        AlignedVector grown(n_rows * new_stride, 0.0);
+        for (size_t i = 0; i < n_rows; ++i) {
+            for (size_t s = 0; s < old_stride; ++s) {
+                grown[i * new_stride + s] = data[i * old_stride + s];
+            }
+        }
+        data.swap(grown);
+    }
+
+    static void move_column(Group &group, size_t from, size_t to, bool second_weights) {
+        AlignedVector *rows[] = {&group.ka_prod, &group.ka_prod_base, &group.weight, &group.charge_sq,
+                                 &group.gamma_exp, &group.conc_weight, &group.log_ka_prod_base,
+                                 &group.conc_weight_2, &group.weight_2};
+        const size_t n_rows = second_weights ? 9 : 7;
+        for (size_t r = 0; r < n_rows; ++r) {
+            for (size_t i = 0; i < group.n_terms; ++i) {
+                (*rows[r])[i * group.stride + to] = (*rows[r])[i * group.stride + from];
+            }
+        }
+        group.conc[to] = group.conc[from];
+        group.weight_max[to] = group.weight_max[from];
+    }
+
+    static void grow(Group &group, bool second_weights) {
+        size_t new_stride = group.stride == 0 ? 8 : 2 * group.stride;
+        grow_rows(group.ka_prod, group.n_terms, group.stride, new_stride);
+        grow_rows(group.ka_prod_base, group.n_terms, group.stride, new_stride);
+        grow_rows(group.weight, group.n_terms, group.stride, new_stride);
+        grow_rows(group.charge_sq, group.n_terms, group.stride, new_stride);
+        grow_rows(group.gamma_exp, group.n_terms, group.stride, new_stride);
+        grow_rows(group.conc_weight, group.n_terms, group.stride, new_stride);
+        grow_rows(group.conc, 1, group.stride, new_stride);
+        grow_rows(group.weight_max, 1, group.stride, new_stride);
+        grow_rows(group.log_ka_prod_base, group.n_terms, group.stride, new_stride);
+        if (second_weights) {
+            grow_rows(group.conc_weight_2, group.n_terms, group.stride, new_stride);
+            grow_rows(group.weight_2, group.n_terms, group.stride, new_stride);
+        }
+        group.stride = new_stride;
+    }
+
+    std::vector<Group> groups;
+    std::vector<Slot> slots;
+    double Kw;       // on the concentration scale of the current ionic strength
+    double Kw_base;  // at zero ionic strength
+    double log_gamma_unit;
+    bool charges_known;
+    bool second_weights;  // every species gave weight_2, see add_species
+    size_t n_terms_total;
+    WorkStealingPool *pool;
+};
+
+#endif  // PH_SYSTEM_H
@@ -0,0 +1,125 @@
+#ifndef PH_TEMPERATURE_H
+#define PH_TEMPERATURE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Temperature dependence of the equilibrium constants. Constants are given at 25 C together
+// with the standard enthalpy dH (kJ/mol) and the heat capacity change dCp (J/(mol K)) of each
+// dissociation step. At T in kelvin,
+//     log10 K(T) = log10 K(T0) - dH/(R ln 10) (1/T - 1/T0) + dCp/(R ln 10) (T0/T - 1 + ln(T/T0)),
+// the van 't Hoff equation with a constant heat capacity change. Kw follows the fit of Harned
+// and Owen, pKw = 4470.99/T - 6.0875 + 0.01706 T, scaled so that the Kw given at 25 C is kept.
+//
+// Sweeps that build the same species at many temperatures read the shifts from a table
+// instead of evaluating them (log_k_table_shifts). The table is uniform in 1/T, where the
+// enthalpy term is linear and so interpolated exactly; the heat capacity term is off by at
+// most 6e-7 in log10 K per 100 J/(mol K) over 0 to 100 C.
+
+const double kReferenceTemperature = 25.0;  // C, where the constants and Kw are given
+const double kKelvinOffset = 273.15;
+const double kGasConstant = 8.314462618;  // J/(mol K)
+
+const size_t kLogKTablePoints = 401;
+const double kLogKTableMin = 0.0;  // C
+const double kLogKTableMax = 100.0;
+
+inline void check_temperature(double celsius) {
+    if (!(celsius > -kKelvinOffset) || !std::isfinite(celsius)) {
+        throw std::invalid_argument("Invalid temperature " + std::to_string(celsius) + " C.");
+    }
+}
+
+// Comma-separated list of temperatures in C, e.g. "5,25,37".
+inline std::vector<double> parse_temperature_list(const std::string &list) {
+    std::vector<double> temperatures;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        char *end = nullptr;
+        double celsius = std::strtod(item.c_str(), &end);
+        if (end == item.c_str() || *end != '\0') {
+            throw std::invalid_argument("Invalid temperature '" + item + "'");
+        }
+        check_temperature(celsius);
+        temperatures.push_back(celsius);
+    }
+    if (temperatures.empty()) {
+        throw std::invalid_argument("No temperature given");
+    }
+    return temperatures;
+}
+
+// log10 K(T) - log10 K(25 C) of one dissociation step; the pKa moves by minus this.
+inline double log_k_shift(double dH, double dCp, double celsius) {
+    const double T0 = kReferenceTemperature + kKelvinOffset;
+    const double T = celsius + kKelvinOffset;
+    const double f = 1.0 / (kGasConstant * std::log(10.0));
+    return -1000.0 * dH * f * (1.0 / T - 1.0 / T0) + dCp * f * (T0 / T - 1.0 + std::log(T / T0));
+}
+
+// Kw at `celsius` for the given value at 25 C.
+inline double kw_at_temperature(double Kw, double celsius) {
+    if (celsius == kReferenceTemperature) {
+        return Kw;
+    }
+    check_temperature(celsius);
+    auto pKw = [](double T) { return 4470.99 / T - 6.0875 + 0.01706 * T; };
+    return Kw * std::pow(10, pKw(kReferenceTemperature + kKelvinOffset) - pKw(celsius + kKelvinOffset));
+}
+
+// Position of `celsius` on the table grid: point p and the weight w of point p + 1. The grid
+// runs from kLogKTableMax to kLogKTableMin, uniform in 1/T. False outside it.
+inline bool log_k_table_locate(double celsius, size_t &p, double &w) {
+    const double x_min = 1.0 / (kLogKTableMax + kKelvinOffset);
+    const double x_max = 1.0 / (kLogKTableMin + kKelvinOffset);
+    double u = (1.0 / (celsius + kKelvinOffset) - x_min) / (x_max - x_min) * (kLogKTablePoints - 1);
+    if (!(u >= 0.0 && u <= kLogKTablePoints - 1)) {
+        return false;
+    }
+    p = std::min(static_cast<size_t>(u), kLogKTablePoints - 2);
+    w = u - static_cast<double>(p);
+    return true;
+}
+
+inline double log_k_table_temperature(size_t p) {
+    const double x_min = 1.0 / (kLogKTableMax + kKelvinOffset);
+    const double x_max = 1.0 / (kLogKTableMin + kKelvinOffset);
+    return 1.0 / (x_min + (x_max - x_min) * p / (kLogKTablePoints - 1)) - kKelvinOffset;
+}
+
+// Shifts of n steps on the grid, step-major: table[i * kLogKTablePoints + p].
+inline void log_k_table_fill(const double *dH, const double *dCp, size_t n, double *table) {
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t p = 0; p < kLogKTablePoints; ++p) {
+            table[i * kLogKTablePoints + p] = log_k_shift(dH[i], dCp[i], log_k_table_temperature(p));
+        }
+    }
+}
+
+// Shifts of n steps at `celsius`, interpolated from a table of log_k_table_fill or, outside
+// the grid, evaluated directly.
+inline void log_k_table_shifts(const double *table, const double *dH, const double *dCp, size_t n, double celsius,
+                               double *out) {
+    size_t p;
+    double w;
+    if (!log_k_table_locate(celsius, p, w)) {
+        check_temperature(celsius);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = log_k_shift(dH[i], dCp[i], celsius);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        const double *row = table + i * kLogKTablePoints + p;
+        out[i] = row[0] + w * (row[1] - row[0]);
+    }
+}
+
+#endif  // PH_TEMPERATURE_H
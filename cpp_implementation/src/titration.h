@@ -0,0 +1,232 @@
+#ifndef PH_TITRATION_H
+#define PH_TITRATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "cli.h"
+#include "mixture_io.h"
+#include "solver.h"
+
+// Titration curves: a volume V0 of analyte receives increasing volumes v of titrant. Every
+// point only changes concentrations, so the calculator is built once and each solve is
+// warm-started from the previous pH, moved along the tangent
+//     dpH/dv = -(d(residual)/dv) / (d(residual)/dpH),
+// where d(residual)/dv = sum_s dc_s/dv * sum_i w_i alpha_i comes from the converged state.
+
+struct TitrationOptions {
+    double V0;        // analyte volume
+    double V_max;     // titrant volume at the last point, same unit as V0
+    size_t points;
+    double tol;
+    double max_step;  // largest predicted pH change between two points
+
+    TitrationOptions() : V0(25.0), V_max(50.0), points(1001), tol(1e-12), max_step(0.5) {}
+};
+
+struct TitrationPoint {
+    double volume;
+    double pH;
+    double dpH_dV;
+    int evaluations;
+    bool converged;
+};
+
+struct EquivalencePoint {
+    double volume;
+    double pH;
+};
+
+struct TitrationStats {
+    size_t points;
+    size_t evaluations;
+    size_t failed;
+    double seconds;
+    std::vector<EquivalencePoint> equivalence;
+};
+
+// Flags a local maximum of |dpH/dV| as an equivalence point when it stands well above the
+// flattest part of the curve since the previous one. Works on the stream of points with a
+// lag of one point; the volume is refined with a parabola through the three slopes.
+class EquivalenceDetector {
+   public:
+    explicit EquivalenceDetector(double ratio = 10.0) : ratio(ratio), count(0), floor(std::numeric_limits<double>::max()), window() {}
+
+    bool push(const TitrationPoint &p, EquivalencePoint &found) {
+        window[0] = window[1];
+        window[1] = window[2];
+        window[2] = p;
+        count++;
+
+        double s0 = std::fabs(window[0].dpH_dV), s1 = std::fabs(window[1].dpH_dV), s2 = std::fabs(window[2].dpH_dV);
+        floor = std::min(floor, s2);
+        if (count < 3 || !(s1 > s0 && s1 >= s2 && s1 > ratio * floor)) {
+            return false;
+        }
+
+        double curvature = s0 - 2.0 * s1 + s2;
+        double h = window[2].volume - window[1].volume;
+        double offset = curvature != 0.0 ? 0.5 * (s0 - s2) / curvature * h : 0.0;
+        found.volume = window[1].volume + offset;
+        found.pH = window[1].pH + window[1].dpH_dV * offset;
+        floor = s2;
+        return true;
+    }
+
+   private:
+    double ratio;
+    size_t count;
+    double floor;
+    TitrationPoint window[3];
+};
+
+// `calc` holds the analyte species first (n_analyte of them) and then the titrant species;
+// `nominal` gives their concentrations in the analyte solution and in the titrant stock.
+template <class Calc, class Sink>
+TitrationStats titrate(Calc &calc, const std::vector<double> &nominal, size_t n_analyte, const TitrationOptions &options,
+                       const Sink &on_point) {
+    TitrationStats stats = {0, 0, 0, 0.0, std::vector<EquivalencePoint>()};
+    auto start = std::chrono::steady_clock::now();
+
+    const size_t n = nominal.size();
+    std::vector<double> dc_dv(n), weight_mean(n);
+    EquivalenceDetector detector;
+    double pH = 7.0, dpH_dV = 0.0, v_prev = 0.0;
+
+    for (size_t k = 0; k < options.points; ++k) {
+        double v = options.points > 1 ? options.V_max * k / (options.points - 1) : 0.0;
+        double total = options.V0 + v;
+        for (size_t i = 0; i < n; ++i) {
+            double c = i < n_analyte ? nominal[i] * options.V0 / total : nominal[i] * v / total;
+            calc.set_conc(i, c);
+            dc_dv[i] = i < n_analyte ? -c / total : nominal[i] * options.V0 / (total * total);
+        }
+
+        SolveResult r;
+        if (k == 0) {
+            r = calc.solve(pH, false, 0, options.tol);
+        } else {
+            double predicted = dpH_dV * (v - v_prev);
+            predicted = std::max(-options.max_step, std::min(options.max_step, predicted));
+            r = calc.solve_warm(pH + predicted, 0.05, options.tol);
+        }
+
+        TitrationPoint point;
+        point.volume = v;
+        point.pH = r.pH;
+        point.evaluations = r.evaluations;
+        point.converged = r.converged;
+
+        calc.get_system().weight_means(r.pH, weight_mean.data());
+        double dres_dv = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            dres_dv += dc_dv[i] * weight_mean[i];
+        }
+        point.dpH_dV = r.slope != 0.0 ? -dres_dv / r.slope : 0.0;
+
+        on_point(point);
+
+        EquivalencePoint eq;
+        if (detector.push(point, eq)) {
+            stats.equivalence.push_back(eq);
+        }
+
+        stats.points++;
+        stats.evaluations += r.evaluations;
+        stats.failed += r.converged ? 0 : 1;
+        if (r.converged) {
+            pH = r.pH;
+            dpH_dV = point.dpH_dV;
+        } else {
+            dpH_dV = 0.0;
+        }
+        v_prev = v;
+    }
+
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+inline void print_titration_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --titrate <analyte.csv> <titrant.csv> <output.csv> [--v0 V] [--vmax V] [--points N] [--kw Kw]\n",
+            program);
+    fprintf(stderr, "The analyte and titrant files use the batch CSV format; the first mixture of each is used.\n");
+}
+
+// Command-line entry point of the titration mode, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int titration_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    if (argc < 5) {
+        print_titration_usage(argv[0]);
+        return 1;
+    }
+
+    TitrationOptions options;
+    double Kw = 1.01e-14;
+    try {
+        for (int i = 5; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--v0" && i + 1 < argc) {
+                options.V0 = option_positive(arg, argv[++i]);
+            } else if (arg == "--vmax" && i + 1 < argc) {
+                options.V_max = option_nonnegative(arg, argv[++i]);
+            } else if (arg == "--points" && i + 1 < argc) {
+                options.points = static_cast<size_t>(option_integer(arg, argv[++i], 2, 1000000000));
+            } else if (arg == "--kw" && i + 1 < argc) {
+                Kw = option_positive(arg, argv[++i]);
+            } else {
+                print_titration_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        MixtureTable analyte = read_mixtures_csv(argv[2], n_weights);
+        MixtureTable titrant = read_mixtures_csv(argv[3], n_weights);
+        if (analyte.mixture_id.empty() || titrant.mixture_id.empty()) {
+            throw std::runtime_error("The analyte and titrant files must each define a mixture");
+        }
+
+        std::vector<Species> species = build_species<Species>(analyte.columns(), 0, make_species);
+        size_t n_analyte = species.size();
+        std::vector<Species> added = build_species<Species>(titrant.columns(), 0, make_species);
+        species.insert(species.end(), added.begin(), added.end());
+
+        std::vector<double> nominal;
+        for (const auto &s : species) {
+            nominal.push_back(s.get_conc());
+        }
+
+        FILE *out = fopen(argv[4], "w");
+        if (!out) {
+            throw std::runtime_error(std::string("Cannot open ") + argv[4]);
+        }
+        fprintf(out, "volume,pH,dpH_dV,evaluations\n");
+
+        Calc calc(species, Kw);
+        TitrationStats stats = titrate(calc, nominal, n_analyte, options, [out](const TitrationPoint &p) {
+            fprintf(out, "%.9g,%.12f,%.6e,%d\n", p.volume, p.pH, p.dpH_dV, p.evaluations);
+        });
+        fclose(out);
+
+        for (const auto &eq : stats.equivalence) {
+            fprintf(stderr, "Equivalence point at V = %.6g, pH = %.4f\n", eq.volume, eq.pH);
+        }
+        fprintf(stderr, "Solved %zu points (%zu failed) in %.3f s: %.1f evaluations and %.2f us per point\n", stats.points,
+                stats.failed, stats.seconds, stats.points ? double(stats.evaluations) / stats.points : 0.0,
+                stats.points ? 1e6 * stats.seconds / stats.points : 0.0);
+        return stats.failed ? 2 : 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_TITRATION_H
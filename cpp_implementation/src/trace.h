@@ -0,0 +1,348 @@
+#ifndef PH_TRACE_H
+#define PH_TRACE_H
+
+// Solver instrumentation, compiled in with -DPH_TRACE (make TRACE=1) and absent otherwise:
+// without the flag this header defines nothing and the hooks in solver.h and balance.h are
+// preprocessed away.
+//
+// Every solve of a BalanceCalc is recorded with its counters: residual evaluations, those
+// spent bracketing the root, Newton / bisection iterations, the final residual, wall time and
+// heap allocations. Each solve also records its steps, the bracket it found and every
+// polishing iteration with pH, residual and slope, like a debugger printf per iteration.
+// Steps go into a per-solve buffer on the stack and are copied into process-wide ring buffers
+// under one lock when the solve ends, so the cost inside the solver is a clock read and a
+// store per step; a clock read costs 20 to 50 ns, so on small mixtures the steps can double
+// the solve time, and recording them can be turned off (Tracer::set_record_steps) where only
+// the counters are wanted. When the rings are full the oldest records are overwritten.
+//
+// The recorded solves are exported as CSV (counters), JSON (counters and steps) or the
+// Chrome trace format (chrome://tracing, Perfetto), see Tracer::write.
+//
+// Allocations are counted by replacing the global operator new, which a program does by
+// defining PH_TRACE_MAIN in exactly one translation unit before including this header.
+
+#ifdef PH_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum TraceStepKind { kTraceBracket, kTraceNewton, kTraceBisection };
+
+inline const char *trace_step_name(int kind) {
+    switch (kind) {
+        case kTraceBracket: return "bracket";
+        case kTraceNewton: return "newton";
+        default: return "bisection";
+    }
+}
+
+struct TraceStep {
+    uint64_t solve;
+    uint64_t t_ns;  // since the tracer started
+    uint32_t thread;
+    int kind;       // TraceStepKind
+    double pH, residual, slope;
+};
+
+struct TraceSolve {
+    uint64_t id;
+    uint64_t start_ns, wall_ns;
+    uint32_t thread;
+    size_t n_species;
+    int evaluations;
+    int bracket_evaluations;
+    int iterations;
+    double pH;
+    double residual;
+    bool converged;
+    uint64_t allocations;
+};
+
+// Allocations made by the calling thread, counted while PH_TRACE_MAIN hooks are linked in.
+inline uint64_t &trace_thread_allocations() {
+    static thread_local uint64_t count = 0;
+    return count;
+}
+
+inline uint32_t trace_thread_id() {
+    static std::atomic<uint32_t> next(0);
+    static thread_local uint32_t id = next++;
+    return id;
+}
+
+// Process-wide store of the recorded solves and steps.
+class Tracer {
+   public:
+    static Tracer &instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    uint64_t now_ns() const {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+    }
+
+    uint64_t next_id() {
+        return ++last_id;
+    }
+
+    // Ring sizes in records; clears what was recorded.
+    void set_capacity(size_t solves, size_t steps) {
+        std::lock_guard<std::mutex> lock(mutex);
+        solve_ring.assign(std::max<size_t>(solves, 1), TraceSolve());
+        step_ring.assign(std::max<size_t>(steps, 1), TraceStep());
+        n_solves = n_steps = 0;
+    }
+
+    // Whether solves record their steps; on by default.
+    void set_record_steps(bool on) {
+        record_steps = on;
+    }
+
+    bool get_record_steps() const {
+        return record_steps;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_solves = n_steps = 0;
+    }
+
+    void record(const TraceSolve &solve, const TraceStep *steps, size_t n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        solve_ring[n_solves++ % solve_ring.size()] = solve;
+        for (size_t i = 0; i < n; ++i) {
+            step_ring[n_steps++ % step_ring.size()] = steps[i];
+        }
+    }
+
+    // Oldest first.
+    std::vector<TraceSolve> solves() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return unroll(solve_ring, n_solves);
+    }
+
+    std::vector<TraceStep> steps() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return unroll(step_ring, n_steps);
+    }
+
+    // Records lost to the rings so far.
+    uint64_t dropped_solves() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_solves > solve_ring.size() ? n_solves - solve_ring.size() : 0;
+    }
+
+    uint64_t dropped_steps() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_steps > step_ring.size() ? n_steps - step_ring.size() : 0;
+    }
+
+    // `format` is "csv", "json" or "chrome".
+    void write(const std::string &path, const std::string &format) const {
+        if (format != "csv" && format != "json" && format != "chrome") {
+            throw std::invalid_argument("Unknown trace format '" + format + "'; use csv, json or chrome");
+        }
+        FILE *out = fopen(path.c_str(), "w");
+        if (!out) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        if (format == "csv") {
+            write_csv(out);
+        } else if (format == "json") {
+            write_json(out);
+        } else {
+            write_chrome(out);
+        }
+        fclose(out);
+    }
+
+    void write_csv(FILE *out) const {
+        fprintf(out, "solve,thread,species,start_us,wall_us,evaluations,bracket_evaluations,iterations,pH,residual,converged,"
+                     "allocations\n");
+        for (const TraceSolve &s : solves()) {
+            fprintf(out, "%llu,%u,%zu,%.3f,%.3f,%d,%d,%d,%.12f,%.6e,%d,%llu\n", static_cast<unsigned long long>(s.id),
+                    s.thread, s.n_species, s.start_ns * 1e-3, s.wall_ns * 1e-3, s.evaluations, s.bracket_evaluations,
+                    s.iterations, s.pH, s.residual, s.converged ? 1 : 0, static_cast<unsigned long long>(s.allocations));
+        }
+    }
+
+    void write_json(FILE *out) const {
+        fprintf(out, "{\"dropped_solves\": %llu, \"dropped_steps\": %llu,\n \"solves\": [",
+                static_cast<unsigned long long>(dropped_solves()), static_cast<unsigned long long>(dropped_steps()));
+        const char *sep = "\n  ";
+        for (const TraceSolve &s : solves()) {
+            fprintf(out,
+                    "%s{\"solve\": %llu, \"thread\": %u, \"species\": %zu, \"start_us\": %.3f, \"wall_us\": %.3f, "
+                    "\"evaluations\": %d, \"bracket_evaluations\": %d, \"iterations\": %d, \"pH\": %.12f, "
+                    "\"residual\": %.6e, \"converged\": %s, \"allocations\": %llu}",
+                    sep, static_cast<unsigned long long>(s.id), s.thread, s.n_species, s.start_ns * 1e-3, s.wall_ns * 1e-3,
+                    s.evaluations, s.bracket_evaluations, s.iterations, s.pH, s.residual, s.converged ? "true" : "false",
+                    static_cast<unsigned long long>(s.allocations));
+            sep = ",\n  ";
+        }
+        fprintf(out, "],\n \"steps\": [");
+        sep = "\n  ";
+        for (const TraceStep &t : steps()) {
+            fprintf(out, "%s{\"solve\": %llu, \"t_us\": %.3f, \"kind\": \"%s\", \"pH\": %.12f, \"residual\": %.6e, \"slope\": %.6e}",
+                    sep, static_cast<unsigned long long>(t.solve), t.t_ns * 1e-3, trace_step_name(t.kind), t.pH, t.residual,
+                    t.slope);
+            sep = ",\n  ";
+        }
+        fprintf(out, "]}\n");
+    }
+
+    // Solves as complete events on the thread that ran them, steps as instant events.
+    void write_chrome(FILE *out) const {
+        fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+        const char *sep = "\n";
+        for (const TraceSolve &s : solves()) {
+            fprintf(out,
+                    "%s{\"name\": \"solve\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"solve\": %llu, \"species\": %zu, \"evaluations\": %d, \"iterations\": %d, \"pH\": %.12f, "
+                    "\"converged\": %s, \"allocations\": %llu}}",
+                    sep, s.thread, s.start_ns * 1e-3, s.wall_ns * 1e-3, static_cast<unsigned long long>(s.id), s.n_species,
+                    s.evaluations, s.iterations, s.pH, s.converged ? "true" : "false",
+                    static_cast<unsigned long long>(s.allocations));
+            sep = ",\n";
+        }
+        for (const TraceStep &t : steps()) {
+            fprintf(out,
+                    "%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+                    "\"args\": {\"solve\": %llu, \"pH\": %.12f, \"residual\": %.6e, \"slope\": %.6e}}",
+                    sep, trace_step_name(t.kind), t.thread, t.t_ns * 1e-3, static_cast<unsigned long long>(t.solve), t.pH,
+                    t.residual, t.slope);
+            sep = ",\n";
+        }
+        fprintf(out, "\n]}\n");
+    }
+
+   private:
+    Tracer() : epoch(std::chrono::steady_clock::now()), last_id(0), record_steps(true), n_solves(0), n_steps(0) {
+        solve_ring.resize(1 << 16);
+        step_ring.resize(1 << 20);
+    }
+
+    template <class T>
+    static std::vector<T> unroll(const std::vector<T> &ring, uint64_t n) {
+        std::vector<T> out;
+        uint64_t first = n > ring.size() ? n - ring.size() : 0;
+        for (uint64_t i = first; i < n; ++i) {
+            out.push_back(ring[i % ring.size()]);
+        }
+        return out;
+    }
+
+    const std::chrono::steady_clock::time_point epoch;
+    std::atomic<uint64_t> last_id;
+    std::atomic<bool> record_steps;
+    mutable std::mutex mutex;
+    std::vector<TraceSolve> solve_ring;
+    std::vector<TraceStep> step_ring;
+    uint64_t n_solves, n_steps;  // ever recorded
+};
+
+// Records one solve: lives on the stack of the solve, and is the target of the step hooks
+// of the solver on the same thread while it does.
+class TraceScope {
+   public:
+    explicit TraceScope(size_t n_species)
+        : tracer(Tracer::instance()), parent(current_ref()), record_steps(tracer.get_record_steps()), n_steps(0) {
+        solve.id = tracer.next_id();
+        solve.thread = trace_thread_id();
+        solve.n_species = n_species;
+        solve.allocations = trace_thread_allocations();
+        solve.start_ns = tracer.now_ns();
+        current_ref() = this;
+    }
+
+    ~TraceScope() {
+        current_ref() = parent;
+    }
+
+    // The scope of the solve running on this thread, null outside solves.
+    static TraceScope *current() {
+        return current_ref();
+    }
+
+    void step(int kind, double pH, double residual, double slope) {
+        if (record_steps && n_steps < kMaxSteps) {
+            TraceStep &t = steps[n_steps];
+            t.solve = solve.id;
+            t.t_ns = tracer.now_ns();
+            t.thread = solve.thread;
+            t.kind = kind;
+            t.pH = pH;
+            t.residual = residual;
+            t.slope = slope;
+            ++n_steps;
+        }
+    }
+
+    template <class Result>
+    void finish(const Result &result) {
+        solve.wall_ns = tracer.now_ns() - solve.start_ns;
+        solve.allocations = trace_thread_allocations() - solve.allocations;
+        solve.evaluations = result.evaluations;
+        solve.bracket_evaluations = result.bracket_evaluations;
+        solve.iterations = result.iterations;
+        solve.pH = result.pH;
+        solve.residual = result.residual;
+        solve.converged = result.converged;
+        tracer.record(solve, steps, n_steps);
+    }
+
+   private:
+    static const size_t kMaxSteps = 128;  // the bracket and up to 100 iterations fit
+
+    static TraceScope *&current_ref() {
+        static thread_local TraceScope *scope = nullptr;
+        return scope;
+    }
+
+    Tracer &tracer;
+    TraceScope *parent;
+    bool record_steps;
+    TraceSolve solve;
+    TraceStep steps[kMaxSteps];
+    size_t n_steps;
+};
+
+inline void trace_step(int kind, double pH, double residual, double slope) {
+    if (TraceScope *scope = TraceScope::current()) {
+        scope->step(kind, pH, residual, slope);
+    }
+}
+
+#ifdef PH_TRACE_MAIN
+void *operator new(size_t size) {
+    ++trace_thread_allocations();
+    void *p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+#endif  // PH_TRACE_MAIN
+
+#endif  // PH_TRACE
+
+#endif  // PH_TRACE_H
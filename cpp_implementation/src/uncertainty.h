@@ -0,0 +1,367 @@
+#ifndef PH_UNCERTAINTY_H
+#define PH_UNCERTAINTY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "alpha.h"
+#include "batch.h"
+#include "cli.h"
+#include "mixture_io.h"
+#include "parallel.h"
+
+// Monte Carlo propagation of the uncertainty of the constants and concentrations into the pH.
+// Every sample draws each pKa from a normal distribution around its nominal value with
+// standard deviation pka_sd, and each concentration from one with relative standard deviation
+// conc_rsd (cut off at zero), and solves the perturbed mixture with a warm start from the
+// nominal pH.
+//
+// The random numbers are a hash of (seed, sample, draw) instead of a sequence, so a sample
+// sees the same values whichever thread solves it. Samples are solved in blocks of
+// kUncertaintyBlock, each on a private copy of the nominal calculator, and folded into
+// StreamingStats in sample order one window of blocks at a time: the results do not depend on
+// the thread count, and memory does not grow with the number of samples.
+
+const size_t kUncertaintyBlock = 256;
+const size_t kUncertaintyWindow = 64;  // blocks solved between two updates of the statistics
+const size_t kQuantilePilot = 4096;
+const size_t kQuantileBins = 8192;
+
+// The splitmix64 finalizer.
+inline uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Counter-based generator: the 64 random bits of draw `draw` of sample `sample`.
+inline uint64_t counter_random(uint64_t seed, uint64_t sample, uint64_t draw) {
+    return mix_bits(mix_bits(seed + 0x9E3779B97F4A7C15ULL * (sample + 1)) + 0xD1B54A32D192ED03ULL * (draw + 1));
+}
+
+// Standard normal value from the bits of draws 2 draw and 2 draw + 1 (Box-Muller).
+inline double counter_normal(uint64_t seed, uint64_t sample, uint64_t draw) {
+    const double unit = 1.0 / 9007199254740992.0;  // 2^-53
+    double u1 = static_cast<double>((counter_random(seed, sample, 2 * draw) >> 11) + 1) * unit;  // (0, 1]
+    double u2 = static_cast<double>(counter_random(seed, sample, 2 * draw + 1) >> 11) * unit;
+    return std::sqrt(-2.0 * std::log(u1)) * std::cos(6.283185307179586 * u2);
+}
+
+// Mean, standard deviation, extremes and quantiles of a stream of values in constant memory.
+// The first kQuantilePilot values are kept and give exact quantiles. After that the values
+// are counted into kQuantileBins bins over the range of the pilot widened by half of it on
+// either side, and quantiles are interpolated within a bin; the few values outside the bins
+// are counted between the bins and the extremes.
+class StreamingStats {
+   public:
+    StreamingStats()
+        : n(0),
+          mean(0.0),
+          m2(0.0),
+          min_value(std::numeric_limits<double>::infinity()),
+          max_value(-std::numeric_limits<double>::infinity()),
+          lo(0.0),
+          width(0.0),
+          below(0),
+          above(0) {}
+
+    void add(double x) {
+        // Welford's update.
+        ++n;
+        double d = x - mean;
+        mean += d / static_cast<double>(n);
+        m2 += d * (x - mean);
+        min_value = std::min(min_value, x);
+        max_value = std::max(max_value, x);
+
+        if (!bins.empty()) {
+            count(x);
+            return;
+        }
+        pilot.push_back(x);
+        if (pilot.size() == kQuantilePilot) {
+            double span = max_value - min_value;
+            if (!(span > 0.0)) {
+                span = std::max(std::fabs(min_value) * 1e-9, 1e-12);
+            }
+            lo = min_value - 0.5 * span;
+            width = 2.0 * span / static_cast<double>(kQuantileBins);
+            bins.assign(kQuantileBins, 0);
+            for (double v : pilot) {
+                count(v);
+            }
+            std::vector<double>().swap(pilot);
+        }
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    double get_mean() const {
+        return n ? mean : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    // Sample standard deviation.
+    double get_sd() const {
+        return n > 1 ? std::sqrt(m2 / static_cast<double>(n - 1)) : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    double get_min() const {
+        return n ? min_value : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    double get_max() const {
+        return n ? max_value : std::numeric_limits<double>::quiet_NaN();
+    }
+
+    // Quantile q in [0, 1], linearly interpolated.
+    double quantile(double q) const {
+        if (n == 0) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        if (bins.empty()) {
+            std::vector<double> sorted(pilot);
+            std::sort(sorted.begin(), sorted.end());
+            double h = q * static_cast<double>(n - 1);
+            size_t i = std::min(static_cast<size_t>(h), n - 1);
+            size_t j = std::min(i + 1, n - 1);
+            return sorted[i] + (h - static_cast<double>(i)) * (sorted[j] - sorted[i]);
+        }
+
+        double target = q * static_cast<double>(n);
+        if (below > 0 && target <= static_cast<double>(below)) {
+            return min_value + target / static_cast<double>(below) * (lo - min_value);
+        }
+        double cumulative = static_cast<double>(below);
+        for (size_t b = 0; b < kQuantileBins; ++b) {
+            double c = static_cast<double>(bins[b]);
+            if (c > 0 && cumulative + c >= target) {
+                return lo + width * (static_cast<double>(b) + (target - cumulative) / c);
+            }
+            cumulative += c;
+        }
+        double hi = lo + width * static_cast<double>(kQuantileBins);
+        return above > 0 ? hi + (target - cumulative) / static_cast<double>(above) * (max_value - hi) : max_value;
+    }
+
+   private:
+    void count(double x) {
+        double u = (x - lo) / width;
+        if (u < 0.0) {
+            below++;
+        } else if (u >= static_cast<double>(kQuantileBins)) {
+            above++;
+        } else {
+            bins[static_cast<size_t>(u)]++;
+        }
+    }
+
+    size_t n;
+    double mean, m2;
+    double min_value, max_value;
+    std::vector<double> pilot;
+    double lo, width;  // of the bins
+    std::vector<uint64_t> bins;
+    uint64_t below, above;
+};
+
+struct UncertaintyOptions {
+    size_t samples;
+    uint64_t seed;
+    double pka_sd;    // standard deviation of every pKa
+    double conc_rsd;  // relative standard deviation of every concentration
+    std::vector<double> quantiles;
+    unsigned threads;
+    double Kw;  // used for mixtures without their own Kw
+    double tol;
+
+    UncertaintyOptions()
+        : samples(10000), seed(1), pka_sd(0.02), conc_rsd(0.01), quantiles({0.025, 0.5, 0.975}),
+          threads(default_thread_count()), Kw(1.01e-14), tol(1e-12) {}
+};
+
+struct UncertaintyResult {
+    double nominal_pH;
+    StreamingStats pH;  // of the converged samples
+    size_t failed;      // samples that did not converge
+
+    UncertaintyResult() : nominal_pH(std::numeric_limits<double>::quiet_NaN()), failed(0) {}
+};
+
+// Propagates the uncertainty of `species` into the pH; `seed` selects the random draws. The
+// draws of a sample go species by species, one per pKa and then one for the concentration.
+template <class Calc, class Species>
+UncertaintyResult propagate_uncertainty(const std::vector<Species> &species, double Kw, uint64_t seed,
+                                        const UncertaintyOptions &options) {
+    UncertaintyResult result;
+    const Calc nominal_calc(species, Kw);
+    SolveResult nominal = nominal_calc.solve(7.0, false, 0, options.tol);
+    if (!nominal.converged) {
+        throw std::runtime_error("The nominal mixture did not converge.");
+    }
+    result.nominal_pH = nominal.pH;
+
+    std::vector<std::vector<double>> nominal_pKa;
+    for (const auto &s : species) {
+        nominal_pKa.push_back(s.pKa_at(nominal_calc.get_temperature()));
+    }
+
+    const size_t window = kUncertaintyWindow * kUncertaintyBlock;
+    std::vector<double> sample_pH(std::min(window, options.samples));
+    for (size_t first = 0; first < options.samples; first += window) {
+        const size_t n = std::min(window, options.samples - first);
+        parallel_for(0, (n + kUncertaintyBlock - 1) / kUncertaintyBlock, options.threads, [&](size_t b) {
+            Calc calc(nominal_calc);
+            double pKa[kMaxAlphaTerms];
+            for (size_t j = b * kUncertaintyBlock; j < std::min((b + 1) * kUncertaintyBlock, n); ++j) {
+                uint64_t sample = first + j;
+                uint64_t draw = 0;
+                for (size_t s = 0; s < species.size(); ++s) {
+                    for (size_t i = 0; i < nominal_pKa[s].size(); ++i) {
+                        pKa[i] = nominal_pKa[s][i] + options.pka_sd * counter_normal(seed, sample, draw++);
+                    }
+                    calc.set_pKa(s, pKa);
+                    double z = counter_normal(seed, sample, draw++);
+                    calc.set_conc(s, std::max(0.0, species[s].get_conc() * (1.0 + options.conc_rsd * z)));
+                }
+                SolveResult r = calc.solve_warm(nominal.pH, 0.05, options.tol);
+                sample_pH[j] = r.converged ? r.pH : std::numeric_limits<double>::quiet_NaN();
+            }
+        }, 1);
+        for (size_t j = 0; j < n; ++j) {
+            if (std::isnan(sample_pH[j])) {
+                result.failed++;
+            } else {
+                result.pH.add(sample_pH[j]);
+            }
+        }
+    }
+    return result;
+}
+
+// Comma-separated list of quantiles in [0, 1], e.g. "0.025,0.5,0.975".
+inline std::vector<double> parse_quantile_list(const std::string &list) {
+    std::vector<double> quantiles;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        char *end = nullptr;
+        double q = std::strtod(item.c_str(), &end);
+        if (end == item.c_str() || *end != '\0' || !(q >= 0.0 && q <= 1.0)) {
+            throw std::invalid_argument("Invalid quantile '" + item + "'");
+        }
+        quantiles.push_back(q);
+    }
+    if (quantiles.empty()) {
+        throw std::invalid_argument("No quantile given");
+    }
+    return quantiles;
+}
+
+inline void print_uncertainty_usage(const char *program) {
+    fprintf(stderr, "Usage: %s --uncertainty <input> <output> [--samples N] [--seed S] [--pka-sd sd] [--conc-rsd rsd]\n",
+            program);
+    fprintf(stderr, "           [--quantiles q1,q2,...] [--threads N] [--kw Kw]\n");
+    fprintf(stderr, "Propagates normal errors of every pKa (default sd 0.02) and concentration (default relative\n");
+    fprintf(stderr, "sd 0.01) of every mixture of a batch input into the pH by Monte Carlo sampling (default 10000\n");
+    fprintf(stderr, "samples) and writes the mean, sd, extremes and quantiles (default 0.025,0.5,0.975) of the pH.\n");
+}
+
+// Command-line entry point of the uncertainty mode, shared by the CBE and PBE executables.
+template <class Calc, class Species, class Factory>
+int uncertainty_main(int argc, char **argv, int n_weights, const Factory &make_species) {
+    if (argc < 4) {
+        print_uncertainty_usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        UncertaintyOptions options;
+        for (int i = 4; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--samples" && i + 1 < argc) {
+                options.samples = static_cast<size_t>(option_integer(arg, argv[++i], 1));
+            } else if (arg == "--seed" && i + 1 < argc) {
+                options.seed = option_integer(arg, argv[++i], 0);
+            } else if (arg == "--pka-sd" && i + 1 < argc) {
+                options.pka_sd = option_nonnegative(arg, argv[++i]);
+            } else if (arg == "--conc-rsd" && i + 1 < argc) {
+                options.conc_rsd = option_nonnegative(arg, argv[++i]);
+            } else if (arg == "--quantiles" && i + 1 < argc) {
+                options.quantiles = parse_quantile_list(argv[++i]);
+            } else if (arg == "--threads" && i + 1 < argc) {
+                options.threads = option_threads(arg, argv[++i]);
+            } else if (arg == "--kw" && i + 1 < argc) {
+                options.Kw = option_positive(arg, argv[++i]);
+            } else {
+                print_uncertainty_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        MixtureTable table;
+        std::unique_ptr<MappedMixtures> mapped;
+        MixtureColumns c;
+        if (is_mixture_binary(argv[2])) {
+            mapped.reset(new MappedMixtures(argv[2]));
+            c = mapped->columns();
+        } else {
+            table = read_mixtures_csv(argv[2], n_weights);
+            c = table.columns();
+        }
+
+        FILE *out = fopen(argv[3], "w");
+        if (!out) {
+            throw std::runtime_error(std::string("Cannot open ") + argv[3]);
+        }
+        fprintf(out, "mixture,nominal_pH,mean,sd,min,max");
+        for (double q : options.quantiles) {
+            fprintf(out, ",q%g", q);
+        }
+        fprintf(out, ",samples,failed\n");
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t m = 0; m < c.n_mixtures; ++m) {
+            UncertaintyResult result;
+            result.failed = options.samples;
+            try {
+                std::vector<Species> species = build_species<Species>(c, m, make_species);
+                uint64_t seed = counter_random(options.seed, c.mixture_id[m], 0);
+                result = propagate_uncertainty<Calc>(species, c.Kw && c.Kw[m] > 0 ? c.Kw[m] : options.Kw, seed, options);
+            } catch (const std::exception &) {
+                // reported as a row of NaN with every sample failed
+            }
+            const StreamingStats &pH = result.pH;
+            fprintf(out, "%llu,%.6f,%.6f,%.6f,%.6f,%.6f", (unsigned long long)c.mixture_id[m], result.nominal_pH,
+                    pH.get_mean(), pH.get_sd(), pH.get_min(), pH.get_max());
+            for (double q : options.quantiles) {
+                fprintf(out, ",%.6f", pH.quantile(q));
+            }
+            fprintf(out, ",%zu,%zu\n", pH.size(), result.failed);
+        }
+        fclose(out);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double solves = static_cast<double>(c.n_mixtures) * static_cast<double>(options.samples);
+        fprintf(stderr, "Propagated %llu mixtures with %zu samples each in %.3f s: %.1f k solves/s\n",
+                (unsigned long long)c.n_mixtures, options.samples, seconds, seconds > 0 ? solves / seconds * 1e-3 : 0.0);
+        return 0;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+}
+
+#endif  // PH_UNCERTAINTY_H
@@ -0,0 +1,144 @@
+// Follows a MixtureHandle through a fixed sequence of random edits and compares it after each
+// one with a calculator built afresh from the same species: the pH of the re-solve, the
+// residual and slope the handle carries, and the residual of the other balance, which reads
+// the second set of weights that System::remove_species moves along with the first. Species
+// have one to three constants, so removals land in the middle of groups of several.
+// Build with: g++ -std=c++11 -Isrc tests/mixture_handle_test.cpp
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "CBE.h"
+#include "PBE.h"
+#include "mixture_handle.h"
+
+namespace {
+
+const double kPHTolerance = 1e-11;
+const double kResidualTolerance = 1e-12;  // relative to the total concentration
+
+Acid make_species(const std::vector<double> &pKa, int charge, int proton, double conc, Acid *) {
+    Acid acid({}, pKa, charge, conc);
+    acid.set_protons(proton, 0);
+    return acid;
+}
+
+PBE_Acid make_species(const std::vector<double> &pKa, int charge, int proton, double conc, PBE_Acid *) {
+    PBE_Acid acid({}, pKa, proton, 0, conc);
+    acid.set_charge(charge);
+    return acid;
+}
+
+template <class Calc, class Species>
+class HandleTest {
+   public:
+    explicit HandleTest(unsigned seed) : rng(seed), Kw(1.01e-14), checks(0) {}
+
+    // Returns false on the first disagreement, after reporting it.
+    bool run(const char *name, int steps) {
+        for (int i = 0; i < 9; ++i) {
+            add();
+        }
+        // Species 1, 4 and 7 have two constants; the middle one goes first.
+        remove(4);
+        if (!compare(name, "remove")) {
+            return false;
+        }
+        for (int step = 0; step < steps; ++step) {
+            unsigned op = rng() % 8;
+            const char *what;
+            if (op < 2 || species.size() < 3) {
+                add();
+                what = "add";
+            } else if (op < 4) {
+                remove(1 + rng() % (species.size() - 2));  // never the first or last
+                what = "remove";
+            } else if (op < 7) {
+                size_t index = rng() % species.size();
+                double conc = uniform(0.0, 0.05);
+                species[index].set_conc(conc);
+                handle.set_conc(index, conc);
+                what = "set_conc";
+            } else {
+                Kw = 1.01e-14 * uniform(0.5, 2.0);
+                handle.set_Kw(Kw);
+                what = "set_Kw";
+            }
+            if (!compare(name, what)) {
+                return false;
+            }
+        }
+        printf("%s: %zu edits agree with fresh solves\n", name, checks);
+        return true;
+    }
+
+   private:
+    double uniform(double lo, double hi) {
+        return lo + (hi - lo) * (rng() / 4294967296.0);
+    }
+
+    void add() {
+        // Constants in the order given, as the species database keeps them: ascending pKa.
+        size_t n = 1 + species.size() % 3;
+        std::vector<double> pKa;
+        double p = uniform(1.0, 4.0);
+        for (size_t i = 0; i < n; ++i) {
+            pKa.push_back(p);
+            p += uniform(1.5, 4.0);
+        }
+        int proton = static_cast<int>(n);
+        int charge = static_cast<int>(rng() % 3) - 1;
+        species.push_back(make_species(pKa, charge, proton, uniform(0.001, 0.05), static_cast<Species *>(nullptr)));
+        handle.add_species(species.back());
+    }
+
+    void remove(size_t index) {
+        species.erase(species.begin() + index);
+        handle.remove_species(index);
+    }
+
+    bool compare(const char *name, const char *what) {
+        Calc fresh(species, Kw);
+        SolveResult expected = fresh.solve(7.0, true, 0, 1e-12);
+        const SolveResult &got = handle.solve();
+
+        double total = 0.0;
+        for (const auto &s : species) {
+            total += s.get_conc();
+        }
+        double scale = 4.0 * total + 1e-7;
+
+        double d_pH = std::fabs(got.pH - expected.pH);
+        double res_expected, slope_expected;
+        res_expected = fresh.residual(got.pH, &slope_expected);
+        double d_res = std::fabs(got.residual - res_expected) / scale;
+        double d_slope = std::fabs(got.slope - slope_expected) / (std::fabs(slope_expected) + scale);
+        double d_other =
+            std::fabs(handle.get_calc().check_balance(expected).residual - fresh.check_balance(expected).residual) / scale;
+
+        checks++;
+        if (!got.converged || !expected.converged || d_pH > kPHTolerance || d_res > kResidualTolerance ||
+            d_slope > kResidualTolerance || d_other > kResidualTolerance) {
+            printf("%s: after %s number %zu with %zu species: pH %.15f, fresh %.15f; residual off by %.2e, slope by "
+                   "%.2e, other balance by %.2e\n",
+                   name, what, checks, species.size(), got.pH, expected.pH, d_res, d_slope, d_other);
+            return false;
+        }
+        return true;
+    }
+
+    std::mt19937 rng;
+    double Kw;
+    std::vector<Species> species;
+    MixtureHandle<Calc, Species> handle;
+    size_t checks;
+};
+
+}  // namespace
+
+int main() {
+    bool ok = HandleTest<CBE_calc, Acid>(7).run("CBE", 400);
+    ok = HandleTest<PBE_calc, PBE_Acid>(11).run("PBE", 400) && ok;
+    return ok ? 0 : 1;
+}